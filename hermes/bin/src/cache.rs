@@ -0,0 +1,101 @@
+//! On-disk cache of app components compiled ahead of time.
+//!
+//! Compiled components are stored under a name made of the hash of the component and
+//! the compatibility hash of the engine, which covers the wasmtime version, the engine
+//! configuration and the CPU features the code is compiled for. A cached component is
+//! mapped into memory directly, without being compiled or copied.
+
+use std::{
+    fs,
+    hash::{Hash, Hasher},
+    path::{Path, PathBuf},
+};
+
+use anyhow::Result;
+use pallas::crypto::hash::Hasher as Blake2b;
+use wasmtime::{component::Component, Engine};
+
+/// Extension of the cached components.
+const EXTENSION: &str = "cwasm";
+
+/// Cache of compiled components for an engine.
+///
+/// Cached components are trusted to have been compiled by the node, so the cache
+/// directory must not be writable by anyone else.
+pub(crate) struct ComponentCache {
+    /// Directory of the cache.
+    dir: PathBuf,
+    /// Hex encoded compatibility hash of the engine.
+    engine_hash: String,
+}
+
+impl ComponentCache {
+    /// Opens the cache in `dir`, creating it if needed.
+    pub(crate) fn open(dir: impl Into<PathBuf>, engine: &Engine) -> Result<Self> {
+        let dir = dir.into();
+        fs::create_dir_all(&dir)?;
+
+        let mut hasher = DigestHasher(Blake2b::<256>::new());
+        engine.precompile_compatibility_hash().hash(&mut hasher);
+
+        Ok(Self {
+            dir,
+            engine_hash: hasher.0.finalize().to_string(),
+        })
+    }
+
+    /// Returns the compiled component of `bytes`, compiling and caching it if it isn't
+    /// cached yet.
+    pub(crate) fn load(&self, engine: &Engine, bytes: &[u8]) -> Result<Component> {
+        let path = self.path(bytes);
+
+        if path.exists() {
+            match Self::deserialize(engine, &path) {
+                Ok(component) => return Ok(component),
+                // Replaced below, it was likely left incomplete.
+                Err(_) => fs::remove_file(&path)?,
+            }
+        }
+
+        // Written to a temporary file first, so a concurrent node never maps a
+        // partially written component.
+        let compiled = engine.precompile_component(bytes)?;
+        let tmp = path.with_extension(format!("{EXTENSION}.{}.tmp", std::process::id()));
+        fs::write(&tmp, compiled)?;
+        fs::rename(&tmp, &path)?;
+
+        Self::deserialize(engine, &path)
+    }
+
+    /// Returns the path of the compiled component of `bytes`.
+    fn path(&self, bytes: &[u8]) -> PathBuf {
+        let component_hash = Blake2b::<256>::hash(bytes);
+        self.dir
+            .join(format!("{component_hash}-{}", self.engine_hash))
+            .with_extension(EXTENSION)
+    }
+
+    /// Maps the compiled component at `path`.
+    fn deserialize(engine: &Engine, path: &Path) -> Result<Component> {
+        // SAFETY: the file was written by `precompile_component`, as the cache directory
+        // is only written by the node.
+        unsafe { Component::deserialize_file(engine, path) }
+    }
+}
+
+/// Feeds whatever is hashed into a Blake2b digest.
+///
+/// Unlike `DefaultHasher`, the digest doesn't change between Rust releases and is too
+/// long for two engines to share by accident.
+struct DigestHasher(Blake2b<256>);
+
+impl Hasher for DigestHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        self.0.input(bytes);
+    }
+
+    /// Not meaningful, only the digest is used.
+    fn finish(&self) -> u64 {
+        0
+    }
+}
@@ -0,0 +1,342 @@
+//! Chain events delivered to the apps, see the `hermes:cardano` WIT package.
+//!
+//! Blocks are passed to the apps as resources backed by the followed block data, so an
+//! app only copies into its memory the transactions it reads, however large the block.
+
+use std::sync::{Arc, Mutex};
+
+use anyhow::{anyhow, Result};
+use cardano_chain_follower::{ChainUpdate, MultiEraBlockData, Point};
+use pallas::{crypto::hash::Hash, ledger::traverse};
+use wasmtime::component::Resource;
+use wasmtime_wasi::preview2::WasiView;
+
+use self::hermes::cardano::block::{self, Era};
+use crate::{
+    dispatcher::{AppHandler, Failure, Invocation},
+    metrics::{self, HostCall, Timer},
+    runtime::{App, AppInstance, AppState, Runtime},
+    sync::lock,
+};
+
+wasmtime::component::bindgen!({
+    path: "../wasm/crates/wasi/wit/deps/cardano",
+    world: "cardano-app",
+    async: {
+        only_imports: [],
+    },
+    with: {
+        "hermes:cardano/block/cardano-block": CardanoBlock,
+    },
+});
+
+/// A block passed to an app, with its header fields decoded ahead.
+pub(crate) struct CardanoBlock {
+    /// Data of the block, shared with the follower and the other apps.
+    data: MultiEraBlockData,
+    /// Era of the block.
+    era: Era,
+    /// Slot of the block.
+    slot: u64,
+    /// Height of the block.
+    height: u64,
+    /// Hash of the block header.
+    hash: Hash<32>,
+}
+
+impl CardanoBlock {
+    /// Decodes the header of a block to pass it to the apps.
+    pub(crate) fn new(data: MultiEraBlockData) -> Result<Self> {
+        let timer = Timer::start();
+        let (era, slot, height, hash) = {
+            let header = data
+                .header()
+                .map_err(|err| anyhow!("invalid block header: {err}"))?;
+            let era = data.era().map_err(|err| anyhow!("invalid block: {err}"))?;
+            (era, header.slot(), header.number(), header.hash())
+        };
+
+        let era = match era {
+            traverse::Era::Byron => Era::Byron,
+            traverse::Era::Shelley => Era::Shelley,
+            traverse::Era::Allegra => Era::Allegra,
+            traverse::Era::Mary => Era::Mary,
+            traverse::Era::Alonzo => Era::Alonzo,
+            traverse::Era::Babbage => Era::Babbage,
+            traverse::Era::Conway => Era::Conway,
+            _ => return Err(anyhow!("unsupported block era {era:?}")),
+        };
+
+        timer.observe(&metrics::BLOCK_DECODE);
+
+        Ok(Self {
+            data,
+            era,
+            slot,
+            height,
+            hash,
+        })
+    }
+
+    /// Returns the point of the block on chain.
+    pub(crate) fn point(&self) -> Point {
+        Point::Specific(self.slot, self.hash.to_vec())
+    }
+}
+
+impl block::Host for AppState {}
+
+impl block::HostCardanoBlock for AppState {
+    fn era(&mut self, block: Resource<CardanoBlock>) -> Result<Era> {
+        Ok(self.table().get(&block)?.era)
+    }
+
+    fn slot(&mut self, block: Resource<CardanoBlock>) -> Result<u64> {
+        Ok(self.table().get(&block)?.slot)
+    }
+
+    fn height(&mut self, block: Resource<CardanoBlock>) -> Result<u64> {
+        Ok(self.table().get(&block)?.height)
+    }
+
+    fn hash(&mut self, block: Resource<CardanoBlock>) -> Result<Vec<u8>> {
+        Ok(self.table().get(&block)?.hash.to_vec())
+    }
+
+    fn tx_count(&mut self, block: Resource<CardanoBlock>) -> Result<u32> {
+        HostCall::BlockTxCount.measure(|| {
+            let count = self
+                .table()
+                .get(&block)?
+                .data
+                .tx_count()
+                .map_err(|err| anyhow!("invalid block: {err}"))?;
+            Ok(u32::try_from(count)?)
+        })
+    }
+
+    fn tx(&mut self, block: Resource<CardanoBlock>, index: u32) -> Result<Option<Vec<u8>>> {
+        HostCall::BlockTx.measure(|| {
+            let tx = self
+                .table()
+                .get(&block)?
+                .data
+                .tx(usize::try_from(index)?)
+                .map_err(|err| anyhow!("invalid block: {err}"))?;
+            Ok(tx.map(|tx| tx.cbor().to_vec()))
+        })
+    }
+
+    fn drop(&mut self, block: Resource<CardanoBlock>) -> Result<()> {
+        self.table_mut().delete(block)?;
+        Ok(())
+    }
+}
+
+/// An instance of an app, with its chain event handlers.
+struct ChainAppInstance {
+    /// The instance.
+    instance: AppInstance,
+    /// Exports of the instance.
+    exports: CardanoApp,
+}
+
+impl ChainAppInstance {
+    /// Passes `updates` to the instance, one at a time, stopping at the first it fails
+    /// to handle.
+    async fn deliver(&mut self, updates: Vec<ChainUpdate>) -> std::result::Result<(), Failure> {
+        let mut updates = updates.into_iter();
+        while let Some(update) = updates.next() {
+            if let Err(error) = self.deliver_one(&update).await {
+                return Err(Failure::Update {
+                    error,
+                    undelivered: updates.collect(),
+                });
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Passes `update` to the instance.
+    async fn deliver_one(&mut self, update: &ChainUpdate) -> Result<()> {
+        let (ChainUpdate::Block(data) | ChainUpdate::Rollback(data)) = update;
+        let block = CardanoBlock::new(data.clone())?;
+        let point = block.point();
+
+        self.instance.start_invocation();
+        let store = &mut self.instance.store;
+
+        // The app handles a rollback with its store as it was after the block.
+        if let (ChainUpdate::Rollback(_), Some(kv)) = (update, store.data_mut().kv_mut()) {
+            if !kv.rewind(&point)? {
+                eprintln!(
+                    "Rollback to slot {} is older than the key-value store history",
+                    block.slot
+                );
+            }
+        }
+
+        let block = store.data_mut().table_mut().push(block)?;
+        let borrowed = Resource::new_borrow(block.rep());
+
+        let event = self.exports.hermes_cardano_event();
+        let res = match update {
+            ChainUpdate::Block(_) => event.call_on_block(&mut *store, borrowed).await,
+            ChainUpdate::Rollback(_) => event.call_on_rollback(&mut *store, borrowed).await,
+        };
+
+        store.data_mut().table_mut().delete(block)?;
+
+        // The writes made while handling the update are committed together.
+        let kv = store.data_mut().kv_mut();
+        match res {
+            Ok(()) => {
+                if let Some(kv) = kv {
+                    kv.commit(&point)?;
+                }
+                Ok(())
+            },
+            Err(err) => {
+                if let Some(kv) = kv {
+                    kv.rollback();
+                }
+                Err(err)
+            },
+        }
+    }
+}
+
+/// Handler running an app on the chain updates.
+///
+/// The app is instantiated on its first updates, and again after it failed to handle
+/// one, as a trapped instance can't be entered anymore. The updates after the failed
+/// one are handled by the new instance. An app that can't be instantiated is stopped.
+///
+/// The chain is followed from the block the furthest behind of the apps last handled,
+/// the blocks an app already handled before the node restarted are skipped.
+pub(crate) struct ChainApp {
+    /// Runtime hosting the app.
+    runtime: Arc<Runtime>,
+    /// The app.
+    app: Arc<App>,
+    /// Instance of the app, taken by the running invocation.
+    instance: Arc<Mutex<Option<ChainAppInstance>>>,
+    /// Last block the app handled, until it is followed past.
+    handled: Option<Point>,
+    /// Last block skipped, rolled back to if the chain turns out not to go through
+    /// `handled`.
+    skipped: Option<MultiEraBlockData>,
+}
+
+impl ChainApp {
+    /// Creates a handler running `app` on the chain followed from `start`.
+    pub(crate) fn new(runtime: Arc<Runtime>, app: Arc<App>, start: Option<&Point>) -> Self {
+        let handled = app.point().filter(|point| Some(point) != start);
+        Self {
+            runtime,
+            app,
+            instance: Arc::default(),
+            handled,
+            skipped: None,
+        }
+    }
+
+    /// Drops the block updates up to the last block the app handled.
+    fn skip_handled(&mut self, updates: Vec<ChainUpdate>) -> Vec<ChainUpdate> {
+        let Some(handled) = self.handled.clone() else {
+            return updates;
+        };
+
+        let mut updates = updates.into_iter();
+        let mut kept = Vec::new();
+        for update in updates.by_ref() {
+            // A rollback rewinds the app to a block of the followed chain anyway.
+            let point = match &update {
+                ChainUpdate::Block(data) => {
+                    data.header()
+                        .ok()
+                        .map(|header| Point::Specific(header.slot(), header.hash().to_vec()))
+                },
+                ChainUpdate::Rollback(_) => None,
+            };
+
+            match point {
+                Some(point) if point == handled => {
+                    self.handled = None;
+                    self.skipped = None;
+                    break;
+                },
+                Some(point) if slot(&point) < slot(&handled) => {
+                    if let ChainUpdate::Block(data) = update {
+                        self.skipped = Some(data);
+                    }
+                },
+                _ => {
+                    // The app handled blocks of a fork the chain no longer goes through.
+                    if point.is_some() {
+                        match self.skipped.take() {
+                            Some(data) => kept.push(ChainUpdate::Rollback(data)),
+                            None => {
+                                eprintln!(
+                                    "{} handled blocks not on the followed chain",
+                                    self.app.name()
+                                )
+                            },
+                        }
+                    }
+                    self.handled = None;
+                    self.skipped = None;
+                    kept.push(update);
+                    break;
+                },
+            }
+        }
+
+        kept.extend(updates);
+        kept
+    }
+}
+
+impl AppHandler for ChainApp {
+    fn name(&self) -> &str {
+        self.app.name()
+    }
+
+    fn handle(&mut self, updates: Vec<ChainUpdate>) -> Invocation {
+        let updates = self.skip_handled(updates);
+        if updates.is_empty() {
+            return Box::pin(async { Ok(()) });
+        }
+
+        let runtime = Arc::clone(&self.runtime);
+        let app = Arc::clone(&self.app);
+        let slot = Arc::clone(&self.instance);
+
+        Box::pin(async move {
+            let taken = lock(&slot).take();
+            let mut instance = match taken {
+                Some(instance) => instance,
+                None => {
+                    let mut instance = runtime.instantiate(&app).await.map_err(Failure::Fatal)?;
+                    let exports = CardanoApp::new(&mut instance.store, &instance.instance)
+                        .map_err(Failure::Fatal)?;
+                    ChainAppInstance { instance, exports }
+                },
+            };
+
+            instance.deliver(updates).await?;
+            *lock(&slot) = Some(instance);
+
+            Ok(())
+        })
+    }
+}
+
+/// Returns the slot of `point`, None for the origin, which comes before every slot.
+fn slot(point: &Point) -> Option<u64> {
+    match point {
+        Point::Origin => None,
+        Point::Specific(slot, _) => Some(*slot),
+    }
+}
@@ -0,0 +1,598 @@
+//! Dispatcher of chain updates to the apps.
+//!
+//! Every app has a mailbox of the updates it hasn't handled yet. An app with pending
+//! updates is scheduled on the run queue of a worker thread, and is never scheduled
+//! twice at once, so each app handles its updates in order while different apps run in
+//! parallel. Idle workers steal scheduled apps from the others, so a slow app holds a
+//! single worker while the other apps keep running on the rest.
+//!
+//! Handling updates is asynchronous: a worker polls the invocation of an app once, and
+//! an invocation that yields, because the app used up its time slice, is put back at the
+//! end of the run queue, behind the apps scheduled meanwhile. An app that is slow to
+//! handle an update thus only delays the other apps by a time slice, however long it
+//! runs for.
+//!
+//! The time workers spend polling the invocations of an app is accounted to it, which
+//! includes the host calls it makes but not the time it waits on the host.
+//!
+//! Mailboxes are bounded: once an app lags behind by a full mailbox, the dispatcher stops
+//! taking updates from the follower until the app catches up, so a slow app slows the
+//! node down instead of growing its mailbox without end.
+//!
+//! Workers poll the invocations within the Tokio runtime the node runs on, as the host
+//! futures rely on its timers and I/O.
+//!
+//! An invocation failing on an update gives back the updates it didn't get to, which are
+//! put back at the front of the mailbox, so the app still sees every update in order.
+//! An app that can't handle updates anymore, or that panics, is stopped without taking
+//! the worker down, and no longer gets updates.
+
+use std::{
+    collections::VecDeque,
+    future::{self, Future},
+    iter,
+    panic::{self, AssertUnwindSafe},
+    pin::Pin,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Condvar, Mutex, RwLock, RwLockReadGuard, Weak,
+    },
+    task::{Context, Poll, Wake, Waker},
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+
+use anyhow::{anyhow, Result};
+use cardano_chain_follower::{ChainUpdate, Follower};
+use crossbeam_deque::{Injector, Steal, Stealer, Worker};
+use tokio::{runtime::Handle, sync::Notify};
+
+use crate::{
+    metrics::{self, Collector, Counter, Encoder, Timer},
+    status::{Status, StatusSource},
+    sync::{self, lock},
+};
+
+/// How long an idle worker sleeps before looking for work again, which bounds the
+/// delay of a missed wake-up.
+const IDLE_TIMEOUT: Duration = Duration::from_millis(10);
+
+/// Capacity of the mailbox of an app, in batches of updates.
+const MAILBOX_BATCHES: usize = 8;
+
+/// Invocation of an app handling chain updates.
+pub(crate) type Invocation = Pin<Box<dyn Future<Output = std::result::Result<(), Failure>> + Send>>;
+
+/// Failure of an invocation.
+pub(crate) enum Failure {
+    /// The app failed to handle an update. The updates after it weren't handled, and
+    /// are passed to the next invocations.
+    Update {
+        /// Error handling the update.
+        error: anyhow::Error,
+        /// Updates not handled yet, in order.
+        undelivered: Vec<ChainUpdate>,
+    },
+    /// The app can't handle updates anymore.
+    Fatal(anyhow::Error),
+}
+
+/// Handler of the chain updates of an app.
+pub(crate) trait AppHandler: Send {
+    /// Returns the name of the app.
+    fn name(&self) -> &str;
+
+    /// Starts handling `updates`, which are either consecutive blocks or a single
+    /// rollback. Invocations of the same app never overlap.
+    fn handle(&mut self, updates: Vec<ChainUpdate>) -> Invocation;
+}
+
+/// An app subscribed to the dispatcher.
+struct AppSlot {
+    /// Name of the app.
+    name: String,
+    /// Updates the app hasn't handled yet.
+    mailbox: Mutex<VecDeque<ChainUpdate>>,
+    /// Whether the app is in a run queue or running.
+    scheduled: AtomicBool,
+    /// Whether the pending invocation of the app was woken since it was last polled.
+    woken: AtomicBool,
+    /// Handler of the app, only used by the worker running the app.
+    handler: Mutex<Box<dyn AppHandler>>,
+    /// Invocation of the app that yielded before completing.
+    invocation: Mutex<Option<Invocation>>,
+    /// Nanoseconds workers spent polling the invocations of the app.
+    busy: Counter,
+    /// Number of invocations of the app.
+    invocations: Counter,
+    /// Number of invocations of the app that failed.
+    failures: Counter,
+    /// Whether the last invocation of the app failed.
+    failing: AtomicBool,
+    /// Whether the app was stopped after a fatal failure.
+    stopped: AtomicBool,
+}
+
+/// Waker of the pending invocation of an app, scheduling the app again.
+struct AppWaker {
+    /// App of the invocation.
+    app: Arc<AppSlot>,
+    /// State of the dispatcher, which may be gone by the time the invocation is woken.
+    shared: Weak<Shared>,
+}
+
+impl Wake for AppWaker {
+    fn wake(self: Arc<Self>) {
+        self.wake_by_ref();
+    }
+
+    fn wake_by_ref(self: &Arc<Self>) {
+        self.app.woken.store(true, Ordering::Release);
+        if let Some(shared) = self.shared.upgrade() {
+            shared.schedule(&self.app);
+        }
+    }
+}
+
+/// State shared by the dispatcher and its workers.
+struct Shared {
+    /// Subscribed apps.
+    apps: RwLock<Vec<Arc<AppSlot>>>,
+    /// Apps scheduled by the dispatcher, taken by the workers in batches.
+    injector: Injector<Arc<AppSlot>>,
+    /// Stealers of the run queues of the workers.
+    stealers: Vec<Stealer<Arc<AppSlot>>>,
+    /// Maximum number of updates of one invocation of an app.
+    max_batch: usize,
+    /// Maximum number of updates in the mailbox of an app.
+    mailbox_capacity: usize,
+    /// Notified when updates are taken from a mailbox.
+    drained: Notify,
+    /// Whether the workers should stop once idle.
+    shutdown: Mutex<bool>,
+    /// Notified when apps are scheduled, and on shutdown.
+    wake: Condvar,
+}
+
+impl Shared {
+    /// Runs scheduled apps until shutdown.
+    fn work(self: &Arc<Self>, queue: &Worker<Arc<AppSlot>>) {
+        loop {
+            if let Some(app) = self.find(queue) {
+                self.run(&app, queue);
+                continue;
+            }
+
+            let shutdown = lock(&self.shutdown);
+            if *shutdown {
+                return;
+            }
+            if self.injector.is_empty() {
+                drop(self.wake.wait_timeout(shutdown, IDLE_TIMEOUT));
+            }
+        }
+    }
+
+    /// Finds a scheduled app in the worker's own queue first, then in the apps
+    /// scheduled by the dispatcher, then in the queues of the other workers.
+    fn find(&self, queue: &Worker<Arc<AppSlot>>) -> Option<Arc<AppSlot>> {
+        queue.pop().or_else(|| {
+            iter::repeat_with(|| {
+                self.injector
+                    .steal_batch_and_pop(queue)
+                    .or_else(|| self.stealers.iter().map(Stealer::steal).collect())
+            })
+            .find(|steal| !steal.is_retry())
+            .and_then(Steal::success)
+        })
+    }
+
+    /// Polls the pending invocation of `app`, or starts one on its next batch of
+    /// updates, and schedules it again if the invocation yielded or more updates are
+    /// pending.
+    fn run(self: &Arc<Self>, app: &Arc<AppSlot>, queue: &Worker<Arc<AppSlot>>) {
+        let mut pending = lock(&app.invocation);
+
+        let invocation = pending.take().or_else(|| {
+            let batch = take_batch(&mut lock(&app.mailbox), self.max_batch);
+            (!batch.is_empty()).then(|| {
+                self.drained.notify_waiters();
+                app.invocations.inc();
+                let mut handler = lock(&app.handler);
+                panic::catch_unwind(AssertUnwindSafe(|| handler.handle(batch))).unwrap_or_else(
+                    |_| Box::pin(future::ready(Err(Failure::Fatal(anyhow!("app panicked"))))),
+                )
+            })
+        });
+
+        if let Some(mut invocation) = invocation {
+            let timer = Timer::start();
+            app.woken.store(false, Ordering::Release);
+            let waker = Waker::from(Arc::new(AppWaker {
+                app: Arc::clone(app),
+                shared: Arc::downgrade(self),
+            }));
+
+            let poll = panic::catch_unwind(AssertUnwindSafe(|| {
+                invocation.as_mut().poll(&mut Context::from_waker(&waker))
+            }))
+            .unwrap_or_else(|_| Poll::Ready(Err(Failure::Fatal(anyhow!("app panicked")))));
+            if let Some(elapsed) = timer.elapsed() {
+                app.busy.add(metrics::nanos(elapsed));
+            }
+
+            match poll {
+                Poll::Ready(Err(Failure::Update { error, undelivered })) => {
+                    app.failures.inc();
+                    app.failing.store(true, Ordering::Relaxed);
+                    eprintln!("App {} failed to handle chain updates: {error:#}", app.name);
+
+                    let mut mailbox = lock(&app.mailbox);
+                    for update in undelivered.into_iter().rev() {
+                        mailbox.push_front(update);
+                    }
+                },
+                Poll::Ready(Err(Failure::Fatal(error))) => {
+                    app.failures.inc();
+                    app.failing.store(true, Ordering::Relaxed);
+                    app.stopped.store(true, Ordering::Release);
+                    eprintln!("App {} stopped: {error:#}", app.name);
+
+                    lock(&app.mailbox).clear();
+                    self.drained.notify_waiters();
+                },
+                Poll::Ready(Ok(())) => app.failing.store(false, Ordering::Relaxed),
+                Poll::Pending => *pending = Some(invocation),
+            }
+        }
+
+        let waiting = pending.is_some();
+        drop(pending);
+
+        // A yielding invocation wakes itself before returning, so it is resumed once
+        // the apps scheduled before it had their turn, while an invocation waiting on
+        // the host is resumed when woken. The app is checked after clearing the flag,
+        // so updates dispatched and wake-ups in between schedule the app exactly once,
+        // either here or in `schedule`.
+        app.scheduled.store(false, Ordering::Release);
+        let ready =
+            app.woken.load(Ordering::Acquire) || (!waiting && !lock(&app.mailbox).is_empty());
+        if ready && !app.scheduled.swap(true, Ordering::AcqRel) {
+            if waiting {
+                // Behind the apps the dispatcher scheduled, not just this worker's.
+                self.injector.push(Arc::clone(app));
+            } else {
+                queue.push(Arc::clone(app));
+            }
+        }
+    }
+
+    /// Schedules `app` unless it is already, waking a worker to run it.
+    fn schedule(&self, app: &Arc<AppSlot>) {
+        if !app.scheduled.swap(true, Ordering::AcqRel) {
+            self.injector.push(Arc::clone(app));
+
+            let _shutdown = lock(&self.shutdown);
+            self.wake.notify_one();
+        }
+    }
+}
+
+impl Collector for Shared {
+    fn collect(&self, encoder: &mut Encoder) {
+        let name = "hermes_dispatcher_injector_depth";
+        encoder.family(
+            name,
+            "gauge",
+            "Apps scheduled and not yet taken by a worker.",
+        );
+        encoder.sample(name, &[], self.injector.len());
+
+        let apps = sync::read(&self.apps);
+
+        let name = "hermes_app_pending_updates";
+        encoder.family(name, "gauge", "Chain updates an app hasn't handled yet.");
+        for app in apps.iter() {
+            encoder.sample(name, &[("app", &app.name)], lock(&app.mailbox).len());
+        }
+
+        let name = "hermes_app_cpu_seconds_total";
+        encoder.family(name, "counter", "Time workers spent running an app.");
+        for app in apps.iter() {
+            encoder.sample(
+                name,
+                &[("app", &app.name)],
+                metrics::seconds(app.busy.get()),
+            );
+        }
+
+        let name = "hermes_app_invocations_total";
+        encoder.family(
+            name,
+            "counter",
+            "Batches of chain updates an app was invoked on.",
+        );
+        for app in apps.iter() {
+            encoder.sample(name, &[("app", &app.name)], app.invocations.get());
+        }
+
+        let name = "hermes_app_failures_total";
+        encoder.family(name, "counter", "Invocations of an app that failed.");
+        for app in apps.iter() {
+            encoder.sample(name, &[("app", &app.name)], app.failures.get());
+        }
+    }
+}
+
+impl StatusSource for Shared {
+    fn sample(&self, status: &mut Status) {
+        status.set("dispatcher.injector", self.injector.len());
+
+        let apps = sync::read(&self.apps);
+        for app in apps.iter() {
+            let prefix = format!("apps.{}", app.name);
+            status.set(format!("{prefix}.pending"), lock(&app.mailbox).len());
+            status.set(
+                format!("{prefix}.healthy"),
+                !app.failing.load(Ordering::Relaxed),
+            );
+            status.set(format!("{prefix}.failures"), app.failures.get());
+            status.set(
+                format!("{prefix}.stopped"),
+                app.stopped.load(Ordering::Relaxed),
+            );
+        }
+    }
+}
+
+/// Dispatcher of chain updates to the apps, running them on a pool of worker threads.
+pub(crate) struct Dispatcher {
+    /// State shared with the workers.
+    shared: Arc<Shared>,
+    /// Worker threads.
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl Dispatcher {
+    /// Creates a dispatcher running apps on `threads` workers within `runtime`, passing
+    /// them up to `max_batch` updates at once. An app can lag behind by
+    /// [`MAILBOX_BATCHES`] batches before following is paused.
+    pub(crate) fn new(runtime: &Handle, threads: usize, max_batch: usize) -> Result<Self> {
+        let queues: Vec<_> = (0..threads.max(1)).map(|_| Worker::new_fifo()).collect();
+
+        let shared = Arc::new(Shared {
+            apps: RwLock::default(),
+            injector: Injector::new(),
+            stealers: queues.iter().map(Worker::stealer).collect(),
+            max_batch: max_batch.max(1),
+            mailbox_capacity: max_batch.max(1).saturating_mul(MAILBOX_BATCHES),
+            drained: Notify::new(),
+            shutdown: Mutex::new(false),
+            wake: Condvar::new(),
+        });
+
+        let workers = queues
+            .into_iter()
+            .enumerate()
+            .map(|(i, queue)| {
+                let shared = Arc::clone(&shared);
+                let runtime = runtime.clone();
+                thread::Builder::new()
+                    .name(format!("hermes-worker-{i}"))
+                    .spawn(move || {
+                        let _runtime = runtime.enter();
+                        shared.work(&queue);
+                    })
+            })
+            .collect::<std::io::Result<_>>()?;
+
+        Ok(Self { shared, workers })
+    }
+
+    /// Subscribes an app to the chain updates.
+    pub(crate) fn subscribe(&self, handler: impl AppHandler + 'static) {
+        sync::write(&self.shared.apps).push(Arc::new(AppSlot {
+            name: handler.name().to_owned(),
+            mailbox: Mutex::default(),
+            scheduled: AtomicBool::new(false),
+            woken: AtomicBool::new(false),
+            handler: Mutex::new(Box::new(handler)),
+            invocation: Mutex::default(),
+            busy: Counter::new(),
+            invocations: Counter::new(),
+            failures: Counter::new(),
+            failing: AtomicBool::new(false),
+            stopped: AtomicBool::new(false),
+        }));
+    }
+
+    /// Queues `update` for every subscribed app still running, without waiting for any
+    /// of them.
+    ///
+    /// The mailboxes may grow past their capacity, see [`Dispatcher::reserve`].
+    pub(crate) fn dispatch(&self, update: &ChainUpdate) {
+        let mut scheduled = 0;
+        for app in self.apps().iter() {
+            let mut mailbox = lock(&app.mailbox);
+            // Checked with the mailbox locked, so it is never filled again once cleared.
+            if app.stopped.load(Ordering::Acquire) {
+                continue;
+            }
+            mailbox.push_back(update.clone());
+            drop(mailbox);
+
+            if !app.scheduled.swap(true, Ordering::AcqRel) {
+                self.shared.injector.push(Arc::clone(app));
+                scheduled += 1;
+            }
+        }
+
+        if scheduled > 0 {
+            let _shutdown = lock(&self.shared.shutdown);
+            if scheduled == 1 {
+                self.shared.wake.notify_one();
+            } else {
+                self.shared.wake.notify_all();
+            }
+        }
+    }
+
+    /// Waits until every app has room for an update in its mailbox.
+    pub(crate) async fn reserve(&self) {
+        loop {
+            // Created first, so updates taken while checking aren't missed.
+            let drained = self.shared.drained.notified();
+            let full = self
+                .apps()
+                .iter()
+                .any(|app| lock(&app.mailbox).len() >= self.shared.mailbox_capacity);
+            if !full {
+                return;
+            }
+            drained.await;
+        }
+    }
+
+    /// Dispatches the updates received by `follower`, taking up to `batch` of them at
+    /// once, until it fails. Following is paused while an app's mailbox is full.
+    pub(crate) async fn follow(&self, follower: &mut Follower, batch: usize) -> Result<()> {
+        let mut updates = Vec::with_capacity(batch);
+        loop {
+            updates.clear();
+            follower
+                .next_batch(batch, &mut updates)
+                .await
+                .map_err(|err| anyhow!("failed to follow the chain: {err}"))?;
+
+            for update in &updates {
+                match update {
+                    ChainUpdate::Block(_) => metrics::FOLLOWER_BLOCKS.inc(),
+                    ChainUpdate::Rollback(_) => metrics::FOLLOWER_ROLLBACKS.inc(),
+                }
+                self.reserve().await;
+                self.dispatch(update);
+            }
+
+            if metrics::enabled() {
+                if let Some(ChainUpdate::Block(data) | ChainUpdate::Rollback(data)) = updates.last()
+                {
+                    if let Ok(header) = data.header() {
+                        metrics::FOLLOWER_TIP_SLOT.set(header.slot());
+                        metrics::FOLLOWER_TIP_HEIGHT.set(header.number());
+                    }
+                }
+
+                let stats = follower.buffer_stats();
+                metrics::FOLLOWER_BUFFER_OCCUPANCY
+                    .set(u64::try_from(stats.occupancy).unwrap_or(u64::MAX));
+                metrics::FOLLOWER_BUFFER_CAPACITY
+                    .set(u64::try_from(stats.capacity).unwrap_or(u64::MAX));
+                metrics::FOLLOWER_PRODUCER_STALL.set(metrics::nanos(stats.producer_stall_time));
+                metrics::FOLLOWER_CONSUMER_STALL.set(metrics::nanos(stats.consumer_stall_time));
+            }
+        }
+    }
+
+    /// Returns the collector of the metrics of the dispatcher and its apps.
+    pub(crate) fn collector(&self) -> Arc<dyn Collector> {
+        let collector: Arc<dyn Collector> = Arc::clone(&self.shared);
+        collector
+    }
+
+    /// Returns the source of the status of the dispatcher and its apps.
+    pub(crate) fn status_source(&self) -> Arc<dyn StatusSource> {
+        let source: Arc<dyn StatusSource> = Arc::clone(&self.shared);
+        source
+    }
+
+    /// Returns the subscribed apps.
+    fn apps(&self) -> RwLockReadGuard<'_, Vec<Arc<AppSlot>>> {
+        sync::read(&self.shared.apps)
+    }
+}
+
+impl Drop for Dispatcher {
+    /// Stops the workers once they've handled every pending update.
+    fn drop(&mut self) {
+        *lock(&self.shared.shutdown) = true;
+        self.shared.wake.notify_all();
+
+        for worker in self.workers.drain(..) {
+            worker.join().ok();
+        }
+    }
+}
+
+/// Takes the next batch of updates from `mailbox`: up to `max` consecutive blocks, or a
+/// single rollback.
+fn take_batch(mailbox: &mut VecDeque<ChainUpdate>, max: usize) -> Vec<ChainUpdate> {
+    if let Some(ChainUpdate::Rollback(_)) = mailbox.front() {
+        return mailbox.pop_front().into_iter().collect();
+    }
+
+    let len = mailbox
+        .iter()
+        .take(max)
+        .take_while(|update| matches!(update, ChainUpdate::Block(_)))
+        .count();
+    mailbox.drain(..len).collect()
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the batching of the updates of an app.
+
+    use std::collections::VecDeque;
+
+    use cardano_chain_follower::{ChainUpdate, MultiEraBlockData};
+
+    use super::take_batch;
+
+    /// Returns a mailbox of blocks (`b`) and rollbacks (`r`).
+    fn mailbox(updates: &str) -> VecDeque<ChainUpdate> {
+        updates
+            .chars()
+            .map(|kind| {
+                let data = MultiEraBlockData::from(Vec::new());
+                if kind == 'r' {
+                    ChainUpdate::Rollback(data)
+                } else {
+                    ChainUpdate::Block(data)
+                }
+            })
+            .collect()
+    }
+
+    /// Returns the kinds of `updates`, in the notation of `mailbox`.
+    fn kinds(updates: &[ChainUpdate]) -> String {
+        updates
+            .iter()
+            .map(|update| {
+                match update {
+                    ChainUpdate::Block(_) => 'b',
+                    ChainUpdate::Rollback(_) => 'r',
+                }
+            })
+            .collect()
+    }
+
+    /// Batches are made of consecutive blocks, up to the maximum.
+    #[test]
+    fn batches_blocks() {
+        let mut updates = mailbox("bbbbb");
+        assert_eq!(kinds(&take_batch(&mut updates, 3)), "bbb");
+        assert_eq!(kinds(&take_batch(&mut updates, 3)), "bb");
+        assert!(take_batch(&mut updates, 3).is_empty());
+    }
+
+    /// Rollbacks are taken alone, and end the batch of blocks before them.
+    #[test]
+    fn takes_rollbacks_alone() {
+        let mut updates = mailbox("bbrrb");
+        assert_eq!(kinds(&take_batch(&mut updates, 8)), "bb");
+        assert_eq!(kinds(&take_batch(&mut updates, 8)), "r");
+        assert_eq!(kinds(&take_batch(&mut updates, 8)), "r");
+        assert_eq!(kinds(&take_batch(&mut updates, 8)), "b");
+        assert!(updates.is_empty());
+    }
+}
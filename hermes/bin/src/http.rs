@@ -0,0 +1,371 @@
+//! Host implementation of the `wasi:http/outgoing-handler` requests of the apps.
+//!
+//! Connections are pooled per authority and shared by every app instance, so the
+//! requests of short-lived instances reuse keep-alive HTTP/1.1 connections, or share a
+//! single HTTP/2 connection when the server negotiates it. TLS sessions are resumed
+//! from a cache shared by all the connections. Responses to `GET` requests can be kept
+//! in a shared cache for as long as the server allows.
+
+mod cache;
+
+use std::{
+    collections::HashMap,
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+
+use http_body_util::BodyExt;
+use hyper::{
+    client::conn::{http1, http2},
+    header::{HeaderValue, HOST},
+    Request, Response,
+};
+use hyper_util::rt::{TokioExecutor, TokioIo};
+use tokio::{
+    io::{AsyncRead, AsyncWrite},
+    net::TcpStream,
+    time::timeout,
+};
+use tokio_rustls::{
+    rustls::{ClientConfig, OwnedTrustAnchor, RootCertStore, ServerName},
+    TlsConnector,
+};
+use wasmtime_wasi::preview2::{self, AbortOnDropJoinHandle};
+use wasmtime_wasi_http::{
+    bindings::http::types::ErrorCode,
+    body::HyperOutgoingBody,
+    hyper_request_error, hyper_response_error,
+    types::{IncomingResponseInternal, OutgoingRequest},
+};
+
+use self::cache::ResponseCache;
+use crate::sync::lock;
+
+/// Configuration of the HTTP client of the apps.
+#[derive(Debug, Clone)]
+pub(crate) struct HttpConfig {
+    /// Maximum number of idle HTTP/1.1 connections kept per authority.
+    pub(crate) max_idle_per_authority: usize,
+    /// How long an idle HTTP/1.1 connection is kept before it is closed.
+    pub(crate) idle_timeout: Duration,
+    /// Maximum total size of the cached response bodies, zero disables the cache.
+    pub(crate) cache_size: usize,
+    /// Largest response body that can be cached.
+    pub(crate) max_cached_body: usize,
+}
+
+impl Default for HttpConfig {
+    fn default() -> Self {
+        Self {
+            max_idle_per_authority: 8,
+            idle_timeout: Duration::from_secs(90),
+            cache_size: 0,
+            max_cached_body: 1024 * 1024,
+        }
+    }
+}
+
+/// Task driving a connection. It is aborted once the connection is neither pooled nor
+/// streaming the body of a response.
+type ConnectionTask = Arc<AbortOnDropJoinHandle<anyhow::Result<()>>>;
+
+/// Sending half of a connection.
+enum Sender {
+    /// HTTP/1.1 connection, sending one request at a time.
+    Http1(http1::SendRequest<HyperOutgoingBody>),
+    /// HTTP/2 connection, multiplexing the requests.
+    Http2(http2::SendRequest<HyperOutgoingBody>),
+}
+
+/// A connection to a server.
+struct Connection {
+    /// Sending half of the connection.
+    sender: Sender,
+    /// Task driving the connection.
+    task: ConnectionTask,
+    /// When the connection was last returned to the pool.
+    idle_since: Instant,
+}
+
+impl Connection {
+    /// Returns whether the connection was closed.
+    fn is_closed(&self) -> bool {
+        match &self.sender {
+            Sender::Http1(sender) => sender.is_closed(),
+            Sender::Http2(sender) => sender.is_closed(),
+        }
+    }
+
+    /// Returns whether the connection can send a request right away.
+    fn is_ready(&self) -> bool {
+        match &self.sender {
+            Sender::Http1(sender) => sender.is_ready(),
+            Sender::Http2(sender) => sender.is_ready(),
+        }
+    }
+
+    /// Returns another handle to an HTTP/2 connection.
+    fn share(&self) -> Option<Self> {
+        match &self.sender {
+            Sender::Http1(_) => None,
+            Sender::Http2(sender) => {
+                Some(Self {
+                    sender: Sender::Http2(sender.clone()),
+                    task: Arc::clone(&self.task),
+                    idle_since: self.idle_since,
+                })
+            },
+        }
+    }
+
+    /// Sends `request` to `authority`, returning the response head.
+    async fn send(
+        &mut self, mut request: Request<HyperOutgoingBody>, authority: &str,
+    ) -> Result<Response<hyper::body::Incoming>, ErrorCode> {
+        match &mut self.sender {
+            Sender::Http1(sender) => {
+                // HTTP/1.1 requests carry the authority in the Host header, and only
+                // the path as their target.
+                if !request.headers().contains_key(HOST) {
+                    let host = HeaderValue::from_str(authority)
+                        .map_err(|_| ErrorCode::HttpRequestUriInvalid)?;
+                    request.headers_mut().insert(HOST, host);
+                }
+                let target = request
+                    .uri()
+                    .path_and_query()
+                    .map_or("/", |target| target.as_str())
+                    .to_string();
+                *request.uri_mut() = target
+                    .parse()
+                    .map_err(|_| ErrorCode::HttpRequestUriInvalid)?;
+
+                sender.ready().await.map_err(hyper_request_error)?;
+                sender
+                    .send_request(request)
+                    .await
+                    .map_err(hyper_request_error)
+            },
+            Sender::Http2(sender) => {
+                sender.ready().await.map_err(hyper_request_error)?;
+                sender
+                    .send_request(request)
+                    .await
+                    .map_err(hyper_request_error)
+            },
+        }
+    }
+}
+
+/// Connections to an authority.
+#[derive(Default)]
+struct Pool {
+    /// Idle HTTP/1.1 connections, the most recently used last.
+    http1: Vec<Connection>,
+    /// HTTP/2 connection, shared by the concurrent requests.
+    http2: Option<Connection>,
+}
+
+/// Key of the pool of connections to an authority.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+struct PoolKey {
+    /// Whether the connections use TLS.
+    use_tls: bool,
+    /// Authority of the requests.
+    authority: String,
+}
+
+/// HTTP client of the apps, shared by all the instances.
+pub(crate) struct HttpClient {
+    /// Configuration of the client.
+    config: HttpConfig,
+    /// Pools of connections.
+    pools: Mutex<HashMap<PoolKey, Pool>>,
+    /// Connector of TLS connections, holding the cache of TLS sessions.
+    tls: TlsConnector,
+    /// Cache of responses, if enabled.
+    cache: Option<ResponseCache>,
+}
+
+impl HttpClient {
+    /// Creates a client trusting the Mozilla root certificates.
+    pub(crate) fn new(config: &HttpConfig) -> Self {
+        let mut roots = RootCertStore::empty();
+        roots.add_trust_anchors(webpki_roots::TLS_SERVER_ROOTS.iter().map(|anchor| {
+            OwnedTrustAnchor::from_subject_spki_name_constraints(
+                anchor.subject,
+                anchor.spki,
+                anchor.name_constraints,
+            )
+        }));
+
+        // Sessions are resumed from the in-memory store of the config, which all
+        // the connections share.
+        let mut tls = ClientConfig::builder()
+            .with_safe_defaults()
+            .with_root_certificates(roots)
+            .with_no_client_auth();
+        tls.alpn_protocols = vec![b"h2".to_vec(), b"http/1.1".to_vec()];
+
+        Self {
+            config: config.clone(),
+            pools: Mutex::default(),
+            tls: TlsConnector::from(Arc::new(tls)),
+            cache: (config.cache_size > 0)
+                .then(|| ResponseCache::new(config.cache_size, config.max_cached_body)),
+        }
+    }
+
+    /// Sends a request of an app, over a pooled connection if there is one.
+    pub(crate) async fn send(
+        &self, request: OutgoingRequest,
+    ) -> Result<IncomingResponseInternal, ErrorCode> {
+        let OutgoingRequest {
+            use_tls,
+            authority,
+            request,
+            connect_timeout,
+            first_byte_timeout,
+            between_bytes_timeout,
+        } = request;
+        let key = PoolKey { use_tls, authority };
+
+        let cache_key = self
+            .cache
+            .as_ref()
+            .and_then(|_| ResponseCache::key(use_tls, &key.authority, &request));
+        if let (Some(cache), Some(cache_key)) = (&self.cache, &cache_key) {
+            if let Some(resp) = cache.get(cache_key) {
+                return Ok(IncomingResponseInternal {
+                    resp,
+                    worker: Arc::new(preview2::spawn(async { Ok(()) })),
+                    between_bytes_timeout,
+                });
+            }
+        }
+
+        let mut conn = match self.idle(&key) {
+            Some(conn) => conn,
+            None => {
+                timeout(connect_timeout, self.connect(&key))
+                    .await
+                    .map_err(|_| ErrorCode::ConnectionTimeout)??
+            },
+        };
+
+        let resp = timeout(first_byte_timeout, conn.send(request, &key.authority))
+            .await
+            .map_err(|_| ErrorCode::ConnectionReadTimeout)??;
+        let worker = Arc::clone(&conn.task);
+        self.release(key, conn);
+
+        let resp = resp.map(|body| body.map_err(hyper_response_error).boxed());
+        let resp = match (&self.cache, cache_key) {
+            (Some(cache), Some(cache_key)) => {
+                cache.store(cache_key, resp, between_bytes_timeout).await?
+            },
+            _ => resp,
+        };
+
+        Ok(IncomingResponseInternal {
+            resp,
+            worker,
+            between_bytes_timeout,
+        })
+    }
+
+    /// Takes a connection to `key` from its pool, dropping the connections that were
+    /// closed or idle for too long.
+    fn idle(&self, key: &PoolKey) -> Option<Connection> {
+        let mut pools = lock(&self.pools);
+        let pool = pools.get_mut(key)?;
+
+        let now = Instant::now();
+        pool.http1.retain(|conn| {
+            !conn.is_closed() && now.duration_since(conn.idle_since) < self.config.idle_timeout
+        });
+        if pool.http2.as_ref().is_some_and(Connection::is_closed) {
+            pool.http2 = None;
+        }
+
+        if let Some(conn) = pool.http2.as_ref().and_then(Connection::share) {
+            return Some(conn);
+        }
+
+        // A connection still streaming its last response isn't ready yet.
+        let i = pool.http1.iter().rposition(Connection::is_ready)?;
+        Some(pool.http1.swap_remove(i))
+    }
+
+    /// Returns a connection to the pool of `key`.
+    fn release(&self, key: PoolKey, mut conn: Connection) {
+        if conn.is_closed() {
+            return;
+        }
+        conn.idle_since = Instant::now();
+
+        let mut pools = lock(&self.pools);
+        let pool = pools.entry(key).or_default();
+        match conn.sender {
+            Sender::Http1(_) if pool.http1.len() < self.config.max_idle_per_authority => {
+                pool.http1.push(conn);
+            },
+            Sender::Http2(_) if pool.http2.is_none() => pool.http2 = Some(conn),
+            _ => {},
+        }
+    }
+
+    /// Opens a new connection to `key`, negotiating HTTP/2 over TLS.
+    async fn connect(&self, key: &PoolKey) -> Result<Connection, ErrorCode> {
+        let (host, address) = match key.authority.rsplit_once(':') {
+            Some((host, _)) => (host, key.authority.clone()),
+            None => {
+                let port = if key.use_tls { 443 } else { 80 };
+                (key.authority.as_str(), format!("{}:{port}", key.authority))
+            },
+        };
+
+        let tcp = TcpStream::connect(&address)
+            .await
+            .map_err(|_| ErrorCode::ConnectionRefused)?;
+        tcp.set_nodelay(true).ok();
+
+        if !key.use_tls {
+            return handshake(tcp, false).await;
+        }
+
+        let name = ServerName::try_from(host).map_err(|_| ErrorCode::TlsProtocolError)?;
+        let stream = self
+            .tls
+            .connect(name, tcp)
+            .await
+            .map_err(|_| ErrorCode::TlsProtocolError)?;
+        let http2 = stream.get_ref().1.alpn_protocol() == Some(b"h2");
+
+        handshake(stream, http2).await
+    }
+}
+
+/// Performs the HTTP handshake over `io`, spawning the task driving the connection.
+async fn handshake<IO>(io: IO, http2: bool) -> Result<Connection, ErrorCode>
+where IO: AsyncRead + AsyncWrite + Unpin + Send + 'static {
+    let io = TokioIo::new(io);
+
+    let (sender, task) = if http2 {
+        let (sender, conn) = http2::handshake(TokioExecutor::new(), io)
+            .await
+            .map_err(hyper_request_error)?;
+        let task = preview2::spawn(async move { Ok::<_, anyhow::Error>(conn.await?) });
+        (Sender::Http2(sender), task)
+    } else {
+        let (sender, conn) = http1::handshake(io).await.map_err(hyper_request_error)?;
+        let task = preview2::spawn(async move { Ok::<_, anyhow::Error>(conn.await?) });
+        (Sender::Http1(sender), task)
+    };
+
+    Ok(Connection {
+        sender,
+        task: Arc::new(task),
+        idle_since: Instant::now(),
+    })
+}
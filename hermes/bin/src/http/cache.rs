@@ -0,0 +1,301 @@
+//! Cache of the responses to the `GET` requests of the apps.
+//!
+//! The cache is shared by all the apps, so like any shared cache it only keeps the
+//! responses to requests without credentials, and only when the server allows it.
+
+use std::{
+    collections::HashMap,
+    sync::{Mutex, MutexGuard},
+    time::{Duration, Instant},
+};
+
+use http_body_util::{BodyExt, Full};
+use hyper::{
+    body::Bytes,
+    header::{HeaderMap, AUTHORIZATION, CACHE_CONTROL, CONTENT_LENGTH, COOKIE, VARY},
+    Method, Request, Response, StatusCode,
+};
+use tokio::time::timeout;
+use wasmtime_wasi_http::{bindings::http::types::ErrorCode, body::HyperIncomingBody};
+
+use crate::sync;
+
+/// A cached response.
+struct Entry {
+    /// Status of the response.
+    status: StatusCode,
+    /// Headers of the response.
+    headers: HeaderMap,
+    /// Body of the response.
+    body: Bytes,
+    /// When the response becomes stale.
+    expires: Instant,
+}
+
+/// State of the cache.
+#[derive(Default)]
+struct State {
+    /// Cached responses, by URL.
+    entries: HashMap<String, Entry>,
+    /// Total size of the cached bodies.
+    size: usize,
+}
+
+impl State {
+    /// Removes the response cached for `key`.
+    fn remove(&mut self, key: &str) {
+        if let Some(entry) = self.entries.remove(key) {
+            self.size -= entry.body.len();
+        }
+    }
+
+    /// Removes the stale responses, then the responses closest to becoming stale, until
+    /// `len` more bytes fit in `max_size`.
+    fn make_room(&mut self, len: usize, max_size: usize) {
+        let now = Instant::now();
+        self.entries.retain(|_, entry| entry.expires > now);
+        self.size = self.entries.values().map(|entry| entry.body.len()).sum();
+
+        while self.size + len > max_size {
+            let Some(key) = self
+                .entries
+                .iter()
+                .min_by_key(|(_, entry)| entry.expires)
+                .map(|(key, _)| key.clone())
+            else {
+                return;
+            };
+            self.remove(&key);
+        }
+    }
+}
+
+/// Cache of responses, bounded by the total size of their bodies.
+pub(super) struct ResponseCache {
+    /// Maximum total size of the cached bodies.
+    max_size: usize,
+    /// Largest body that can be cached.
+    max_body: usize,
+    /// State of the cache.
+    state: Mutex<State>,
+}
+
+impl ResponseCache {
+    /// Creates a cache holding up to `max_size` bytes of bodies of up to `max_body`
+    /// bytes each.
+    pub(super) fn new(max_size: usize, max_body: usize) -> Self {
+        Self {
+            max_size,
+            max_body: max_body.min(max_size),
+            state: Mutex::default(),
+        }
+    }
+
+    /// Returns the key of the response to `request`, or None if it can't be cached.
+    pub(super) fn key<B>(use_tls: bool, authority: &str, request: &Request<B>) -> Option<String> {
+        let headers = request.headers();
+        if request.method() != Method::GET
+            || headers.contains_key(AUTHORIZATION)
+            || headers.contains_key(COOKIE)
+        {
+            return None;
+        }
+
+        let scheme = if use_tls { "https" } else { "http" };
+        let target = request
+            .uri()
+            .path_and_query()
+            .map_or("/", |target| target.as_str());
+        Some(format!("{scheme}://{authority}{target}"))
+    }
+
+    /// Returns the response cached for `key`, if it is still fresh.
+    pub(super) fn get(&self, key: &str) -> Option<Response<HyperIncomingBody>> {
+        let mut state = self.lock();
+
+        let entry = state.entries.get(key)?;
+        if entry.expires <= Instant::now() {
+            state.remove(key);
+            return None;
+        }
+
+        let mut resp = Response::new(
+            Full::new(entry.body.clone())
+                .map_err(|never| match never {})
+                .boxed(),
+        );
+        *resp.status_mut() = entry.status;
+        *resp.headers_mut() = entry.headers.clone();
+
+        Some(resp)
+    }
+
+    /// Caches `resp` for `key` if the server allows it, in which case its body is read
+    /// first, waiting up to `between_bytes_timeout` for it. Returns the response to
+    /// pass on to the app.
+    pub(super) async fn store(
+        &self, key: String, resp: Response<HyperIncomingBody>, between_bytes_timeout: Duration,
+    ) -> Result<Response<HyperIncomingBody>, ErrorCode> {
+        let Some(max_age) = self.max_age(&resp) else {
+            return Ok(resp);
+        };
+
+        let (parts, body) = resp.into_parts();
+        let body = timeout(between_bytes_timeout, body.collect())
+            .await
+            .map_err(|_| ErrorCode::ConnectionReadTimeout)??
+            .to_bytes();
+
+        {
+            let mut state = self.lock();
+            state.remove(&key);
+            state.make_room(body.len(), self.max_size);
+            state.size += body.len();
+            state.entries.insert(key, Entry {
+                status: parts.status,
+                headers: parts.headers.clone(),
+                body: body.clone(),
+                expires: Instant::now() + max_age,
+            });
+        }
+
+        Ok(Response::from_parts(
+            parts,
+            Full::new(body).map_err(|never| match never {}).boxed(),
+        ))
+    }
+
+    /// Returns how long `resp` can be cached, or None if it can't. Only successful
+    /// responses of a known length that are fresh for some time and don't vary with
+    /// the request headers are cached.
+    fn max_age(&self, resp: &Response<HyperIncomingBody>) -> Option<Duration> {
+        let headers = resp.headers();
+        if resp.status() != StatusCode::OK || headers.contains_key(VARY) {
+            return None;
+        }
+
+        let len: usize = headers.get(CONTENT_LENGTH)?.to_str().ok()?.parse().ok()?;
+        if len > self.max_body {
+            return None;
+        }
+
+        let mut max_age = None;
+        for directive in headers
+            .get_all(CACHE_CONTROL)
+            .iter()
+            .filter_map(|value| value.to_str().ok())
+            .flat_map(|value| value.split(','))
+        {
+            let (name, value) = directive
+                .trim()
+                .split_once('=')
+                .unwrap_or((directive.trim(), ""));
+            match name.to_ascii_lowercase().as_str() {
+                "no-store" | "no-cache" | "private" => return None,
+                // The shared cache directive takes precedence.
+                "s-maxage" => max_age = value.parse().ok().or(max_age),
+                "max-age" if max_age.is_none() => max_age = value.parse().ok(),
+                _ => {},
+            }
+        }
+
+        max_age.filter(|&secs| secs > 0).map(Duration::from_secs)
+    }
+
+    /// Locks the state of the cache.
+    fn lock(&self) -> MutexGuard<'_, State> {
+        sync::lock(&self.state)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the caching rules of the responses.
+
+    use std::time::Duration;
+
+    use http_body_util::{BodyExt, Full};
+    use hyper::{body::Bytes, Response, StatusCode};
+    use wasmtime_wasi_http::body::HyperIncomingBody;
+
+    use super::ResponseCache;
+
+    /// Returns an empty response with `status` and `headers`.
+    fn response(status: StatusCode, headers: &[(&str, &str)]) -> Response<HyperIncomingBody> {
+        let mut builder = Response::builder().status(status);
+        for (name, value) in headers {
+            builder = builder.header(*name, *value);
+        }
+        builder
+            .body(
+                Full::new(Bytes::new())
+                    .map_err(|never| match never {})
+                    .boxed(),
+            )
+            .expect("invalid response")
+    }
+
+    /// Returns how long a successful response with `headers` is cached.
+    fn max_age(headers: &[(&str, &str)]) -> Option<Duration> {
+        ResponseCache::new(1024, 100).max_age(&response(StatusCode::OK, headers))
+    }
+
+    /// Responses are cached for their shared max age, or else their max age.
+    #[test]
+    fn max_age_directives() {
+        let secs = |secs| Some(Duration::from_secs(secs));
+        let length = ("content-length", "10");
+
+        assert_eq!(
+            max_age(&[length, ("cache-control", "max-age=60")]),
+            secs(60)
+        );
+        assert_eq!(
+            max_age(&[length, ("cache-control", "public, Max-Age=60")]),
+            secs(60)
+        );
+        assert_eq!(
+            max_age(&[length, ("cache-control", "max-age=60, s-maxage=5")]),
+            secs(5)
+        );
+        assert_eq!(
+            max_age(&[
+                length,
+                ("cache-control", "s-maxage=5"),
+                ("cache-control", "max-age=60")
+            ]),
+            secs(5)
+        );
+        assert_eq!(
+            max_age(&[length, ("cache-control", "max-age=60, s-maxage=soon")]),
+            secs(60)
+        );
+    }
+
+    /// Responses that aren't fresh, private, varying, unsuccessful or of an unknown or
+    /// too large length aren't cached.
+    #[test]
+    fn uncacheable_responses() {
+        let length = ("content-length", "10");
+        let fresh = ("cache-control", "max-age=60");
+
+        assert_eq!(max_age(&[length]), None);
+        assert_eq!(max_age(&[length, ("cache-control", "max-age=0")]), None);
+        assert_eq!(max_age(&[fresh]), None);
+        assert_eq!(max_age(&[("content-length", "101"), fresh]), None);
+        assert_eq!(max_age(&[length, fresh, ("vary", "accept")]), None);
+        for directive in ["no-store", "no-cache", "private"] {
+            assert_eq!(
+                max_age(&[
+                    length,
+                    ("cache-control", &format!("max-age=60, {directive}"))
+                ]),
+                None
+            );
+        }
+
+        let cache = ResponseCache::new(1024, 100);
+        let resp = response(StatusCode::NOT_FOUND, &[length, fresh]);
+        assert_eq!(cache.max_age(&resp), None);
+    }
+}
@@ -0,0 +1,115 @@
+//! Persistent key-value stores of the apps, see the `hermes:kv` WIT package.
+//!
+//! Every app has its own store, shared by its instances. The writes of an instance are
+//! buffered while it handles an event, and committed as a single batch once it is done,
+//! so an event costs one sync of the store however many keys it writes.
+//!
+//! Each batch is tagged with the block it was written for, and the store is rewound to
+//! the block a rollback goes back to before the app handles it, so the app finds the
+//! state it had right after that block.
+
+mod store;
+
+use std::{
+    path::{Path, PathBuf},
+    sync::Arc,
+};
+
+use anyhow::{anyhow, Result};
+use cardano_chain_follower::Point;
+
+use self::store::Batch;
+pub(crate) use self::{hermes::kv::store::add_to_linker, store::KvStore};
+use crate::{metrics::HostCall, runtime::AppState};
+
+wasmtime::component::bindgen!({
+    path: "../wasm/crates/wasi/wit/deps/kv",
+    world: "imports",
+});
+
+/// Returns the directory of the store of the app `name` in `data_dir`.
+pub(crate) fn store_dir(data_dir: &Path, name: &str) -> PathBuf {
+    let name: String = name
+        .chars()
+        .map(|c| {
+            if c.is_ascii_alphanumeric() || c == '-' || c == '_' || c == '.' {
+                c
+            } else {
+                '_'
+            }
+        })
+        .collect();
+    data_dir.join(name)
+}
+
+/// Store of an app instance, with the writes of the running invocation.
+pub(crate) struct KvSession {
+    /// Store of the app.
+    store: Arc<KvStore>,
+    /// Writes not committed yet.
+    batch: Batch,
+}
+
+impl KvSession {
+    /// Creates a session of `store`.
+    pub(crate) fn new(store: Arc<KvStore>) -> Self {
+        Self {
+            store,
+            batch: Batch::default(),
+        }
+    }
+
+    /// Commits the writes of the invocation, made for the block `point`.
+    pub(crate) fn commit(&mut self, point: &Point) -> Result<()> {
+        let res = self.store.commit(point, &self.batch);
+        self.batch.clear();
+        res
+    }
+
+    /// Rewinds the store to the block `point`, see [`KvStore::rewind`].
+    pub(crate) fn rewind(&mut self, point: &Point) -> Result<bool> {
+        self.batch.clear();
+        self.store.rewind(point)
+    }
+
+    /// Drops the writes of the invocation.
+    pub(crate) fn rollback(&mut self) {
+        self.batch.clear();
+    }
+}
+
+impl hermes::kv::store::Host for AppState {
+    fn get(&mut self, key: Vec<u8>) -> Result<Option<Vec<u8>>> {
+        HostCall::KvGet.measure(|| {
+            let Some(kv) = self.kv_mut() else {
+                return Ok(None);
+            };
+
+            Ok(match kv.batch.get(&key) {
+                Some(value) => value.map(<[u8]>::to_vec),
+                None => kv.store.get(&key),
+            })
+        })
+    }
+
+    fn set(&mut self, key: Vec<u8>, value: Vec<u8>) -> Result<()> {
+        HostCall::KvSet.measure(|| {
+            session(self)?.batch.put(key, value);
+            Ok(())
+        })
+    }
+
+    fn delete(&mut self, key: Vec<u8>) -> Result<()> {
+        HostCall::KvDelete.measure(|| {
+            session(self)?.batch.delete(key);
+            Ok(())
+        })
+    }
+}
+
+/// Returns the store session of `state`, failing if the node has no data directory.
+fn session(state: &mut AppState) -> Result<&mut KvSession> {
+    state
+        .kv_mut()
+        .ok_or_else(|| anyhow!("the node has no key-value store for the app"))
+}
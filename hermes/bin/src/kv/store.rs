@@ -0,0 +1,968 @@
+//! On-disk key-value store of an app.
+//!
+//! The whole store is held in memory in a sorted map, which serves all the reads.
+//! Writes are committed in batches, each appended as a single record to a write-ahead
+//! log and synced before being applied to the map. The log is split in segments
+//! (`NNNNNNNN.wal`), each starting from a full checkpoint of the store
+//! (`NNNNNNNN.checkpoint`, missing for the empty store of the first segment). A new
+//! segment is started once the current one outgrows the store or holds enough blocks,
+//! and only the last few segments are kept.
+//!
+//! Batches are tagged with the block they were written for, and the values they
+//! replaced are kept in memory for the last [`DELTA_WINDOW`] blocks written to. The
+//! store is rewound to a block by undoing the batches of the later slots, so blocks
+//! that wrote nothing have nothing to undo. Older blocks are rewound to by loading an
+//! earlier checkpoint, replaying the log following it and undoing the batches after
+//! the block.
+//!
+//! The store also keeps the last block it was committed or rewound to, so the app
+//! can resume from it. Blocks without writes are recorded without syncing the log,
+//! the point they move the store to is durable once a later batch is.
+//!
+//! Records are `[len: u32, crc32: u32, kind: u8, point, ops]`, where `point` is the
+//! block of the record, and each op is either `[0, key_len: u32, key, value_len: u32,
+//! value]` or `[1, key_len: u32, key]` for a deletion, all integers in little endian.
+//! Checkpoints are made of records of the same format.
+
+use std::{
+    collections::{BTreeMap, VecDeque},
+    fs::{self, File, OpenOptions},
+    io::{ErrorKind, Write},
+    path::{Path, PathBuf},
+    sync::{RwLock, RwLockReadGuard, RwLockWriteGuard},
+};
+
+use anyhow::{anyhow, Result};
+use cardano_chain_follower::Point;
+
+use crate::sync;
+
+/// Size of the header of a record.
+const HEADER_SIZE: usize = 8;
+
+/// Size of a log segment below which no checkpoint is taken, whatever the size of
+/// the store.
+const MIN_CHECKPOINT_SIZE: u64 = 16 * 1024 * 1024;
+
+/// Number of blocks written to a log segment after which a checkpoint is taken.
+const CHECKPOINT_BLOCKS: u64 = 2160;
+
+/// Number of checkpoints kept, along with the log segments following them.
+const MAX_CHECKPOINTS: u32 = 4;
+
+/// Number of blocks whose batches can be undone without reading the log, which is
+/// the maximum depth of a rollback as set by the security parameter of the chain.
+const DELTA_WINDOW: usize = 2160;
+
+/// Size of the records the checkpoints are split into.
+const CHECKPOINT_RECORD_SIZE: usize = 1024 * 1024;
+
+/// Kind of a record of writes not tied to a block, as found in checkpoints.
+const KIND_WRITES: u8 = 0;
+/// Kind of a record of the writes of a block.
+const KIND_BLOCK: u8 = 1;
+/// Kind of a record of the store being rewound to a block.
+const KIND_REWIND: u8 = 2;
+/// Kind of a record of a block without writes, as well as the last record of a
+/// checkpoint.
+const KIND_POINT: u8 = 3;
+
+/// Tag of a put op.
+const OP_PUT: u8 = 0;
+/// Tag of a delete op.
+const OP_DELETE: u8 = 1;
+
+/// Writes of a record: the new value of every written key, None if it is deleted.
+type Ops = Vec<(Vec<u8>, Option<Vec<u8>>)>;
+
+/// Writes to the store, committed at once. Later writes to a key replace earlier ones.
+#[derive(Default)]
+pub(crate) struct Batch {
+    /// New value of every written key, None if the key is deleted.
+    ops: BTreeMap<Vec<u8>, Option<Vec<u8>>>,
+}
+
+impl Batch {
+    /// Sets `key` to `value`.
+    pub(crate) fn put(&mut self, key: Vec<u8>, value: Vec<u8>) {
+        self.ops.insert(key, Some(value));
+    }
+
+    /// Deletes `key`.
+    pub(crate) fn delete(&mut self, key: Vec<u8>) {
+        self.ops.insert(key, None);
+    }
+
+    /// Returns the value written to `key` by the batch: None if the batch doesn't
+    /// write it, Some(None) if it deletes it.
+    pub(crate) fn get(&self, key: &[u8]) -> Option<Option<&[u8]>> {
+        self.ops.get(key).map(Option::as_deref)
+    }
+
+    /// Returns whether the batch has no writes.
+    pub(crate) fn is_empty(&self) -> bool {
+        self.ops.is_empty()
+    }
+
+    /// Drops every write of the batch.
+    pub(crate) fn clear(&mut self) {
+        self.ops.clear();
+    }
+}
+
+/// Values replaced by the writes of a block.
+struct Delta {
+    /// The block.
+    point: Point,
+    /// Value of every key written by the block before it was, None if it wasn't set.
+    undo: BTreeMap<Vec<u8>, Option<Vec<u8>>>,
+}
+
+/// Contents of the store.
+struct Tables {
+    /// Every key of the store, with its value.
+    memtable: BTreeMap<Vec<u8>, Vec<u8>>,
+    /// Values replaced by the last blocks, the latest last.
+    deltas: VecDeque<Delta>,
+    /// Whether `deltas` go back to the empty store.
+    from_origin: bool,
+    /// Slot of the last block whose delta was dropped, if any.
+    dropped: Option<u64>,
+    /// Total size of the keys and values of the store.
+    size: usize,
+    /// Last block the store was committed or rewound to, if any.
+    point: Option<Point>,
+}
+
+impl Tables {
+    /// Creates empty tables, whose deltas go back to the empty store if `from_origin`.
+    fn new(from_origin: bool) -> Self {
+        Self {
+            memtable: BTreeMap::new(),
+            deltas: VecDeque::new(),
+            from_origin,
+            dropped: None,
+            size: 0,
+            point: None,
+        }
+    }
+
+    /// Sets `key` to `value`, or deletes it if None, returning its previous value.
+    fn apply(&mut self, key: Vec<u8>, value: Option<Vec<u8>>) -> Option<Vec<u8>> {
+        let key_len = key.len();
+        let old = match value {
+            Some(value) => {
+                self.size += key_len + value.len();
+                self.memtable.insert(key, value)
+            },
+            None => self.memtable.remove(&key),
+        };
+        if let Some(old) = &old {
+            self.size -= key_len + old.len();
+        }
+        old
+    }
+
+    /// Applies the writes of the block `point`, keeping the values they replace.
+    fn apply_block(&mut self, point: Point, ops: Ops) {
+        self.point = Some(point.clone());
+
+        // A block is written to again when handling a rollback to it.
+        let mut delta = match self.deltas.back() {
+            Some(delta) if delta.point == point => self.deltas.pop_back(),
+            _ => None,
+        }
+        .unwrap_or(Delta {
+            point,
+            undo: BTreeMap::new(),
+        });
+
+        for (key, value) in ops {
+            let old = self.apply(key.clone(), value);
+            delta.undo.entry(key).or_insert(old);
+        }
+
+        self.deltas.push_back(delta);
+        if self.deltas.len() > DELTA_WINDOW {
+            if let Some(delta) = self.deltas.pop_front() {
+                self.dropped = slot(&delta.point);
+            }
+            self.from_origin = false;
+        }
+    }
+
+    /// Returns the writes undoing the blocks after `point`, or None if they aren't all
+    /// known.
+    fn undo_after(&self, point: &Point) -> Option<Ops> {
+        let target = slot(point);
+
+        // The deltas cover every write made after the oldest of them, or after the
+        // last one dropped.
+        let floor = self
+            .dropped
+            .or_else(|| self.deltas.front().and_then(|delta| slot(&delta.point)));
+        let covered = self.from_origin || floor.is_some_and(|floor| target >= Some(floor));
+        if !covered {
+            return None;
+        }
+
+        // Older values replace newer ones, as the older blocks are undone last.
+        let mut ops = BTreeMap::new();
+        for delta in self.deltas.iter().rev() {
+            if slot(&delta.point) <= target {
+                break;
+            }
+            for (key, old) in &delta.undo {
+                ops.insert(key.clone(), old.clone());
+            }
+        }
+
+        Some(ops.into_iter().collect())
+    }
+
+    /// Applies the writes rewinding the store to `point`, dropping the values replaced
+    /// by the blocks after it.
+    fn apply_rewind(&mut self, point: &Point, ops: Ops) {
+        for (key, value) in ops {
+            self.apply(key, value);
+        }
+        let target = slot(point);
+        while self
+            .deltas
+            .back()
+            .is_some_and(|delta| slot(&delta.point) > target)
+        {
+            self.deltas.pop_back();
+        }
+        self.point = Some(point.clone());
+    }
+}
+
+/// State of the store.
+struct Inner {
+    /// Contents of the store.
+    tables: Tables,
+    /// Number of the current log segment.
+    segment: u32,
+    /// Current log segment, opened for appending.
+    wal: File,
+    /// Length of the current log segment.
+    wal_len: u64,
+    /// Number of block records in the current log segment.
+    wal_blocks: u64,
+}
+
+impl Inner {
+    /// Appends a record to the current log segment, and syncs it if `durable`.
+    fn append(&mut self, kind: u8, point: &Point, ops: &Ops, durable: bool) -> Result<()> {
+        let mut record = Vec::new();
+        encode_record(
+            &mut record,
+            kind,
+            point,
+            ops.iter().map(|(key, value)| (key, value.as_deref())),
+        )?;
+
+        let res = self.wal.write_all(&record).and_then(|()| {
+            if durable {
+                self.wal.sync_data()
+            } else {
+                Ok(())
+            }
+        });
+        if let Err(err) = res {
+            self.wal.set_len(self.wal_len).ok();
+            return Err(err.into());
+        }
+        self.wal_len += u64::try_from(record.len())?;
+
+        Ok(())
+    }
+}
+
+/// Key-value store of an app.
+pub(crate) struct KvStore {
+    /// Directory holding the store files.
+    dir: PathBuf,
+    /// State of the store.
+    inner: RwLock<Inner>,
+}
+
+impl KvStore {
+    /// Opens the store in directory `dir`, creating it if it doesn't exist.
+    ///
+    /// A batch left incomplete in the log by an interrupted commit is discarded.
+    pub(crate) fn open(dir: &Path) -> Result<Self> {
+        fs::create_dir_all(dir)?;
+
+        // A segment is only used once its checkpoint is in place, a log without one is
+        // left over by an interrupted checkpoint and holds no batch.
+        let mut segment = 0;
+        for entry in fs::read_dir(dir)? {
+            let name = entry?.file_name();
+            let number = name
+                .to_str()
+                .and_then(|name| name.split_once('.'))
+                .filter(|(_, ext)| *ext == "checkpoint")
+                .and_then(|(number, _)| number.parse().ok());
+            if let Some(number) = number {
+                segment = segment.max(number);
+            }
+        }
+
+        let mut tables = load_checkpoint(dir, segment)?;
+        let wal_path = wal_path(dir, segment);
+        let replayed = replay(&read_or_empty(&wal_path)?, &mut tables);
+        let wal_len = u64::try_from(replayed.len)?;
+
+        let wal = open_append(&wal_path)?;
+        wal.set_len(wal_len)?;
+
+        Ok(Self {
+            dir: dir.to_path_buf(),
+            inner: RwLock::new(Inner {
+                tables,
+                segment,
+                wal,
+                wal_len,
+                wal_blocks: replayed.blocks,
+            }),
+        })
+    }
+
+    /// Returns the last block the store was committed or rewound to, if any.
+    pub(crate) fn point(&self) -> Option<Point> {
+        self.read().tables.point.clone()
+    }
+
+    /// Returns the value of `key`, if any.
+    pub(crate) fn get(&self, key: &[u8]) -> Option<Vec<u8>> {
+        self.read().tables.memtable.get(key).cloned()
+    }
+
+    /// Commits `batch` as writes of the block `point`, which are undone when rewinding
+    /// the store to an earlier block. The batch is durable once this returns, unless
+    /// it is empty.
+    ///
+    /// If the batch can't be fully written, the store is left as it was.
+    pub(crate) fn commit(&self, point: &Point, batch: &Batch) -> Result<()> {
+        let mut inner = self.write();
+
+        // The store is rewound by slot, so a block without writes only moves its point,
+        // which is not worth a sync: if it is lost, the block is handled again.
+        if batch.is_empty() {
+            inner.append(KIND_POINT, point, &Ops::new(), false)?;
+            inner.tables.point = Some(point.clone());
+            self.maybe_checkpoint(&mut inner);
+            return Ok(());
+        }
+
+        let ops: Ops = batch
+            .ops
+            .iter()
+            .map(|(key, value)| (key.clone(), value.clone()))
+            .collect();
+
+        inner.append(KIND_BLOCK, point, &ops, true)?;
+        inner.wal_blocks += 1;
+        inner.tables.apply_block(point.clone(), ops);
+
+        self.maybe_checkpoint(&mut inner);
+
+        Ok(())
+    }
+
+    /// Rewinds the store to its state right after the block `point`, which may not have
+    /// written anything. Returns false if the block is older than the oldest checkpoint,
+    /// in which case the store is left as it was.
+    pub(crate) fn rewind(&self, point: &Point) -> Result<bool> {
+        let mut inner = self.write();
+
+        if let Some(ops) = inner.tables.undo_after(point) {
+            inner.append(KIND_REWIND, point, &ops, true)?;
+            inner.tables.apply_rewind(point, ops);
+            return Ok(true);
+        }
+
+        // The block is too old for the writes after it to be undone, so the store is
+        // rebuilt from the checkpoint preceding it, and checkpointed again.
+        let oldest = inner.segment.saturating_sub(MAX_CHECKPOINTS - 1);
+        if *point == Point::Origin && oldest == 0 {
+            inner.tables = load_checkpoint(&self.dir, 0)?;
+            inner.tables.point = Some(Point::Origin);
+            self.checkpoint(&mut inner)?;
+            return Ok(true);
+        }
+
+        // The current segment is already replayed in memory.
+        for segment in (oldest..inner.segment).rev() {
+            let wal = read_or_empty(&wal_path(&self.dir, segment))?;
+            let mut tables = load_checkpoint(&self.dir, segment)?;
+            replay(&wal, &mut tables);
+            if let Some(ops) = tables.undo_after(point) {
+                tables.apply_rewind(point, ops);
+                inner.tables = tables;
+                self.checkpoint(&mut inner)?;
+                return Ok(true);
+            }
+        }
+
+        Ok(false)
+    }
+
+    /// Takes a checkpoint if the current log segment grew large enough.
+    ///
+    /// Writes are durable whether or not the checkpoint succeeds, a failed checkpoint
+    /// is tried again on the next commit.
+    fn maybe_checkpoint(&self, inner: &mut Inner) {
+        let size = u64::try_from(inner.tables.size).unwrap_or(u64::MAX);
+        if inner.wal_len <= MIN_CHECKPOINT_SIZE.max(size) && inner.wal_blocks < CHECKPOINT_BLOCKS {
+            return;
+        }
+
+        if let Err(err) = self.checkpoint(inner) {
+            eprintln!(
+                "Failed to checkpoint the key-value store in {}: {err:#}",
+                self.dir.display()
+            );
+        }
+    }
+
+    /// Writes the whole store to a checkpoint starting a new log segment, and removes
+    /// the oldest segment if there are too many.
+    fn checkpoint(&self, inner: &mut Inner) -> Result<()> {
+        let segment = inner.segment + 1;
+
+        let mut checkpoint = Vec::new();
+        let mut chunk = Vec::new();
+        let mut chunk_size = 0;
+        for (key, value) in &inner.tables.memtable {
+            chunk.push((key, Some(value.as_slice())));
+            chunk_size += key.len() + value.len();
+            if chunk_size >= CHECKPOINT_RECORD_SIZE {
+                encode_record(
+                    &mut checkpoint,
+                    KIND_WRITES,
+                    &Point::Origin,
+                    chunk.drain(..),
+                )?;
+                chunk_size = 0;
+            }
+        }
+        if !chunk.is_empty() {
+            encode_record(
+                &mut checkpoint,
+                KIND_WRITES,
+                &Point::Origin,
+                chunk.drain(..),
+            )?;
+        }
+        if let Some(point) = &inner.tables.point {
+            encode_record(&mut checkpoint, KIND_POINT, point, std::iter::empty())?;
+        }
+
+        let wal = match self.start_segment(segment, &checkpoint) {
+            Ok(wal) => wal,
+            Err(err) => {
+                fs::remove_file(checkpoint_path(&self.dir, segment).with_extension("tmp")).ok();
+                fs::remove_file(wal_path(&self.dir, segment)).ok();
+                return Err(err);
+            },
+        };
+
+        inner.segment = segment;
+        inner.wal = wal;
+        inner.wal_len = 0;
+        inner.wal_blocks = 0;
+
+        if let Some(old) = segment.checked_sub(MAX_CHECKPOINTS) {
+            fs::remove_file(wal_path(&self.dir, old)).ok();
+            fs::remove_file(checkpoint_path(&self.dir, old)).ok();
+        }
+
+        Ok(())
+    }
+
+    /// Writes the log and then the checkpoint of `segment`, returning the log.
+    ///
+    /// The checkpoint appears at once, and comes last so that the store is reopened
+    /// from the segment in use if anything fails. If it can't be made durable, it is
+    /// removed, unless that fails as well, in which case the segment is complete and
+    /// to be used.
+    fn start_segment(&self, segment: u32, checkpoint: &[u8]) -> Result<File> {
+        let wal = open_append(&wal_path(&self.dir, segment))?;
+        wal.set_len(0)?;
+        wal.sync_all()?;
+
+        let path = checkpoint_path(&self.dir, segment);
+        let tmp_path = path.with_extension("tmp");
+        let mut tmp = File::create(&tmp_path)?;
+        tmp.write_all(checkpoint)?;
+        tmp.sync_all()?;
+        fs::rename(&tmp_path, &path)?;
+
+        if let Err(err) = File::open(&self.dir).and_then(|dir| dir.sync_all()) {
+            if fs::remove_file(&path).is_ok() {
+                return Err(err.into());
+            }
+        }
+
+        Ok(wal)
+    }
+
+    /// Locks the store for reading.
+    fn read(&self) -> RwLockReadGuard<'_, Inner> {
+        sync::read(&self.inner)
+    }
+
+    /// Locks the store for writing.
+    fn write(&self) -> RwLockWriteGuard<'_, Inner> {
+        sync::write(&self.inner)
+    }
+}
+
+/// Returns the slot of `point`, None for the origin, which comes before every slot.
+fn slot(point: &Point) -> Option<u64> {
+    match point {
+        Point::Origin => None,
+        Point::Specific(slot, _) => Some(*slot),
+    }
+}
+
+/// Returns the path of the log of `segment` in `dir`.
+fn wal_path(dir: &Path, segment: u32) -> PathBuf {
+    dir.join(format!("{segment:08}.wal"))
+}
+
+/// Returns the path of the checkpoint of `segment` in `dir`.
+fn checkpoint_path(dir: &Path, segment: u32) -> PathBuf {
+    dir.join(format!("{segment:08}.checkpoint"))
+}
+
+/// Loads the checkpoint of `segment` in `dir`.
+fn load_checkpoint(dir: &Path, segment: u32) -> Result<Tables> {
+    if segment == 0 {
+        return Ok(Tables::new(true));
+    }
+
+    let checkpoint = fs::read(checkpoint_path(dir, segment))?;
+    let mut tables = Tables::new(false);
+    if replay(&checkpoint, &mut tables).len != checkpoint.len() {
+        return Err(anyhow!("corrupted key-value store checkpoint"));
+    }
+
+    Ok(tables)
+}
+
+/// Reads the file at `path`, which is empty if it doesn't exist.
+fn read_or_empty(path: &Path) -> Result<Vec<u8>> {
+    match fs::read(path) {
+        Ok(data) => Ok(data),
+        Err(err) if err.kind() == ErrorKind::NotFound => Ok(Vec::new()),
+        Err(err) => Err(err.into()),
+    }
+}
+
+/// Opens `path` for appending, creating it if needed.
+fn open_append(path: &Path) -> Result<File> {
+    Ok(OpenOptions::new().create(true).append(true).open(path)?)
+}
+
+/// Appends a record of `kind` for the block `point` to `buf`.
+fn encode_record<'a>(
+    buf: &mut Vec<u8>, kind: u8, point: &Point,
+    ops: impl Iterator<Item = (&'a Vec<u8>, Option<&'a [u8]>)>,
+) -> Result<()> {
+    let mut encoded = vec![kind];
+    match point {
+        Point::Origin => encoded.push(0),
+        Point::Specific(slot, hash) => {
+            encoded.push(1);
+            encoded.extend_from_slice(&slot.to_le_bytes());
+            encoded.extend_from_slice(&u32::try_from(hash.len())?.to_le_bytes());
+            encoded.extend_from_slice(hash);
+        },
+    }
+
+    for (key, value) in ops {
+        encoded.push(if value.is_some() { OP_PUT } else { OP_DELETE });
+        encoded.extend_from_slice(&u32::try_from(key.len())?.to_le_bytes());
+        encoded.extend_from_slice(key);
+        if let Some(value) = value {
+            encoded.extend_from_slice(&u32::try_from(value.len())?.to_le_bytes());
+            encoded.extend_from_slice(value);
+        }
+    }
+
+    buf.reserve(HEADER_SIZE + encoded.len());
+    buf.extend_from_slice(&u32::try_from(encoded.len())?.to_le_bytes());
+    buf.extend_from_slice(&crc32fast::hash(&encoded).to_le_bytes());
+    buf.extend_from_slice(&encoded);
+
+    Ok(())
+}
+
+/// Outcome of replaying records.
+struct Replayed {
+    /// Length of the records replayed.
+    len: usize,
+    /// Number of block records replayed.
+    blocks: u64,
+}
+
+/// Applies the records of `data` to `tables`, up to the first incomplete or corrupted
+/// one.
+fn replay(data: &[u8], tables: &mut Tables) -> Replayed {
+    let mut replayed = Replayed { len: 0, blocks: 0 };
+
+    while let Some(record) = next_record(data, replayed.len) {
+        let Some((kind, point, ops)) = decode_record(record) else {
+            break;
+        };
+        replayed.len += HEADER_SIZE + record.len();
+
+        match kind {
+            KIND_BLOCK => {
+                tables.apply_block(point, ops);
+                replayed.blocks += 1;
+            },
+            KIND_REWIND => tables.apply_rewind(&point, ops),
+            KIND_POINT => tables.point = Some(point),
+            _ => {
+                for (key, value) in ops {
+                    tables.apply(key, value);
+                }
+            },
+        }
+    }
+
+    replayed
+}
+
+/// Returns the contents of the record at `pos` in `data`, if it is complete and
+/// intact.
+fn next_record(data: &[u8], pos: usize) -> Option<&[u8]> {
+    let len = usize::try_from(read_u32(data.get(pos..)?)?).ok()?;
+    let crc = read_u32(data.get(pos.checked_add(4)?..)?)?;
+
+    let start = pos.checked_add(HEADER_SIZE)?;
+    let record = data.get(start..start.checked_add(len)?)?;
+    (crc32fast::hash(record) == crc).then_some(record)
+}
+
+/// Decodes the kind, block and writes of a record, returning None if it is invalid.
+fn decode_record(mut record: &[u8]) -> Option<(u8, Point, Ops)> {
+    /// Takes `len` bytes from the start of `record`.
+    fn take<'a>(record: &mut &'a [u8], len: usize) -> Option<&'a [u8]> {
+        let bytes = record.get(..len)?;
+        *record = record.get(len..)?;
+        Some(bytes)
+    }
+
+    /// Takes a length-prefixed byte string from the start of `record`.
+    fn take_bytes(record: &mut &[u8]) -> Option<Vec<u8>> {
+        let len = usize::try_from(read_u32(take(record, 4)?)?).ok()?;
+        Some(take(record, len)?.to_vec())
+    }
+
+    let kind = *take(&mut record, 1)?.first()?;
+    let point = match take(&mut record, 1)?.first()? {
+        0 => Point::Origin,
+        1 => {
+            let slot = u64::from_le_bytes(take(&mut record, 8)?.try_into().ok()?);
+            Point::Specific(slot, take_bytes(&mut record)?)
+        },
+        _ => return None,
+    };
+
+    let mut ops = Vec::new();
+    while let Some(&op) = take(&mut record, 1).and_then(<[u8]>::first) {
+        let key = take_bytes(&mut record)?;
+        let value = match op {
+            OP_PUT => Some(take_bytes(&mut record)?),
+            OP_DELETE => None,
+            _ => return None,
+        };
+        ops.push((key, value));
+    }
+
+    Some((kind, point, ops))
+}
+
+/// Reads a little endian `u32` from the start of `data`.
+fn read_u32(data: &[u8]) -> Option<u32> {
+    Some(u32::from_le_bytes(data.get(..4)?.try_into().ok()?))
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the recovery and the rewinding of the store.
+
+    use std::{
+        fs::{self, OpenOptions},
+        io::Write,
+        path::{Path, PathBuf},
+    };
+
+    use cardano_chain_follower::Point;
+
+    use super::{checkpoint_path, wal_path, Batch, KvStore, DELTA_WINDOW};
+
+    /// Directory removed once the test is over.
+    struct TempDir(PathBuf);
+
+    impl TempDir {
+        /// Creates an empty directory for the test `name`.
+        fn new(name: &str) -> Self {
+            let dir = std::env::temp_dir().join(format!("hermes-kv-{name}-{}", std::process::id()));
+            fs::remove_dir_all(&dir).ok();
+            Self(dir)
+        }
+
+        /// Returns the path of the directory.
+        fn path(&self) -> &Path {
+            &self.0
+        }
+    }
+
+    impl Drop for TempDir {
+        fn drop(&mut self) {
+            fs::remove_dir_all(&self.0).ok();
+        }
+    }
+
+    /// Returns the point of a block at `slot`.
+    fn point(slot: u64) -> Point {
+        Point::Specific(slot, slot.to_le_bytes().to_vec())
+    }
+
+    /// Returns a batch setting each key to its value.
+    fn batch(writes: &[(&str, &str)]) -> Batch {
+        let mut batch = Batch::default();
+        for (key, value) in writes {
+            batch.put(key.as_bytes().to_vec(), value.as_bytes().to_vec());
+        }
+        batch
+    }
+
+    /// Returns the value of `key` in `store` as a string.
+    fn get(store: &KvStore, key: &str) -> Option<String> {
+        store
+            .get(key.as_bytes())
+            .map(|value| String::from_utf8(value).expect("invalid value"))
+    }
+
+    /// A batch torn by an interrupted commit is discarded on opening, and the log goes
+    /// on from the last complete batch.
+    #[test]
+    fn replay_after_torn_tail() {
+        let dir = TempDir::new("torn-tail");
+        let store = KvStore::open(dir.path()).expect("open");
+        store
+            .commit(&point(1), &batch(&[("a", "1")]))
+            .expect("commit");
+        store
+            .commit(&point(2), &batch(&[("b", "2")]))
+            .expect("commit");
+        drop(store);
+
+        // Cut the last record short, as if the node stopped while writing it.
+        let path = wal_path(dir.path(), 0);
+        let len = fs::metadata(&path).expect("metadata").len();
+        OpenOptions::new()
+            .write(true)
+            .open(&path)
+            .expect("open log")
+            .set_len(len - 3)
+            .expect("truncate log");
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+        assert_eq!(get(&store, "b"), None);
+
+        store
+            .commit(&point(3), &batch(&[("c", "3")]))
+            .expect("commit");
+        drop(store);
+
+        // Garbage after the last record is discarded just the same.
+        OpenOptions::new()
+            .append(true)
+            .open(&path)
+            .expect("open log")
+            .write_all(&[0xFF; 16])
+            .expect("append garbage");
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+        assert_eq!(get(&store, "c").as_deref(), Some("3"));
+        assert!(store.rewind(&point(1)).expect("rewind"));
+        assert_eq!(get(&store, "c"), None);
+    }
+
+    /// Rewinding within the deltas undoes the later batches, deletions included, and
+    /// writes made after the rewind replace the undone ones.
+    #[test]
+    fn rewind_within_deltas() {
+        let dir = TempDir::new("rewind-deltas");
+        let store = KvStore::open(dir.path()).expect("open");
+
+        store
+            .commit(&point(1), &batch(&[("a", "1"), ("b", "1")]))
+            .expect("commit");
+        let mut deletion = batch(&[("a", "2")]);
+        deletion.delete(b"b".to_vec());
+        store.commit(&point(2), &deletion).expect("commit");
+        store
+            .commit(&point(3), &batch(&[("c", "3")]))
+            .expect("commit");
+
+        assert!(store.rewind(&point(1)).expect("rewind"));
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+        assert_eq!(get(&store, "b").as_deref(), Some("1"));
+        assert_eq!(get(&store, "c"), None);
+
+        store
+            .commit(&point(4), &batch(&[("d", "4")]))
+            .expect("commit");
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+        assert_eq!(get(&store, "c"), None);
+        assert_eq!(get(&store, "d").as_deref(), Some("4"));
+
+        assert!(store.rewind(&Point::Origin).expect("rewind"));
+        assert_eq!(get(&store, "a"), None);
+        assert_eq!(get(&store, "d"), None);
+    }
+
+    /// Rewinding to a block older than the deltas rebuilds the store from the log.
+    #[test]
+    fn rewind_beyond_deltas() {
+        let dir = TempDir::new("rewind-log");
+        let store = KvStore::open(dir.path()).expect("open");
+
+        let blocks = u64::try_from(DELTA_WINDOW).expect("window") + 10;
+        for slot in 1..=blocks {
+            let value = slot.to_string();
+            store
+                .commit(&point(slot), &batch(&[("n", &value), (&value, "")]))
+                .expect("commit");
+        }
+
+        assert!(store.rewind(&point(5)).expect("rewind"));
+        assert_eq!(get(&store, "n").as_deref(), Some("5"));
+        assert_eq!(get(&store, "5").as_deref(), Some(""));
+        assert_eq!(get(&store, "6"), None);
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "n").as_deref(), Some("5"));
+        assert_eq!(get(&store, "6"), None);
+    }
+
+    /// The store can be rewound to a block that wrote nothing, before and after being
+    /// reopened.
+    #[test]
+    fn rewind_to_block_without_writes() {
+        let dir = TempDir::new("rewind-empty");
+        let store = KvStore::open(dir.path()).expect("open");
+
+        store
+            .commit(&point(1), &batch(&[("a", "1")]))
+            .expect("commit");
+        store.commit(&point(2), &Batch::default()).expect("commit");
+        store
+            .commit(&point(3), &batch(&[("a", "3"), ("b", "3")]))
+            .expect("commit");
+        store
+            .commit(&point(4), &batch(&[("c", "4")]))
+            .expect("commit");
+
+        assert!(store.rewind(&point(3)).expect("rewind"));
+        assert_eq!(get(&store, "c"), None);
+        assert_eq!(get(&store, "a").as_deref(), Some("3"));
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "c"), None);
+        assert!(store.rewind(&point(2)).expect("rewind"));
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+        assert_eq!(get(&store, "b"), None);
+    }
+
+    /// A failed checkpoint leaves the store in its current segment, so the batches
+    /// committed after it are found again once the store is reopened.
+    #[test]
+    fn failed_checkpoint() {
+        let dir = TempDir::new("failed-checkpoint");
+        let store = KvStore::open(dir.path()).expect("open");
+        store
+            .commit(&point(1), &batch(&[("a", "1")]))
+            .expect("commit");
+
+        // The log of the next segment can't be created where a directory is.
+        fs::create_dir(wal_path(dir.path(), 1)).expect("create directory");
+        assert!(store.checkpoint(&mut store.write()).is_err());
+        assert!(!checkpoint_path(dir.path(), 1).exists());
+
+        store
+            .commit(&point(2), &batch(&[("b", "2")]))
+            .expect("commit");
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+        assert_eq!(get(&store, "b").as_deref(), Some("2"));
+
+        // Once the checkpoint can be taken, batches go to the next segment.
+        fs::remove_dir(wal_path(dir.path(), 1)).expect("remove directory");
+        store.checkpoint(&mut store.write()).expect("checkpoint");
+        store
+            .commit(&point(3), &batch(&[("c", "3")]))
+            .expect("commit");
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(get(&store, "b").as_deref(), Some("2"));
+        assert_eq!(get(&store, "c").as_deref(), Some("3"));
+        assert!(
+            fs::metadata(wal_path(dir.path(), 1))
+                .expect("metadata")
+                .len()
+                > 0
+        );
+    }
+
+    /// The last block committed, with or without writes, or rewound to is found again
+    /// once the store is reopened, checkpointed or not.
+    #[test]
+    fn point_survives_reopen() {
+        let dir = TempDir::new("point");
+        let store = KvStore::open(dir.path()).expect("open");
+        assert_eq!(store.point(), None);
+
+        store
+            .commit(&point(1), &batch(&[("a", "1")]))
+            .expect("commit");
+        store.commit(&point(2), &Batch::default()).expect("commit");
+        assert_eq!(store.point(), Some(point(2)));
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(store.point(), Some(point(2)));
+        assert!(store.rewind(&point(1)).expect("rewind"));
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(store.point(), Some(point(1)));
+        store.commit(&point(3), &Batch::default()).expect("commit");
+        store.checkpoint(&mut store.write()).expect("checkpoint");
+        drop(store);
+
+        let store = KvStore::open(dir.path()).expect("reopen");
+        assert_eq!(store.point(), Some(point(3)));
+        assert_eq!(get(&store, "a").as_deref(), Some("1"));
+    }
+}
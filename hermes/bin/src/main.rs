@@ -1,5 +1,173 @@
 //! The Hermes Node
+//!
+//! Runs the apps given as arguments on the chain followed from the node at
+//! `HERMES_NODE_ADDR`, on the network named by `HERMES_NETWORK` (mainnet by default).
+//! Without a node to follow, the apps are only instantiated once, to check them.
+//! Immutable blocks are kept in `HERMES_BLOCKS_DIR`, if set, and read from there
+//! rather than from the node.
+//!
+//! Apps with a key-value store, kept in `HERMES_DATA_DIR`, resume from the last block
+//! they handled when the node restarts. The others follow the chain from its tip, or
+//! from where the apps that resume do.
+//!
+//! An app can be given its own time slice and time budget, in milliseconds, as
+//! `PATH@SLICE/BUDGET`.
 
-fn main() {
-    println!("Hello, world!");
+mod cache;
+mod chain;
+mod dispatcher;
+mod http;
+mod kv;
+mod metrics;
+mod runtime;
+mod status;
+mod sync;
+
+use std::{
+    env, fs,
+    net::SocketAddr,
+    sync::Arc,
+    thread,
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, bail, Result};
+use cardano_chain_follower::{BlockStore, Follower, FollowerConfigBuilder, Network, Point};
+use chain::ChainApp;
+use dispatcher::Dispatcher;
+use runtime::{App, Runtime, RuntimeConfig};
+use status::StatusFeed;
+use tokio::{net::TcpListener, runtime::Handle};
+
+/// Interval between two updates of the status feed.
+const STATUS_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Maximum number of updates taken from the follower, and passed to an app, at once.
+const DISPATCH_BATCH: usize = 64;
+
+#[tokio::main]
+async fn main() -> Result<()> {
+    let config = RuntimeConfig {
+        cache_dir: env::var_os("HERMES_CACHE_DIR").map(Into::into),
+        data_dir: env::var_os("HERMES_DATA_DIR").map(Into::into),
+        ..RuntimeConfig::default()
+    };
+    let runtime = Arc::new(Runtime::new(&config)?);
+
+    let apps = env::args()
+        .skip(1)
+        .map(|arg| load_app(&runtime, &arg).map(Arc::new))
+        .collect::<Result<Vec<_>>>()?;
+
+    let Ok(address) = env::var("HERMES_NODE_ADDR") else {
+        for app in &apps {
+            let start = Instant::now();
+            let instance = runtime.instantiate(app).await?;
+            println!("Instantiated {} in {:?}", app.name(), start.elapsed());
+            drop(instance);
+        }
+        return Ok(());
+    };
+    let network = match env::var("HERMES_NETWORK") {
+        Ok(name) => network(&name)?,
+        Err(_) => Network::Mainnet,
+    };
+
+    // The chain is followed from the block the furthest behind of the apps last
+    // handled.
+    let start = apps
+        .iter()
+        .filter_map(|app| app.point())
+        .min_by_key(|point| {
+            match point {
+                Point::Origin => None,
+                Point::Specific(slot, _) => Some(*slot),
+            }
+        });
+
+    let threads = thread::available_parallelism().map_or(1, Into::into);
+    let dispatcher = Dispatcher::new(&Handle::current(), threads, DISPATCH_BATCH)?;
+    for app in apps {
+        dispatcher.subscribe(ChainApp::new(Arc::clone(&runtime), app, start.as_ref()));
+    }
+
+    // Metrics are only collected when they are exported.
+    if let Ok(addr) = env::var("HERMES_METRICS_ADDR") {
+        let listener = TcpListener::bind(addr.parse::<SocketAddr>()?).await?;
+        metrics::enable();
+        let collectors = vec![dispatcher.collector()];
+        tokio::spawn(async move {
+            if let Err(err) = metrics::serve(listener, collectors).await {
+                eprintln!("Stopped serving metrics: {err:#}");
+            }
+        });
+    }
+
+    // The status feed is sampled from the metrics.
+    if let Ok(addr) = env::var("HERMES_STATUS_ADDR") {
+        let listener = TcpListener::bind(addr.parse::<SocketAddr>()?).await?;
+        metrics::enable();
+        let feed = StatusFeed::new(vec![dispatcher.status_source()], STATUS_INTERVAL);
+        tokio::spawn(Arc::clone(&feed).run());
+        tokio::spawn(async move {
+            if let Err(err) = feed.serve(listener).await {
+                eprintln!("Stopped serving the status feed: {err:#}");
+            }
+        });
+    }
+
+    let mut follower_config = FollowerConfigBuilder::default();
+    if let Some(point) = start {
+        follower_config = follower_config.follow_from(point);
+    }
+    if let Some(dir) = env::var_os("HERMES_BLOCKS_DIR") {
+        let store = BlockStore::open(&dir)
+            .map_err(|err| anyhow!("failed to open the block store: {err}"))?;
+        follower_config = follower_config.block_store(Arc::new(store));
+    }
+
+    let mut follower = Follower::connect(&address, network, follower_config.build())
+        .await
+        .map_err(|err| anyhow!("failed to connect to {address}: {err}"))?;
+    let result = dispatcher.follow(&mut follower, DISPATCH_BATCH).await;
+    if let Err(err) = follower.close().await {
+        eprintln!("Failed to close the follower: {err}");
+    }
+
+    result
+}
+
+/// Loads the app at the path given by `arg`, with the time limits it gives if any.
+fn load_app(runtime: &Runtime, arg: &str) -> Result<App> {
+    let (path, limits) = match arg.rsplit_once('@') {
+        Some((path, limits)) => (path, Some(limits)),
+        None => (arg, None),
+    };
+    let mut app = runtime.load_app(path, &fs::read(path)?)?;
+
+    if let Some(limits) = limits {
+        let millis = |limit: &str| {
+            limit
+                .parse()
+                .map(Duration::from_millis)
+                .map_err(|err| anyhow!("invalid time limit of {path}: {err}"))
+        };
+        let Some((slice, budget)) = limits.split_once('/') else {
+            bail!("invalid time limits of {path}, expected SLICE/BUDGET");
+        };
+        runtime.set_time_limits(&mut app, millis(slice)?, millis(budget)?);
+    }
+
+    Ok(app)
+}
+
+/// Returns the network called `name`.
+fn network(name: &str) -> Result<Network> {
+    match name {
+        "mainnet" => Ok(Network::Mainnet),
+        "preprod" => Ok(Network::Preprod),
+        "preview" => Ok(Network::Preview),
+        "testnet" => Ok(Network::Testnet),
+        _ => bail!("unknown network {name}"),
+    }
 }
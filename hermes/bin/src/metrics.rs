@@ -0,0 +1,416 @@
+//! Metrics of the node, exported in the Prometheus text format.
+//!
+//! Metrics are atomics in static storage, or in the state of the component they
+//! measure, so recording one is a couple of relaxed atomic operations and never
+//! allocates. Collection is off until [`enable`] is called: every recording site checks
+//! a single flag first, and timings don't read the clock while it is off.
+
+use std::{
+    convert::Infallible,
+    fmt::{Display, Write},
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
+};
+
+use anyhow::Result;
+use http_body_util::Full;
+use hyper::{
+    body::Bytes,
+    header::{HeaderValue, CONTENT_TYPE},
+    server::conn::http1,
+    service::service_fn,
+    Response,
+};
+use hyper_util::rt::TokioIo;
+use tokio::net::TcpListener;
+
+/// Whether metrics are collected.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+/// Upper bounds of the histogram buckets, in microseconds, from 1µs to about 1s.
+const BUCKETS: [u64; 11] = [
+    1, 4, 16, 64, 256, 1_024, 4_096, 16_384, 65_536, 262_144, 1_048_576,
+];
+
+/// Blocks received by the follower.
+pub(crate) static FOLLOWER_BLOCKS: Counter = Counter::new();
+/// Rollbacks received by the follower.
+pub(crate) static FOLLOWER_ROLLBACKS: Counter = Counter::new();
+/// Slot of the last block received by the follower, or rolled back to.
+pub(crate) static FOLLOWER_TIP_SLOT: Gauge = Gauge::new();
+/// Height of the last block received by the follower, or rolled back to.
+pub(crate) static FOLLOWER_TIP_HEIGHT: Gauge = Gauge::new();
+/// Updates held by the buffer of the follower.
+pub(crate) static FOLLOWER_BUFFER_OCCUPANCY: Gauge = Gauge::new();
+/// Capacity of the buffer of the follower.
+pub(crate) static FOLLOWER_BUFFER_CAPACITY: Gauge = Gauge::new();
+/// Nanoseconds the follower waited for the dispatcher to take updates.
+pub(crate) static FOLLOWER_PRODUCER_STALL: Gauge = Gauge::new();
+/// Nanoseconds the dispatcher waited for the follower to receive updates.
+pub(crate) static FOLLOWER_CONSUMER_STALL: Gauge = Gauge::new();
+/// Time to decode the header of a block passed to an app.
+pub(crate) static BLOCK_DECODE: Histogram = Histogram::new();
+/// Time to instantiate an app.
+pub(crate) static INSTANTIATE: Histogram = Histogram::new();
+/// Latency of the host calls of the apps, by function.
+static HOST_CALLS: [Histogram; HostCall::ALL.len()] = {
+    /// Histogram the array is filled with.
+    const EMPTY: Histogram = Histogram::new();
+    [EMPTY; HostCall::ALL.len()]
+};
+
+/// Starts collecting metrics.
+pub(crate) fn enable() {
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+/// Returns whether metrics are collected.
+#[inline]
+pub(crate) fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// A monotonic count.
+pub(crate) struct Counter(AtomicU64);
+
+impl Counter {
+    /// Creates a counter at zero.
+    pub(crate) const fn new() -> Self {
+        Self(AtomicU64::new(0))
+    }
+
+    /// Adds `n` to the counter, if metrics are collected.
+    #[inline]
+    pub(crate) fn add(&self, n: u64) {
+        if enabled() {
+            self.0.fetch_add(n, Ordering::Relaxed);
+        }
+    }
+
+    /// Adds one to the counter, if metrics are collected.
+    #[inline]
+    pub(crate) fn inc(&self) {
+        self.add(1);
+    }
+
+    /// Returns the count.
+    pub(crate) fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// A value that can go up and down.
+pub(crate) struct Gauge(AtomicU64);
+
+impl Gauge {
+    /// Creates a gauge at zero.
+    pub(crate) const fn new() -> Self {
+        Self(AtomicU64::new(0))
+    }
+
+    /// Sets the value of the gauge, if metrics are collected.
+    #[inline]
+    pub(crate) fn set(&self, value: u64) {
+        if enabled() {
+            self.0.store(value, Ordering::Relaxed);
+        }
+    }
+
+    /// Returns the value of the gauge.
+    pub(crate) fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// Distribution of durations, in exponential buckets.
+pub(crate) struct Histogram {
+    /// Number of durations in each bucket, not cumulated, the last one for those
+    /// above every bound.
+    buckets: [AtomicU64; BUCKETS.len() + 1],
+    /// Sum of the durations, in nanoseconds.
+    sum: AtomicU64,
+}
+
+impl Histogram {
+    /// Creates an empty histogram.
+    pub(crate) const fn new() -> Self {
+        /// Bucket the array is filled with.
+        const ZERO: AtomicU64 = AtomicU64::new(0);
+
+        Self {
+            buckets: [ZERO; BUCKETS.len() + 1],
+            sum: AtomicU64::new(0),
+        }
+    }
+
+    /// Records `duration`.
+    pub(crate) fn observe(&self, duration: Duration) {
+        let micros = u64::try_from(duration.as_micros()).unwrap_or(u64::MAX);
+        let bucket = BUCKETS.partition_point(|&bound| bound < micros);
+        if let Some(bucket) = self.buckets.get(bucket) {
+            bucket.fetch_add(1, Ordering::Relaxed);
+        }
+
+        self.sum.fetch_add(nanos(duration), Ordering::Relaxed);
+    }
+}
+
+/// Measures a duration, if metrics are collected when it starts.
+#[must_use]
+pub(crate) struct Timer(Option<Instant>);
+
+impl Timer {
+    /// Starts measuring.
+    #[inline]
+    pub(crate) fn start() -> Self {
+        Self(enabled().then(Instant::now))
+    }
+
+    /// Returns the time elapsed since the timer started, if it measures.
+    pub(crate) fn elapsed(&self) -> Option<Duration> {
+        self.0.map(|start| start.elapsed())
+    }
+
+    /// Records the time elapsed since the timer started in `histogram`.
+    pub(crate) fn observe(self, histogram: &Histogram) {
+        if let Some(elapsed) = self.elapsed() {
+            histogram.observe(elapsed);
+        }
+    }
+}
+
+/// Functions the node implements for the apps.
+#[derive(Debug, Clone, Copy)]
+pub(crate) enum HostCall {
+    /// `hermes:cardano/block.[method]cardano-block.tx`.
+    BlockTx,
+    /// `hermes:cardano/block.[method]cardano-block.tx-count`.
+    BlockTxCount,
+    /// `hermes:kv/store.get`.
+    KvGet,
+    /// `hermes:kv/store.set`.
+    KvSet,
+    /// `hermes:kv/store.delete`.
+    KvDelete,
+    /// `wasi:http/outgoing-handler.handle`, up to the response headers.
+    HttpHandle,
+}
+
+impl HostCall {
+    /// Every host call, in the order of their histograms.
+    const ALL: [Self; 6] = [
+        Self::BlockTx,
+        Self::BlockTxCount,
+        Self::KvGet,
+        Self::KvSet,
+        Self::KvDelete,
+        Self::HttpHandle,
+    ];
+
+    /// Returns the WIT name of the function.
+    fn name(self) -> &'static str {
+        match self {
+            Self::BlockTx => "hermes:cardano/block.[method]cardano-block.tx",
+            Self::BlockTxCount => "hermes:cardano/block.[method]cardano-block.tx-count",
+            Self::KvGet => "hermes:kv/store.get",
+            Self::KvSet => "hermes:kv/store.set",
+            Self::KvDelete => "hermes:kv/store.delete",
+            Self::HttpHandle => "wasi:http/outgoing-handler.handle",
+        }
+    }
+
+    /// Returns the latency histogram of the function.
+    fn histogram(self) -> Option<&'static Histogram> {
+        HOST_CALLS.get(self as usize)
+    }
+
+    /// Records the latency of a call to the function measured by `timer`.
+    pub(crate) fn observe(self, timer: Timer) {
+        if let Some(histogram) = self.histogram() {
+            timer.observe(histogram);
+        }
+    }
+
+    /// Runs the host function `f`, recording its latency.
+    #[inline]
+    pub(crate) fn measure<T>(self, f: impl FnOnce() -> T) -> T {
+        let timer = Timer::start();
+        let res = f();
+        self.observe(timer);
+        res
+    }
+}
+
+/// Source of metrics rendered on every scrape, for metrics held by a component.
+pub(crate) trait Collector: Send + Sync {
+    /// Writes the metrics of the component to `encoder`.
+    fn collect(&self, encoder: &mut Encoder);
+}
+
+/// Writer of metrics in the Prometheus text format.
+#[derive(Default)]
+pub(crate) struct Encoder {
+    /// Text written so far.
+    out: String,
+}
+
+impl Encoder {
+    /// Starts the metric family `name` of `kind` (`counter`, `gauge` or `histogram`).
+    pub(crate) fn family(&mut self, name: &str, kind: &str, help: &str) {
+        writeln!(self.out, "# HELP {name} {help}").ok();
+        writeln!(self.out, "# TYPE {name} {kind}").ok();
+    }
+
+    /// Writes a sample of the current family.
+    pub(crate) fn sample(&mut self, name: &str, labels: &[(&str, &str)], value: impl Display) {
+        self.out.push_str(name);
+        if !labels.is_empty() {
+            self.out.push('{');
+            for (i, (label, value)) in labels.iter().enumerate() {
+                if i > 0 {
+                    self.out.push(',');
+                }
+                write!(self.out, "{label}=\"").ok();
+                for c in value.chars() {
+                    match c {
+                        '\\' => self.out.push_str("\\\\"),
+                        '"' => self.out.push_str("\\\""),
+                        '\n' => self.out.push_str("\\n"),
+                        c => self.out.push(c),
+                    }
+                }
+                self.out.push('"');
+            }
+            self.out.push('}');
+        }
+        writeln!(self.out, " {value}").ok();
+    }
+
+    /// Writes the samples of `histogram` in the current family.
+    pub(crate) fn histogram(&mut self, name: &str, labels: &[(&str, &str)], histogram: &Histogram) {
+        let mut bucket_labels = labels.to_vec();
+        let mut count = 0;
+        for (i, bucket) in histogram.buckets.iter().enumerate() {
+            count += bucket.load(Ordering::Relaxed);
+            let bound = BUCKETS
+                .get(i)
+                .map_or_else(|| "+Inf".to_owned(), |&micros| seconds(micros * 1_000));
+            bucket_labels.push(("le", &bound));
+            self.sample(&format!("{name}_bucket"), &bucket_labels, count);
+            bucket_labels.pop();
+        }
+
+        let sum = seconds(histogram.sum.load(Ordering::Relaxed));
+        self.sample(&format!("{name}_sum"), labels, sum);
+        self.sample(&format!("{name}_count"), labels, count);
+    }
+
+    /// Returns the text written.
+    fn finish(self) -> String {
+        self.out
+    }
+}
+
+/// Returns `duration` in nanoseconds, saturating.
+pub(crate) fn nanos(duration: Duration) -> u64 {
+    u64::try_from(duration.as_nanos()).unwrap_or(u64::MAX)
+}
+
+/// Formats `nanos` nanoseconds in seconds.
+pub(crate) fn seconds(nanos: u64) -> String {
+    format!("{}.{:09}", nanos / 1_000_000_000, nanos % 1_000_000_000)
+}
+
+/// Writes the metrics held in static storage.
+fn collect_node(encoder: &mut Encoder) {
+    let name = "hermes_follower_blocks_total";
+    encoder.family(name, "counter", "Blocks received from the chain.");
+    encoder.sample(name, &[], FOLLOWER_BLOCKS.get());
+
+    let name = "hermes_follower_rollbacks_total";
+    encoder.family(name, "counter", "Rollbacks received from the chain.");
+    encoder.sample(name, &[], FOLLOWER_ROLLBACKS.get());
+
+    let name = "hermes_follower_tip_slot";
+    encoder.family(name, "gauge", "Slot of the tip of the followed chain.");
+    encoder.sample(name, &[], FOLLOWER_TIP_SLOT.get());
+
+    let name = "hermes_follower_tip_height";
+    encoder.family(name, "gauge", "Height of the tip of the followed chain.");
+    encoder.sample(name, &[], FOLLOWER_TIP_HEIGHT.get());
+
+    let name = "hermes_follower_buffer_occupancy";
+    encoder.family(name, "gauge", "Chain updates held by the follower buffer.");
+    encoder.sample(name, &[], FOLLOWER_BUFFER_OCCUPANCY.get());
+
+    let name = "hermes_follower_buffer_capacity";
+    encoder.family(name, "gauge", "Capacity of the follower buffer.");
+    encoder.sample(name, &[], FOLLOWER_BUFFER_CAPACITY.get());
+
+    let name = "hermes_follower_producer_stall_seconds_total";
+    encoder.family(
+        name,
+        "counter",
+        "Time the follower waited for room in its buffer.",
+    );
+    encoder.sample(name, &[], seconds(FOLLOWER_PRODUCER_STALL.get()));
+
+    let name = "hermes_follower_consumer_stall_seconds_total";
+    encoder.family(name, "counter", "Time the node waited for chain updates.");
+    encoder.sample(name, &[], seconds(FOLLOWER_CONSUMER_STALL.get()));
+
+    let name = "hermes_block_decode_seconds";
+    encoder.family(
+        name,
+        "histogram",
+        "Time to decode a block passed to an app.",
+    );
+    encoder.histogram(name, &[], &BLOCK_DECODE);
+
+    let name = "hermes_app_instantiate_seconds";
+    encoder.family(name, "histogram", "Time to instantiate an app.");
+    encoder.histogram(name, &[], &INSTANTIATE);
+
+    let name = "hermes_host_call_seconds";
+    encoder.family(name, "histogram", "Latency of the host calls of the apps.");
+    for (call, histogram) in HostCall::ALL.iter().zip(&HOST_CALLS) {
+        encoder.histogram(name, &[("function", call.name())], histogram);
+    }
+}
+
+/// Serves the metrics on `listener`, at any path, until the listener fails.
+pub(crate) async fn serve(
+    listener: TcpListener, collectors: Vec<Arc<dyn Collector>>,
+) -> Result<()> {
+    let collectors = Arc::new(collectors);
+
+    loop {
+        let (stream, _) = listener.accept().await?;
+
+        let collectors = Arc::clone(&collectors);
+        let service = service_fn(move |_request| {
+            let mut encoder = Encoder::default();
+            collect_node(&mut encoder);
+            for collector in collectors.iter() {
+                collector.collect(&mut encoder);
+            }
+
+            let mut resp = Response::new(Full::new(Bytes::from(encoder.finish())));
+            resp.headers_mut().insert(
+                CONTENT_TYPE,
+                HeaderValue::from_static("text/plain; version=0.0.4"),
+            );
+            async move { Ok::<_, Infallible>(resp) }
+        });
+
+        tokio::spawn(async move {
+            http1::Builder::new()
+                .serve_connection(TokioIo::new(stream), service)
+                .await
+                .ok();
+        });
+    }
+}
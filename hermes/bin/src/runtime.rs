@@ -0,0 +1,412 @@
+//! Runtime hosting the WASM apps of the node.
+//!
+//! Apps are instantiated often, once per chain event, so instances are allocated from a
+//! pool reserved up front, and linear memories are initialized by mapping the module's
+//! memory image copy-on-write, so a new instance only pays for the pages it writes to.
+//!
+//! Apps run asynchronously and are interrupted at every epoch deadline, once per time
+//! slice: an interrupted app yields back to whoever polls it, which lets the dispatcher
+//! run other apps in between, and an app that overruns its time budget is trapped.
+
+use std::{
+    path::PathBuf,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+
+use anyhow::{anyhow, Result};
+use cardano_chain_follower::Point;
+use wasmtime::{
+    component::{Component, Instance, InstancePre, Linker, Resource},
+    Config, Engine, InstanceAllocationStrategy, PoolingAllocationConfig, Store, UpdateDeadline,
+};
+use wasmtime_wasi::preview2::{self, command, Table, WasiCtx, WasiCtxBuilder, WasiView};
+use wasmtime_wasi_http::{
+    bindings::http::{outgoing_handler, types},
+    types::{HostFutureIncomingResponse, OutgoingRequest},
+    WasiHttpCtx, WasiHttpView,
+};
+
+use crate::{
+    cache::ComponentCache,
+    chain::CardanoApp,
+    http::{HttpClient, HttpConfig},
+    kv::{self, KvSession, KvStore},
+    metrics::{self, HostCall, Timer},
+};
+
+/// Core instances of an app component: the app module, the WASI adapter and the shim
+/// modules linking them, with room to spare.
+const CORE_INSTANCES_PER_APP: u32 = 16;
+
+/// Linear memories of an app component.
+const MEMORIES_PER_APP: u32 = 2;
+
+/// Tables of an app component.
+const TABLES_PER_APP: u32 = 4;
+
+/// Configuration of the app runtime.
+#[derive(Debug, Clone)]
+pub(crate) struct RuntimeConfig {
+    /// Maximum number of app instances alive at once, which is the size of the pool.
+    pub(crate) max_instances: u32,
+    /// Maximum size of the linear memory of an app instance, in WASM pages.
+    pub(crate) max_memory_pages: u64,
+    /// Bytes at the start of a pooled memory or table that are zeroed in place when its
+    /// slot is reused, instead of being unmapped and faulted in again.
+    pub(crate) keep_resident: usize,
+    /// Directory of the cache of compiled apps, if apps are to be cached.
+    pub(crate) cache_dir: Option<PathBuf>,
+    /// Interval between two epochs, which is the granularity of time slices.
+    pub(crate) epoch_tick: Duration,
+    /// Default time an app runs before yielding.
+    pub(crate) time_slice: Duration,
+    /// Default time an app can run to handle an event before it is trapped.
+    pub(crate) time_budget: Duration,
+    /// Configuration of the HTTP client of the apps.
+    pub(crate) http: HttpConfig,
+    /// Directory of the persistent data of the apps, without which apps have no
+    /// key-value store.
+    pub(crate) data_dir: Option<PathBuf>,
+}
+
+impl Default for RuntimeConfig {
+    fn default() -> Self {
+        Self {
+            max_instances: 1000,
+            // 64 MiB.
+            max_memory_pages: 1024,
+            keep_resident: 64 * 1024,
+            cache_dir: None,
+            epoch_tick: Duration::from_millis(1),
+            time_slice: Duration::from_millis(10),
+            time_budget: Duration::from_secs(10),
+            http: HttpConfig::default(),
+            data_dir: None,
+        }
+    }
+}
+
+/// Time limits of the invocations of an app, in epochs.
+#[derive(Debug, Clone, Copy)]
+struct TimeLimits {
+    /// Epochs an app runs before yielding.
+    slice: u64,
+    /// Time slices an invocation can take before it is trapped.
+    max_slices: u64,
+}
+
+impl TimeLimits {
+    /// Converts a time slice and a time budget to epochs of `epoch_tick`.
+    fn new(epoch_tick: Duration, time_slice: Duration, time_budget: Duration) -> Self {
+        let ticks = |time: Duration| {
+            u64::try_from(time.as_nanos() / epoch_tick.as_nanos().max(1)).unwrap_or(u64::MAX)
+        };
+        let slice = ticks(time_slice).max(1);
+
+        Self {
+            slice,
+            max_slices: (ticks(time_budget) / slice).max(1),
+        }
+    }
+}
+
+/// State of an app instance.
+pub(crate) struct AppState {
+    /// Resources owned by the instance.
+    table: Table,
+    /// WASI context of the instance.
+    wasi: WasiCtx,
+    /// WASI HTTP context of the instance.
+    http_ctx: WasiHttpCtx,
+    /// HTTP client shared by all the instances.
+    http: Arc<HttpClient>,
+    /// Key-value store of the app, if it has one.
+    kv: Option<KvSession>,
+    /// Time slices taken by the current invocation.
+    slices: u64,
+}
+
+impl AppState {
+    /// Returns the key-value store of the app, if it has one.
+    pub(crate) fn kv_mut(&mut self) -> Option<&mut KvSession> {
+        self.kv.as_mut()
+    }
+}
+
+impl WasiView for AppState {
+    fn table(&self) -> &Table {
+        &self.table
+    }
+
+    fn table_mut(&mut self) -> &mut Table {
+        &mut self.table
+    }
+
+    fn ctx(&self) -> &WasiCtx {
+        &self.wasi
+    }
+
+    fn ctx_mut(&mut self) -> &mut WasiCtx {
+        &mut self.wasi
+    }
+}
+
+impl WasiHttpView for AppState {
+    fn ctx(&mut self) -> &mut WasiHttpCtx {
+        &mut self.http_ctx
+    }
+
+    fn table(&mut self) -> &mut Table {
+        &mut self.table
+    }
+
+    /// Sends the request with the shared client, rather than over a new connection.
+    fn send_request(
+        &mut self, request: OutgoingRequest,
+    ) -> wasmtime::Result<Resource<HostFutureIncomingResponse>> {
+        let client = Arc::clone(&self.http);
+        let timer = Timer::start();
+        let response = preview2::spawn(async move {
+            let res = client.send(request).await;
+            HostCall::HttpHandle.observe(timer);
+            Ok(res)
+        });
+
+        Ok(self.table.push(HostFutureIncomingResponse::new(response))?)
+    }
+}
+
+/// An app, compiled and linked ahead of its instantiations.
+pub(crate) struct App {
+    /// Name of the app.
+    name: String,
+    /// App component with its imports resolved.
+    pre: InstancePre<AppState>,
+    /// Time limits of the invocations of the app.
+    limits: TimeLimits,
+    /// Key-value store of the app, if it has one.
+    kv: Option<Arc<KvStore>>,
+}
+
+impl App {
+    /// Returns the name of the app.
+    pub(crate) fn name(&self) -> &str {
+        &self.name
+    }
+
+    /// Returns the last block the app handled, as recorded by its key-value store, if
+    /// it has one.
+    pub(crate) fn point(&self) -> Option<Point> {
+        self.kv.as_ref().and_then(|kv| kv.point())
+    }
+}
+
+/// An instance of an app.
+pub(crate) struct AppInstance {
+    /// Store holding the instance state.
+    pub(crate) store: Store<AppState>,
+    /// The instance.
+    pub(crate) instance: Instance,
+    /// Time limits of the invocations of the instance.
+    limits: TimeLimits,
+}
+
+impl AppInstance {
+    /// Resets the time budget of the instance, to be called before invoking it on an
+    /// event.
+    pub(crate) fn start_invocation(&mut self) {
+        self.store.data_mut().slices = 0;
+        self.store.set_epoch_deadline(self.limits.slice);
+    }
+}
+
+/// Thread advancing the epoch of an engine at a fixed interval.
+struct EpochTicker {
+    /// Whether the thread should stop.
+    stop: Arc<AtomicBool>,
+    /// The thread.
+    thread: Option<JoinHandle<()>>,
+}
+
+impl EpochTicker {
+    /// Starts advancing the epoch of `engine` every `tick`.
+    fn start(engine: Engine, tick: Duration) -> Result<Self> {
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread = thread::Builder::new()
+            .name("hermes-epoch".to_string())
+            .spawn({
+                let stop = Arc::clone(&stop);
+                move || {
+                    while !stop.load(Ordering::Relaxed) {
+                        thread::sleep(tick);
+                        engine.increment_epoch();
+                    }
+                }
+            })?;
+
+        Ok(Self {
+            stop,
+            thread: Some(thread),
+        })
+    }
+}
+
+impl Drop for EpochTicker {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            thread.join().ok();
+        }
+    }
+}
+
+/// Runtime hosting the apps.
+pub(crate) struct Runtime {
+    /// Engine compiling and running the apps.
+    engine: Engine,
+    /// Host functions the apps are linked against.
+    linker: Linker<AppState>,
+    /// Cache of compiled apps.
+    cache: Option<ComponentCache>,
+    /// HTTP client of the apps.
+    http: Arc<HttpClient>,
+    /// Directory of the persistent data of the apps.
+    data_dir: Option<PathBuf>,
+    /// Interval between two epochs.
+    epoch_tick: Duration,
+    /// Default time limits of the apps.
+    limits: TimeLimits,
+    /// Thread advancing the epoch of the engine.
+    ticker: EpochTicker,
+}
+
+impl Runtime {
+    /// Creates a runtime.
+    pub(crate) fn new(config: &RuntimeConfig) -> Result<Self> {
+        let instances = config.max_instances;
+
+        let mut pooling = PoolingAllocationConfig::default();
+        pooling
+            .total_component_instances(instances)
+            .total_core_instances(instances.saturating_mul(CORE_INSTANCES_PER_APP))
+            .total_memories(instances.saturating_mul(MEMORIES_PER_APP))
+            .total_tables(instances.saturating_mul(TABLES_PER_APP))
+            .max_core_instances_per_component(CORE_INSTANCES_PER_APP)
+            .max_memories_per_component(MEMORIES_PER_APP)
+            .max_tables_per_component(TABLES_PER_APP)
+            .total_stacks(instances)
+            .memory_pages(config.max_memory_pages)
+            .linear_memory_keep_resident(config.keep_resident)
+            .table_keep_resident(config.keep_resident);
+
+        let mut engine_config = Config::new();
+        engine_config
+            .wasm_component_model(true)
+            .allocation_strategy(InstanceAllocationStrategy::Pooling(pooling))
+            .memory_init_cow(true)
+            .async_support(true)
+            .epoch_interruption(true);
+
+        let engine = Engine::new(&engine_config)?;
+
+        let mut linker = Linker::new(&engine);
+        command::add_to_linker(&mut linker)?;
+        outgoing_handler::add_to_linker(&mut linker, |state: &mut AppState| state)?;
+        types::add_to_linker(&mut linker, |state: &mut AppState| state)?;
+        kv::add_to_linker(&mut linker, |state: &mut AppState| state)?;
+        CardanoApp::add_to_linker(&mut linker, |state: &mut AppState| state)?;
+
+        let cache = config
+            .cache_dir
+            .as_ref()
+            .map(|dir| ComponentCache::open(dir, &engine))
+            .transpose()?;
+
+        let limits = TimeLimits::new(config.epoch_tick, config.time_slice, config.time_budget);
+        let ticker = EpochTicker::start(engine.clone(), config.epoch_tick)?;
+
+        Ok(Self {
+            engine,
+            linker,
+            cache,
+            http: Arc::new(HttpClient::new(&config.http)),
+            data_dir: config.data_dir.clone(),
+            epoch_tick: config.epoch_tick,
+            limits,
+            ticker,
+        })
+    }
+
+    /// Compiles an app component, or loads it from the cache, and links it, so that
+    /// instantiating it only takes slots from the pool.
+    pub(crate) fn load_app(&self, name: &str, bytes: &[u8]) -> Result<App> {
+        let component = match &self.cache {
+            Some(cache) => cache.load(&self.engine, bytes)?,
+            None => Component::new(&self.engine, bytes)?,
+        };
+        self.link_app(name, &component)
+    }
+
+    /// Links a compiled app component.
+    pub(crate) fn link_app(&self, name: &str, component: &Component) -> Result<App> {
+        Ok(App {
+            name: name.to_string(),
+            pre: self.linker.instantiate_pre(component)?,
+            limits: self.limits,
+            kv: self
+                .data_dir
+                .as_ref()
+                .map(|dir| KvStore::open(&kv::store_dir(dir, name)).map(Arc::new))
+                .transpose()?,
+        })
+    }
+
+    /// Overrides the time slice and the time budget of `app`.
+    pub(crate) fn set_time_limits(
+        &self, app: &mut App, time_slice: Duration, time_budget: Duration,
+    ) {
+        app.limits = TimeLimits::new(self.epoch_tick, time_slice, time_budget);
+    }
+
+    /// Creates a new instance of `app`.
+    pub(crate) async fn instantiate(&self, app: &App) -> Result<AppInstance> {
+        let timer = Timer::start();
+        let state = AppState {
+            table: Table::new(),
+            wasi: WasiCtxBuilder::new()
+                .inherit_stdout()
+                .inherit_stderr()
+                .build(),
+            http_ctx: WasiHttpCtx,
+            http: Arc::clone(&self.http),
+            kv: app.kv.clone().map(KvSession::new),
+            slices: 0,
+        };
+        let mut store = Store::new(&self.engine, state);
+
+        let limits = app.limits;
+        store.epoch_deadline_callback(move |mut store| {
+            let state = store.data_mut();
+            state.slices += 1;
+            if state.slices >= limits.max_slices {
+                return Err(anyhow!("app exceeded its time budget"));
+            }
+            Ok(UpdateDeadline::Yield(limits.slice))
+        });
+        store.set_epoch_deadline(limits.slice);
+
+        let instance = app.pre.instantiate_async(&mut store).await?;
+        timer.observe(&metrics::INSTANTIATE);
+
+        Ok(AppInstance {
+            store,
+            instance,
+            limits,
+        })
+    }
+}
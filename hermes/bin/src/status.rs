@@ -0,0 +1,486 @@
+//! Status feed of the node, for dashboards.
+//!
+//! The status is a flat set of named fields: the tip of the followed chain, the state of
+//! the follower and, per app, its pending updates and health. It is sampled at a fixed
+//! interval, and every sample that changes it is published as a delta holding only the
+//! fields that changed, so watching a node costs little however many apps it runs.
+//!
+//! Two resources are served:
+//!
+//! * `/status`: the current status, as a binary snapshot `[seq: u64, count: u32,
+//!   fields]`, each field being `[key_len: u16, key, tag: u8, value]` with a `u64` value
+//!   for tag 0, a `u8` boolean for tag 1 and `[len: u32, utf-8]` text for tag 2, all
+//!   integers in little endian. `seq` is the number of the last delta.
+//! * `/status/events`: a server-sent event stream of the deltas, as `delta` events of id
+//!   `seq` with the JSON payload `{"seq":..,"set":{..},"unset":[..]}`. The stream starts
+//!   with a `snapshot` event holding the whole status, unless the `Last-Event-ID` header
+//!   of the request is the current `seq`, e.g. after loading the binary snapshot. A
+//!   subscriber that falls behind is sent a snapshot again instead of the deltas it
+//!   missed.
+
+use std::{
+    collections::BTreeMap,
+    convert::Infallible,
+    fmt::Write,
+    pin::Pin,
+    sync::{Arc, Mutex, MutexGuard},
+    task::{Context, Poll},
+    time::Duration,
+};
+
+use anyhow::Result;
+use http_body_util::{combinators::BoxBody, BodyExt, Full};
+use hyper::{
+    body::{Body, Bytes, Frame, Incoming},
+    header::{HeaderValue, ACCESS_CONTROL_ALLOW_ORIGIN, CACHE_CONTROL, CONTENT_TYPE},
+    server::conn::http1,
+    service::service_fn,
+    Request, Response, StatusCode,
+};
+use hyper_util::rt::TokioIo;
+use tokio::{
+    net::TcpListener,
+    sync::{broadcast, mpsc},
+    time::{self, timeout, MissedTickBehavior},
+};
+
+use crate::{metrics, sync};
+
+/// Number of published deltas a subscriber can fall behind by before it is sent a
+/// snapshot instead.
+const BACKLOG: usize = 64;
+
+/// How long an event stream stays silent before a comment is sent to keep it open.
+const KEEPALIVE: Duration = Duration::from_secs(15);
+
+/// Tag of a `u64` field in the binary snapshot.
+const TAG_INT: u8 = 0;
+/// Tag of a boolean field in the binary snapshot.
+const TAG_BOOL: u8 = 1;
+/// Tag of a text field in the binary snapshot.
+const TAG_TEXT: u8 = 2;
+
+/// Value of a status field.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub(crate) enum Value {
+    /// An integer.
+    Int(u64),
+    /// A boolean.
+    Bool(bool),
+    /// A text.
+    Text(String),
+}
+
+impl From<u64> for Value {
+    fn from(value: u64) -> Self {
+        Self::Int(value)
+    }
+}
+
+impl From<usize> for Value {
+    fn from(value: usize) -> Self {
+        Self::Int(u64::try_from(value).unwrap_or(u64::MAX))
+    }
+}
+
+impl From<bool> for Value {
+    fn from(value: bool) -> Self {
+        Self::Bool(value)
+    }
+}
+
+impl From<&str> for Value {
+    fn from(value: &str) -> Self {
+        Self::Text(value.to_owned())
+    }
+}
+
+/// Status of the node.
+#[derive(Default)]
+pub(crate) struct Status {
+    /// Every field, by key.
+    fields: BTreeMap<String, Value>,
+}
+
+impl Status {
+    /// Sets the field `key` to `value`.
+    pub(crate) fn set(&mut self, key: impl Into<String>, value: impl Into<Value>) {
+        self.fields.insert(key.into(), value.into());
+    }
+}
+
+/// Component reporting its status, sampled at every interval.
+pub(crate) trait StatusSource: Send + Sync {
+    /// Sets the fields of the component in `status`.
+    fn sample(&self, status: &mut Status);
+}
+
+/// Last published status.
+#[derive(Default)]
+struct Published {
+    /// Number of the last delta.
+    seq: u64,
+    /// The status.
+    status: Status,
+}
+
+/// Feed of the status of the node.
+pub(crate) struct StatusFeed {
+    /// Components sampled along with the node.
+    sources: Vec<Arc<dyn StatusSource>>,
+    /// Interval between samples.
+    interval: Duration,
+    /// Last published status.
+    published: Mutex<Published>,
+    /// Published delta events, with their number.
+    events: broadcast::Sender<(u64, Bytes)>,
+}
+
+impl StatusFeed {
+    /// Creates a feed sampling the node and `sources` every `interval`.
+    ///
+    /// The node fields are read from the metrics, which must be enabled.
+    pub(crate) fn new(sources: Vec<Arc<dyn StatusSource>>, interval: Duration) -> Arc<Self> {
+        Arc::new(Self {
+            sources,
+            interval,
+            published: Mutex::default(),
+            events: broadcast::channel(BACKLOG).0,
+        })
+    }
+
+    /// Publishes the changes of the status at every interval.
+    pub(crate) async fn run(self: Arc<Self>) {
+        let mut interval = time::interval(self.interval);
+        interval.set_missed_tick_behavior(MissedTickBehavior::Skip);
+        loop {
+            interval.tick().await;
+            self.publish();
+        }
+    }
+
+    /// Serves the feed on `listener` until the listener fails.
+    pub(crate) async fn serve(self: Arc<Self>, listener: TcpListener) -> Result<()> {
+        loop {
+            let (stream, _) = listener.accept().await?;
+
+            let feed = Arc::clone(&self);
+            let service = service_fn(move |request| {
+                let resp = feed.respond(&request);
+                async move { Ok::<_, Infallible>(resp) }
+            });
+
+            tokio::spawn(async move {
+                http1::Builder::new()
+                    .serve_connection(TokioIo::new(stream), service)
+                    .await
+                    .ok();
+            });
+        }
+    }
+
+    /// Samples the status, and publishes the fields that changed since the last
+    /// sample.
+    fn publish(&self) {
+        let mut status = Status::default();
+        status.set("tip.slot", metrics::FOLLOWER_TIP_SLOT.get());
+        status.set("tip.height", metrics::FOLLOWER_TIP_HEIGHT.get());
+        status.set("follower.blocks", metrics::FOLLOWER_BLOCKS.get());
+        status.set("follower.rollbacks", metrics::FOLLOWER_ROLLBACKS.get());
+        status.set("follower.buffer", metrics::FOLLOWER_BUFFER_OCCUPANCY.get());
+        for source in &self.sources {
+            source.sample(&mut status);
+        }
+
+        let mut published = self.lock();
+        let (changed, unset) = diff(&published.status, &status);
+        if changed.is_empty() && unset.is_empty() {
+            return;
+        }
+
+        let seq = published.seq + 1;
+        let event = encode_event("delta", seq, changed.into_iter(), &unset);
+        published.seq = seq;
+        published.status = status;
+
+        // Nobody may be subscribed.
+        self.events.send((seq, event)).ok();
+    }
+
+    /// Responds to `request`.
+    fn respond(
+        self: &Arc<Self>, request: &Request<Incoming>,
+    ) -> Response<BoxBody<Bytes, Infallible>> {
+        let mut resp = match request.uri().path() {
+            "/status" => {
+                let mut resp = Response::new(Full::new(self.snapshot()).boxed());
+                resp.headers_mut().insert(
+                    CONTENT_TYPE,
+                    HeaderValue::from_static("application/octet-stream"),
+                );
+                resp
+            },
+            "/status/events" => {
+                let last_seq = request
+                    .headers()
+                    .get("last-event-id")
+                    .and_then(|value| value.to_str().ok())
+                    .and_then(|value| value.parse().ok());
+
+                let mut resp = Response::new(self.subscribe(last_seq).boxed());
+                resp.headers_mut()
+                    .insert(CONTENT_TYPE, HeaderValue::from_static("text/event-stream"));
+                resp
+            },
+            _ => {
+                let mut resp = Response::new(Full::default().boxed());
+                *resp.status_mut() = StatusCode::NOT_FOUND;
+                resp
+            },
+        };
+
+        let headers = resp.headers_mut();
+        headers.insert(CACHE_CONTROL, HeaderValue::from_static("no-store"));
+        // The feed is read-only, so dashboards can be served from anywhere.
+        headers.insert(ACCESS_CONTROL_ALLOW_ORIGIN, HeaderValue::from_static("*"));
+
+        resp
+    }
+
+    /// Returns the binary snapshot of the last published status.
+    fn snapshot(&self) -> Bytes {
+        let published = self.lock();
+
+        // Fields too large for the format are left out.
+        let fields: Vec<_> = published
+            .status
+            .fields
+            .iter()
+            .filter_map(|(key, value)| {
+                let key_len = u16::try_from(key.len()).ok()?;
+                let value_len = match value {
+                    Value::Text(text) => Some(u32::try_from(text.len()).ok()?),
+                    _ => None,
+                };
+                Some((key_len, key, value, value_len))
+            })
+            .collect();
+
+        let mut buf = Vec::new();
+        buf.extend_from_slice(&published.seq.to_le_bytes());
+        buf.extend_from_slice(&u32::try_from(fields.len()).unwrap_or(0).to_le_bytes());
+        for (key_len, key, value, value_len) in fields {
+            buf.extend_from_slice(&key_len.to_le_bytes());
+            buf.extend_from_slice(key.as_bytes());
+            match value {
+                Value::Int(value) => {
+                    buf.push(TAG_INT);
+                    buf.extend_from_slice(&value.to_le_bytes());
+                },
+                Value::Bool(value) => {
+                    buf.push(TAG_BOOL);
+                    buf.push(u8::from(*value));
+                },
+                Value::Text(value) => {
+                    buf.push(TAG_TEXT);
+                    buf.extend_from_slice(&value_len.unwrap_or(0).to_le_bytes());
+                    buf.extend_from_slice(value.as_bytes());
+                },
+            }
+        }
+
+        buf.into()
+    }
+
+    /// Returns an event stream of the deltas published after `last_seq`, starting with
+    /// a snapshot unless `last_seq` is the last published delta.
+    fn subscribe(self: &Arc<Self>, last_seq: Option<u64>) -> EventBody {
+        // Subscribed before reading the status, so no delta is missed in between.
+        let mut events = self.events.subscribe();
+        let (tx, rx) = mpsc::channel(1);
+
+        let feed = Arc::clone(self);
+        tokio::spawn(async move {
+            let (mut seq, snapshot) = feed.snapshot_event();
+            if last_seq != Some(seq) && tx.send(snapshot).await.is_err() {
+                return;
+            }
+
+            loop {
+                let event = match timeout(KEEPALIVE, events.recv()).await {
+                    Err(_) => Bytes::from_static(b": keepalive\n\n"),
+                    Ok(Ok((id, _))) if id <= seq => continue,
+                    Ok(Ok((id, event))) => {
+                        seq = id;
+                        event
+                    },
+                    Ok(Err(broadcast::error::RecvError::Lagged(_))) => {
+                        let (id, snapshot) = feed.snapshot_event();
+                        seq = id;
+                        snapshot
+                    },
+                    Ok(Err(broadcast::error::RecvError::Closed)) => return,
+                };
+
+                // The stream is closed once the subscriber is gone.
+                if tx.send(event).await.is_err() {
+                    return;
+                }
+            }
+        });
+
+        EventBody { rx }
+    }
+
+    /// Returns the snapshot event of the last published status, with its number.
+    fn snapshot_event(&self) -> (u64, Bytes) {
+        let published = self.lock();
+        let event = encode_event(
+            "snapshot",
+            published.seq,
+            published.status.fields.iter(),
+            &[],
+        );
+        (published.seq, event)
+    }
+
+    /// Locks the last published status.
+    fn lock(&self) -> MutexGuard<'_, Published> {
+        sync::lock(&self.published)
+    }
+}
+
+/// Body of an event stream, fed by the task of its subscriber.
+struct EventBody {
+    /// Events to send.
+    rx: mpsc::Receiver<Bytes>,
+}
+
+impl Body for EventBody {
+    type Data = Bytes;
+    type Error = Infallible;
+
+    fn poll_frame(
+        mut self: Pin<&mut Self>, cx: &mut Context<'_>,
+    ) -> Poll<Option<Result<Frame<Bytes>, Infallible>>> {
+        self.rx
+            .poll_recv(cx)
+            .map(|event| event.map(|event| Ok(Frame::data(event))))
+    }
+}
+
+/// Returns the fields of `new` that are missing from `old` or differ, and the keys of
+/// `old` missing from `new`.
+fn diff<'a>(old: &Status, new: &'a Status) -> (Vec<(&'a String, &'a Value)>, Vec<String>) {
+    let set = new
+        .fields
+        .iter()
+        .filter(|(key, value)| old.fields.get(*key) != Some(*value))
+        .collect();
+    let unset = old
+        .fields
+        .keys()
+        .filter(|key| !new.fields.contains_key(*key))
+        .cloned()
+        .collect();
+    (set, unset)
+}
+
+/// Encodes a server-sent event of `kind` setting the fields `changed` and removing the
+/// fields `unset`.
+fn encode_event<'a>(
+    kind: &str, seq: u64, changed: impl Iterator<Item = (&'a String, &'a Value)>, unset: &[String],
+) -> Bytes {
+    let mut data = format!("{{\"seq\":{seq},\"set\":{{");
+    for (i, (key, value)) in changed.enumerate() {
+        if i > 0 {
+            data.push(',');
+        }
+        write_json_string(&mut data, key);
+        data.push(':');
+        match value {
+            Value::Int(value) => {
+                write!(data, "{value}").ok();
+            },
+            Value::Bool(value) => {
+                write!(data, "{value}").ok();
+            },
+            Value::Text(value) => write_json_string(&mut data, value),
+        }
+    }
+    data.push_str("},\"unset\":[");
+    for (i, key) in unset.iter().enumerate() {
+        if i > 0 {
+            data.push(',');
+        }
+        write_json_string(&mut data, key);
+    }
+    data.push_str("]}");
+
+    format!("event: {kind}\nid: {seq}\ndata: {data}\n\n").into()
+}
+
+/// Writes `value` to `out` as a JSON string.
+fn write_json_string(out: &mut String, value: &str) {
+    out.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if u32::from(c) < 0x20 => {
+                write!(out, "\\u{:04x}", u32::from(c)).ok();
+            },
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the encoding of the status deltas.
+
+    use super::{diff, encode_event, Status};
+
+    /// Returns a status with `fields`.
+    fn status(fields: &[(&str, &str)]) -> Status {
+        let mut status = Status::default();
+        for (key, value) in fields {
+            status.set(*key, *value);
+        }
+        status
+    }
+
+    /// Only the fields that changed or appeared are set, and the ones that disappeared
+    /// are unset.
+    #[test]
+    fn diff_fields() {
+        let old = status(&[("a", "1"), ("b", "1"), ("c", "1")]);
+        let new = status(&[("a", "1"), ("b", "2"), ("d", "2")]);
+
+        let (set, unset) = diff(&old, &new);
+        let set: Vec<_> = set.into_iter().map(|(key, _)| key.as_str()).collect();
+        assert_eq!(set, ["b", "d"]);
+        assert_eq!(unset, ["c"]);
+
+        let (set, unset) = diff(&new, &new);
+        assert!(set.is_empty() && unset.is_empty());
+    }
+
+    /// Events are server-sent events carrying JSON, with keys and texts escaped.
+    #[test]
+    fn encode_events() {
+        let mut new = Status::default();
+        new.set("apps.a\"b.pending", 3_u64);
+        new.set("healthy", true);
+        new.set("tip", "line\nbreak");
+
+        let (set, unset) = diff(&status(&[("gone", "x")]), &new);
+        let event = encode_event("delta", 7, set.into_iter(), &unset);
+        assert_eq!(
+            event,
+            "event: delta\nid: 7\ndata: {\"seq\":7,\"set\":{\"apps.a\\\"b.pending\":3,\
+             \"healthy\":true,\"tip\":\"line\\u000abreak\"},\"unset\":[\"gone\"]}\n\n"
+        );
+    }
+}
@@ -0,0 +1,49 @@
+//! This example shows how to use the chain follower to catch up with a Cardano
+//! network chain, receiving chain updates in batches.
+
+use std::error::Error;
+
+use cardano_chain_follower::{ChainUpdate, Follower, FollowerConfigBuilder, Network, Point};
+
+#[tokio::main]
+async fn main() -> Result<(), Box<dyn Error>> {
+    let config = FollowerConfigBuilder::default()
+        .follow_from(Point::Specific(
+            110_908_236,
+            hex::decode("ad3798a1db2b6097c71f35609399e4b2ff834f0f45939803d563bf9d660df2f2")?,
+        ))
+        .chain_update_buffer_max_size(1024)
+        .build();
+
+    let mut follower = Follower::connect(
+        "relays-new.cardano-mainnet.iohk.io:3001",
+        Network::Mainnet,
+        config,
+    )
+    .await?;
+
+    let mut updates = Vec::with_capacity(256);
+    loop {
+        updates.clear();
+        follower.next_batch(256, &mut updates).await?;
+
+        for chain_update in &updates {
+            if let ChainUpdate::Block(data) = chain_update {
+                let header = data.header()?;
+                println!(
+                    "New block NUMBER={} SLOT={}",
+                    header.number(),
+                    header.slot()
+                );
+            }
+        }
+
+        let stats = follower.buffer_stats();
+        println!(
+            "Batch of {} updates, buffer capacity={} high-water mark={}",
+            updates.len(),
+            stats.capacity,
+            stats.high_water_mark,
+        );
+    }
+}
@@ -22,7 +22,7 @@ async fn main() -> Result<(), Box<dyn Error>> {
 
         match chain_update {
             ChainUpdate::Block(data) => {
-                let block = data.decode()?;
+                let block = data.header()?;
 
                 println!(
                     "New block NUMBER={} SLOT={} HASH={}",
@@ -32,7 +32,7 @@ async fn main() -> Result<(), Box<dyn Error>> {
                 );
             },
             ChainUpdate::Rollback(data) => {
-                let block = data.decode()?;
+                let block = data.header()?;
 
                 println!(
                     "Rollback block NUMBER={} SLOT={} HASH={}",
@@ -0,0 +1,45 @@
+//! This example shows how to use the chain reader to download a range of blocks
+//! from several relays in parallel and validate it.
+
+use std::error::Error;
+
+use cardano_chain_follower::{validate_blocks, Network, Point, Reader};
+use tokio_stream::StreamExt;
+
+#[tokio::main]
+async fn main() -> Result<(), Box<dyn Error>> {
+    let mut reader = Reader::connect_many(
+        &[
+            "relays-new.cardano-mainnet.iohk.io:3001",
+            "backbone.cardano-mainnet.iohk.io:3001",
+        ],
+        Network::Mainnet,
+    )
+    .await?;
+
+    let mut stream = reader
+        .read_block_range_stream(
+            Point::Specific(
+                110_908_236,
+                hex::decode("ad3798a1db2b6097c71f35609399e4b2ff834f0f45939803d563bf9d660df2f2")?,
+            ),
+            Point::Specific(
+                110_908_582,
+                hex::decode("16e97a73e866280582ee1201a5e1815993978eede956af1869b0733bedc131f2")?,
+            ),
+            64,
+        )
+        .await?;
+
+    let mut blocks = Vec::new();
+    while let Some(data) = stream.next().await {
+        blocks.push(data?);
+    }
+
+    let total_blocks = blocks.len();
+    tokio::task::spawn_blocking(move || validate_blocks(&blocks)).await??;
+
+    println!("Total valid blocks: {total_blocks}");
+
+    Ok(())
+}
@@ -0,0 +1,44 @@
+//! This example shows how to keep downloaded blocks in a local block store, so they
+//! are read from disk the next time they are needed.
+
+use std::{error::Error, sync::Arc};
+
+use cardano_chain_follower::{BlockStore, Network, Point, Reader};
+
+#[tokio::main]
+async fn main() -> Result<(), Box<dyn Error>> {
+    let store = Arc::new(BlockStore::open(
+        std::env::temp_dir().join("cardano-chain-follower-blocks"),
+    )?);
+
+    let mut reader =
+        Reader::connect("relays-new.cardano-mainnet.iohk.io:3001", Network::Mainnet).await?;
+    reader.set_block_store(Arc::clone(&store));
+
+    let from = Point::Specific(
+        110_908_236,
+        hex::decode("ad3798a1db2b6097c71f35609399e4b2ff834f0f45939803d563bf9d660df2f2")?,
+    );
+    let to = Point::Specific(
+        110_908_582,
+        hex::decode("16e97a73e866280582ee1201a5e1815993978eede956af1869b0733bedc131f2")?,
+    );
+
+    // Served from the producer the first time the example is run, and from the
+    // store afterwards.
+    let data_vec = reader.read_block_range(from, to).await?;
+
+    for data in &data_vec {
+        let header = data.header()?;
+        let point = Point::Specific(header.slot(), header.hash().to_vec());
+
+        if store.get(&point)?.is_none() {
+            store.append(&point, data.raw())?;
+        }
+    }
+    store.sync()?;
+
+    println!("Stored blocks: {}", store.len());
+
+    Ok(())
+}
@@ -0,0 +1,513 @@
+//! Multi-era block data.
+
+use std::{
+    ops::Range,
+    sync::{Arc, OnceLock},
+};
+
+use bytes::Bytes;
+use pallas::{
+    codec::minicbor::{self, data::Type, Decoder},
+    ledger::traverse::{Era, MultiEraBlock, MultiEraHeader, MultiEraTx},
+};
+
+use crate::Result;
+
+/// Result of scanning the CBOR structure of a block.
+type ScanResult<T> = std::result::Result<T, minicbor::decode::Error>;
+
+/// CBOR encoded data of a multi-era block.
+///
+/// The data is held in a reference-counted immutable buffer, cloning it or taking
+/// slices of it does not copy the block. The decoded block is computed the first time
+/// it is needed and shared by all the clones.
+#[derive(Clone)]
+pub struct MultiEraBlockData(Arc<BlockData>);
+
+/// Shared state of a [`MultiEraBlockData`].
+struct BlockData {
+    /// Decoded block, borrowing from `raw`.
+    ///
+    /// The `'static` lifetime is a lie: the block borrows from the buffer owned by
+    /// `raw`. This is sound because the buffer is immutable, it isn't moved by moving
+    /// the [`Bytes`] handle, and this field is declared first so it is dropped before
+    /// `raw`. The block is never handed out with a lifetime longer than the borrow of
+    /// this struct.
+    decoded: OnceLock<MultiEraBlock<'static>>,
+    /// Era and location of the block's transactions within `raw`, found the first time
+    /// a transaction is accessed.
+    layout: OnceLock<BlockLayout>,
+    /// CBOR encoded data of the block.
+    raw: Bytes,
+}
+
+/// Era and transactions of a block.
+struct BlockLayout {
+    /// Era of the block.
+    era: Era,
+    /// Transactions of the block.
+    txs: Vec<TxLayout>,
+}
+
+/// Location of the parts of a transaction within the block data.
+struct TxLayout {
+    /// Transaction body. For Byron blocks this covers the whole transaction, along
+    /// with its witnesses.
+    body: Range<usize>,
+    /// Witness set, missing for Byron blocks.
+    witness_set: Option<Range<usize>>,
+    /// Auxiliary data, if any.
+    auxiliary_data: Option<Range<usize>>,
+    /// Whether the transaction is valid (phase-2 validation succeeded).
+    valid: bool,
+}
+
+/// A single transaction from a [`MultiEraBlockData`], see [`MultiEraBlockData::tx`].
+pub struct BlockTx {
+    /// Era of the block the transaction was taken from.
+    era: Era,
+    /// CBOR encoded data of the transaction.
+    cbor: Bytes,
+    /// Offset in `cbor` of the auxiliary data of a Shelley to Mary transaction, which
+    /// has no validity flag.
+    auxiliary_data_offset: Option<usize>,
+    /// `cbor` with a validity flag, in the shape the multi-era decoder expects for the
+    /// Shelley to Mary transactions, built the first time it is decoded.
+    decodable: OnceLock<Vec<u8>>,
+}
+
+impl BlockTx {
+    /// Returns the CBOR encoded data of the transaction.
+    #[must_use]
+    pub fn cbor(&self) -> &Bytes {
+        &self.cbor
+    }
+
+    /// Decodes the data into a multi-era transaction.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the encoded data is invalid.
+    pub fn decode(&self) -> Result<MultiEraTx<'_>> {
+        let tx = MultiEraTx::decode_for_era(self.era, self.decodable()).map_err(Box::new)?;
+
+        Ok(tx)
+    }
+
+    /// Returns the data in the shape expected by the multi-era decoder, which reads the
+    /// transactions of all the eras after Byron as `[body, witness_set, valid,
+    /// auxiliary_data]`.
+    fn decodable(&self) -> &[u8] {
+        let Some(offset) = self.auxiliary_data_offset else {
+            return &self.cbor;
+        };
+
+        self.decodable.get_or_init(|| {
+            let mut cbor = Vec::with_capacity(self.cbor.len() + 1);
+            cbor.push(0x84);
+            cbor.extend_from_slice(self.cbor.get(1..offset).unwrap_or_default());
+            cbor.push(0xF5);
+            cbor.extend_from_slice(self.cbor.get(offset..).unwrap_or_default());
+            cbor
+        })
+    }
+}
+
+impl MultiEraBlockData {
+    /// Returns the CBOR encoded data of the block.
+    ///
+    /// The returned buffer shares the block's memory, it can be cloned and sliced
+    /// without copying.
+    #[must_use]
+    pub fn raw(&self) -> &Bytes {
+        &self.0.raw
+    }
+
+    /// Decodes the data into a multi-era block.
+    ///
+    /// The block is only decoded the first time this is called, following calls (on
+    /// this value or any of its clones) return the same decoded block.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block's era couldn't be decided or if the encoded data is
+    /// invalid.
+    pub fn decode(&self) -> Result<&MultiEraBlock<'_>> {
+        if let Some(block) = self.0.decoded.get() {
+            return Ok(block);
+        }
+
+        // SAFETY: See `BlockData::decoded`. The slice points into the buffer owned
+        // by `self.0.raw`, which lives as long as the cell the block is stored
+        // in.
+        let raw: &'static [u8] =
+            unsafe { std::slice::from_raw_parts(self.0.raw.as_ptr(), self.0.raw.len()) };
+        let block = MultiEraBlock::decode(raw).map_err(Box::new)?;
+
+        // If another thread decoded the block concurrently, its result is kept and
+        // this one is dropped.
+        Ok(self.0.decoded.get_or_init(|| block))
+    }
+
+    /// Decodes only the header of the block, skipping over its transactions.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block's era couldn't be decided or if the encoded data is
+    /// invalid.
+    pub fn header(&self) -> Result<MultiEraHeader<'_>> {
+        let mut d = Decoder::new(&self.0.raw);
+        let tag = block_tag(&mut d)?;
+        d.array()?;
+        let start = d.position();
+        d.skip()?;
+        let cbor = self
+            .0
+            .raw
+            .get(start..d.position())
+            .ok_or("invalid block header")?;
+
+        // Headers are tagged as in chain-sync, where the Byron main and boundary blocks
+        // share a tag and all the others are shifted by one.
+        let (variant, subtag) = match tag {
+            0 | 1 => (0, Some(tag)),
+            _ => (tag - 1, None),
+        };
+        let header = MultiEraHeader::decode(variant, subtag, cbor).map_err(Box::new)?;
+
+        Ok(header)
+    }
+
+    /// Returns the era of the block, without decoding it.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block's era couldn't be decided.
+    pub fn era(&self) -> Result<Era> {
+        if let Some(layout) = self.0.layout.get() {
+            return Ok(layout.era);
+        }
+
+        let mut d = Decoder::new(&self.0.raw);
+        let era = tag_era(block_tag(&mut d)?)?;
+
+        Ok(era)
+    }
+
+    /// Returns the number of transactions in the block without decoding them.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the encoded data is invalid.
+    pub fn tx_count(&self) -> Result<usize> {
+        Ok(self.layout()?.txs.len())
+    }
+
+    /// Returns the transaction at `index` in the block, or None if there is no such
+    /// transaction. Only that transaction is decoded when calling
+    /// [`BlockTx::decode`].
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block's era couldn't be decided or if the encoded data is
+    /// invalid.
+    pub fn tx(&self, index: usize) -> Result<Option<BlockTx>> {
+        let layout = self.layout()?;
+        let Some(tx) = layout.txs.get(index) else {
+            return Ok(None);
+        };
+        let era = layout.era;
+
+        let raw = &self.0.raw;
+        if matches!(era, Era::Byron) {
+            // Byron transactions are stored along with their witnesses.
+            return Ok(Some(BlockTx {
+                era,
+                cbor: raw.slice(tx.body.clone()),
+                auxiliary_data_offset: None,
+                decodable: OnceLock::new(),
+            }));
+        }
+        let witness_set = tx
+            .witness_set
+            .as_ref()
+            .ok_or("transaction without a witness set")?;
+
+        // Other transactions are split across the block, so they are put back together
+        // as they are encoded on their own: `[body, witness_set, auxiliary_data]` up to
+        // Mary, and `[body, witness_set, valid, auxiliary_data]` from Alonzo onwards.
+        let has_validity = !matches!(era, Era::Shelley | Era::Allegra | Era::Mary);
+        let part = |range: &Range<usize>| raw.get(range.clone()).unwrap_or_default();
+        let auxiliary_data = tx.auxiliary_data.as_ref().map_or(&[0xF6][..], part);
+        let mut cbor =
+            Vec::with_capacity(2 + tx.body.len() + witness_set.len() + auxiliary_data.len());
+        cbor.push(if has_validity { 0x84 } else { 0x83 });
+        cbor.extend_from_slice(part(&tx.body));
+        cbor.extend_from_slice(part(witness_set));
+        let auxiliary_data_offset = if has_validity {
+            cbor.push(if tx.valid { 0xF5 } else { 0xF4 });
+            None
+        } else {
+            Some(cbor.len())
+        };
+        cbor.extend_from_slice(auxiliary_data);
+
+        Ok(Some(BlockTx {
+            era,
+            cbor: cbor.into(),
+            auxiliary_data_offset,
+            decodable: OnceLock::new(),
+        }))
+    }
+
+    /// Returns the era and the location of the block's transactions, scanning the block
+    /// the first time it is called.
+    fn layout(&self) -> Result<&BlockLayout> {
+        if let Some(layout) = self.0.layout.get() {
+            return Ok(layout);
+        }
+
+        let layout = scan_txs(&self.0.raw)?;
+
+        Ok(self.0.layout.get_or_init(|| layout))
+    }
+}
+
+/// Reads the era tag wrapping the block.
+fn block_tag(d: &mut Decoder) -> ScanResult<u8> {
+    d.array()?;
+    d.u8()
+}
+
+/// Returns the era of the blocks tagged with `tag`.
+fn tag_era(tag: u8) -> std::result::Result<Era, &'static str> {
+    match tag {
+        0 | 1 => Ok(Era::Byron),
+        2 => Ok(Era::Shelley),
+        3 => Ok(Era::Allegra),
+        4 => Ok(Era::Mary),
+        5 => Ok(Era::Alonzo),
+        6 => Ok(Era::Babbage),
+        7 => Ok(Era::Conway),
+        _ => Err("unknown block era"),
+    }
+}
+
+/// Calls `f` for each item of the array or map at the current position. Map entries
+/// are passed as a single item, `f` receives the entry's key and must skip its value.
+fn for_each_item(
+    d: &mut Decoder, mut f: impl FnMut(&mut Decoder, u64) -> ScanResult<()>,
+) -> ScanResult<()> {
+    let len = match d.datatype()? {
+        Type::Map | Type::MapIndef => d.map()?,
+        _ => d.array()?,
+    };
+
+    match len {
+        Some(len) => {
+            for i in 0..len {
+                f(d, i)?;
+            }
+        },
+        None => {
+            let mut i = 0;
+            while d.datatype()? != Type::Break {
+                f(d, i)?;
+                i += 1;
+            }
+            // Consume the break marker.
+            d.set_position(d.position() + 1);
+        },
+    }
+
+    Ok(())
+}
+
+/// Skips the item at the current position, returning its location.
+fn skip_item(d: &mut Decoder) -> ScanResult<Range<usize>> {
+    let start = d.position();
+    d.skip()?;
+    Ok(start..d.position())
+}
+
+/// Finds the era and the location of the transactions of a block, skipping over their
+/// contents.
+fn scan_txs(raw: &[u8]) -> ScanResult<BlockLayout> {
+    let mut d = Decoder::new(raw);
+    let tag = block_tag(&mut d)?;
+    let era = tag_era(tag).map_err(minicbor::decode::Error::message)?;
+    let mut txs = Vec::new();
+
+    match tag {
+        // Epoch boundary blocks have no transactions.
+        0 => {},
+        // Byron blocks are `[header, [txs, ssc, dlg, upd], extra]`, where each
+        // transaction is `[tx, witnesses]`.
+        1 => {
+            d.array()?;
+            d.skip()?;
+            d.array()?;
+            for_each_item(&mut d, |d, _| {
+                txs.push(TxLayout {
+                    body: skip_item(d)?,
+                    witness_set: None,
+                    auxiliary_data: None,
+                    valid: true,
+                });
+                Ok(())
+            })?;
+        },
+        // Later blocks are `[header, bodies, witness_sets, auxiliary_data, invalid]`,
+        // where the auxiliary data is a map keyed by transaction index and the list of
+        // invalid transactions is only present from Alonzo onwards.
+        _ => {
+            let len = d.array()?;
+            d.skip()?;
+
+            for_each_item(&mut d, |d, _| {
+                txs.push(TxLayout {
+                    body: skip_item(d)?,
+                    witness_set: None,
+                    auxiliary_data: None,
+                    valid: true,
+                });
+                Ok(())
+            })?;
+
+            for_each_item(&mut d, |d, i| {
+                let range = skip_item(d)?;
+                if let Some(tx) = usize::try_from(i).ok().and_then(|i| txs.get_mut(i)) {
+                    tx.witness_set = Some(range);
+                }
+                Ok(())
+            })?;
+
+            for_each_item(&mut d, |d, _| {
+                let index = d.u64()?;
+                let range = skip_item(d)?;
+                if let Some(tx) = usize::try_from(index).ok().and_then(|i| txs.get_mut(i)) {
+                    tx.auxiliary_data = Some(range);
+                }
+                Ok(())
+            })?;
+
+            if len != Some(4) && d.datatype()? != Type::Break {
+                for_each_item(&mut d, |d, _| {
+                    let index = d.u64()?;
+                    if let Some(tx) = usize::try_from(index).ok().and_then(|i| txs.get_mut(i)) {
+                        tx.valid = false;
+                    }
+                    Ok(())
+                })?;
+            }
+        },
+    }
+
+    Ok(BlockLayout { era, txs })
+}
+
+impl From<Vec<u8>> for MultiEraBlockData {
+    fn from(data: Vec<u8>) -> Self {
+        // Takes ownership of the vector's allocation, no copy involved.
+        Bytes::from(data).into()
+    }
+}
+
+impl From<Bytes> for MultiEraBlockData {
+    fn from(raw: Bytes) -> Self {
+        Self(Arc::new(BlockData {
+            decoded: OnceLock::new(),
+            layout: OnceLock::new(),
+            raw,
+        }))
+    }
+}
+
+impl AsRef<[u8]> for MultiEraBlockData {
+    fn as_ref(&self) -> &[u8] {
+        &self.0.raw
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the transaction scanner.
+
+    use super::*;
+
+    /// Returns the CBOR of the transaction at `index` in `block`.
+    fn tx_cbor(block: &MultiEraBlockData, index: usize) -> Option<Vec<u8>> {
+        block
+            .tx(index)
+            .expect("valid block")
+            .map(|tx| tx.cbor().to_vec())
+    }
+
+    /// Byron transactions are taken as they are stored.
+    #[test]
+    fn byron_txs() {
+        // [1, [header, [[[1, 2]], ssc, dlg, upd], extra]]
+        let block = MultiEraBlockData::from(vec![
+            0x82, 0x01, 0x83, 0x00, 0x84, 0x81, 0x82, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00,
+        ]);
+
+        assert_eq!(block.era().expect("valid block"), Era::Byron);
+        assert_eq!(block.tx_count().expect("valid block"), 1);
+        assert_eq!(tx_cbor(&block, 0), Some(vec![0x82, 0x01, 0x02]));
+        assert_eq!(tx_cbor(&block, 1), None);
+    }
+
+    /// Shelley to Mary transactions have no validity flag, but are decoded with one.
+    #[test]
+    fn shelley_txs() {
+        // [2, [header, [10, 11], [20, 21], {1: 30}]]
+        let block = MultiEraBlockData::from(vec![
+            0x82, 0x02, 0x84, 0x00, 0x82, 0x0A, 0x0B, 0x82, 0x14, 0x15, 0xA1, 0x01, 0x18, 0x1E,
+        ]);
+
+        assert_eq!(block.tx_count().expect("valid block"), 2);
+        assert_eq!(block.era().expect("valid block"), Era::Shelley);
+        assert_eq!(tx_cbor(&block, 0), Some(vec![0x83, 0x0A, 0x14, 0xF6]));
+        assert_eq!(tx_cbor(&block, 1), Some(vec![0x83, 0x0B, 0x15, 0x18, 0x1E]));
+
+        let tx = block.tx(1).expect("valid block").expect("existing tx");
+        assert_eq!(tx.decodable(), [0x84, 0x0B, 0x15, 0xF5, 0x18, 0x1E]);
+    }
+
+    /// Alonzo transactions carry their validity flag.
+    #[test]
+    fn alonzo_txs() {
+        // [5, [header, [_ 10, 11], [20, 21], {}, [0]]]
+        let block = MultiEraBlockData::from(vec![
+            0x82, 0x05, 0x85, 0x00, 0x9F, 0x0A, 0x0B, 0xFF, 0x82, 0x14, 0x15, 0xA0, 0x81, 0x00,
+        ]);
+
+        assert_eq!(block.era().expect("valid block"), Era::Alonzo);
+        assert_eq!(tx_cbor(&block, 0), Some(vec![0x84, 0x0A, 0x14, 0xF4, 0xF6]));
+        assert_eq!(tx_cbor(&block, 1), Some(vec![0x84, 0x0B, 0x15, 0xF5, 0xF6]));
+
+        let tx = block.tx(0).expect("valid block").expect("existing tx");
+        assert_eq!(tx.decodable(), tx.cbor().to_vec());
+    }
+
+    /// Transactions missing from the witness sets are rejected.
+    #[test]
+    fn missing_witness_set() {
+        // [2, [header, [10, 11], [20], {}]]
+        let block = MultiEraBlockData::from(vec![
+            0x82, 0x02, 0x84, 0x00, 0x82, 0x0A, 0x0B, 0x81, 0x14, 0xA0,
+        ]);
+
+        assert_eq!(tx_cbor(&block, 0), Some(vec![0x83, 0x0A, 0x14, 0xF6]));
+        assert!(block.tx(1).is_err());
+    }
+
+    /// Blocks of unknown eras are rejected.
+    #[test]
+    fn unknown_era() {
+        let block = MultiEraBlockData::from(vec![0x82, 0x08, 0x80]);
+
+        assert!(block.era().is_err());
+        assert!(block.tx_count().is_err());
+    }
+}
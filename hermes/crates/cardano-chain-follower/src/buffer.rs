@@ -0,0 +1,341 @@
+//! Buffer of chain updates between the follower task and its consumer.
+//!
+//! The buffer can adapt its capacity between configured bounds. It grows when the
+//! producer finds it full after the consumer had found it empty, which means the
+//! updates arrive in bursts that a larger buffer would smooth out. It shrinks when its
+//! occupancy stays low for a while. A consumer that is consistently slower than the
+//! producer doesn't make it grow, the producer just waits for it.
+
+use std::{
+    collections::VecDeque,
+    sync::{Mutex, MutexGuard},
+    time::{Duration, Instant},
+};
+
+use tokio::sync::Notify;
+
+use crate::{ChainUpdate, SendError};
+
+/// Statistics of the chain updates buffer of a [`Follower`](crate::Follower).
+#[derive(Debug, Clone, Default)]
+pub struct ChainUpdateBufferStats {
+    /// Current capacity of the buffer.
+    pub capacity: usize,
+    /// Number of updates currently held by the buffer.
+    pub occupancy: usize,
+    /// Largest number of updates ever held by the buffer.
+    pub high_water_mark: usize,
+    /// Total time the follower spent waiting for the consumer to make room in the
+    /// buffer.
+    pub producer_stall_time: Duration,
+    /// Total time the consumer spent waiting for updates.
+    pub consumer_stall_time: Duration,
+}
+
+/// State of the buffer.
+struct State {
+    /// Buffered updates.
+    queue: VecDeque<Result<ChainUpdate, SendError>>,
+    /// Smallest capacity the buffer can shrink to.
+    min_capacity: usize,
+    /// Largest capacity the buffer can grow to.
+    max_capacity: usize,
+    /// Whether the consumer found the buffer empty since the capacity last changed.
+    consumer_waited: bool,
+    /// Number of updates popped in the current observation window.
+    window_pops: usize,
+    /// Largest occupancy in the current observation window.
+    window_peak: usize,
+    /// Reported statistics.
+    stats: ChainUpdateBufferStats,
+}
+
+impl State {
+    /// Shrinks the buffer if its occupancy stayed below a quarter of its capacity
+    /// for a whole observation window, which lasts a few times the capacity in pops.
+    fn observe_pop(&mut self) {
+        self.window_pops += 1;
+        if self.window_pops < self.stats.capacity * 4 {
+            return;
+        }
+
+        if self.window_peak <= self.stats.capacity / 4 {
+            self.stats.capacity = (self.stats.capacity / 2).max(self.min_capacity);
+            self.consumer_waited = false;
+        }
+
+        self.window_pops = 0;
+        self.window_peak = self.queue.len();
+    }
+}
+
+/// Buffer of chain updates with a single producer and a single consumer.
+pub(crate) struct UpdateBuffer {
+    /// Buffer state.
+    state: Mutex<State>,
+    /// Notified when an update is pushed.
+    pushed: Notify,
+    /// Notified when an update is popped.
+    popped: Notify,
+}
+
+impl UpdateBuffer {
+    /// Creates a buffer of `min_capacity` updates, that can grow up to
+    /// `max_capacity` updates.
+    pub(crate) fn new(min_capacity: usize, max_capacity: usize) -> Self {
+        let min_capacity = min_capacity.max(1);
+
+        Self {
+            state: Mutex::new(State {
+                queue: VecDeque::with_capacity(min_capacity),
+                min_capacity,
+                max_capacity: max_capacity.max(min_capacity),
+                consumer_waited: false,
+                window_pops: 0,
+                window_peak: 0,
+                stats: ChainUpdateBufferStats {
+                    capacity: min_capacity,
+                    ..ChainUpdateBufferStats::default()
+                },
+            }),
+            pushed: Notify::new(),
+            popped: Notify::new(),
+        }
+    }
+
+    /// Pushes an update, waiting for room in the buffer if it is full.
+    pub(crate) async fn push(&self, update: Result<ChainUpdate, SendError>) {
+        let mut stalled_since: Option<Instant> = None;
+
+        loop {
+            // Created before checking the buffer so no notification is missed.
+            let popped = self.popped.notified();
+
+            {
+                let mut state = self.lock();
+                let state = &mut *state;
+
+                if state.queue.len() >= state.stats.capacity
+                    && state.consumer_waited
+                    && state.stats.capacity < state.max_capacity
+                {
+                    state.stats.capacity = (state.stats.capacity * 2).min(state.max_capacity);
+                    state.consumer_waited = false;
+                }
+
+                if state.queue.len() < state.stats.capacity {
+                    if let Some(since) = stalled_since {
+                        state.stats.producer_stall_time += since.elapsed();
+                    }
+
+                    state.queue.push_back(update);
+                    state.window_peak = state.window_peak.max(state.queue.len());
+                    state.stats.high_water_mark =
+                        state.stats.high_water_mark.max(state.queue.len());
+                    break;
+                }
+            }
+
+            stalled_since.get_or_insert_with(Instant::now);
+            popped.await;
+        }
+
+        self.pushed.notify_waiters();
+    }
+
+    /// Pops the next update, waiting for one if the buffer is empty.
+    pub(crate) async fn pop(&self) -> Result<ChainUpdate, SendError> {
+        self.take(|state| {
+            let update = state.queue.pop_front();
+            state.observe_pop();
+            update
+        })
+        .await
+    }
+
+    /// Pops up to `max` updates into `updates`, waiting for one if the buffer is
+    /// empty. Returns the number of updates popped.
+    ///
+    /// Updates are popped up to the first error, which is returned if it comes first.
+    pub(crate) async fn pop_batch(
+        &self, max: usize, updates: &mut Vec<ChainUpdate>,
+    ) -> Result<usize, SendError> {
+        if max == 0 {
+            return Ok(0);
+        }
+
+        self.take(|state| {
+            let mut count = 0;
+
+            while count < max {
+                match state.queue.front() {
+                    Some(Ok(_)) => {},
+                    Some(Err(_)) if count == 0 => {
+                        let err = state.queue.pop_front().and_then(Result::err)?;
+                        state.observe_pop();
+                        return Some(Err(err));
+                    },
+                    _ => break,
+                }
+
+                if let Some(Ok(update)) = state.queue.pop_front() {
+                    updates.push(update);
+                    state.observe_pop();
+                    count += 1;
+                }
+            }
+
+            Some(Ok(count))
+        })
+        .await
+    }
+
+    /// Takes updates from the buffer with `f`, waiting for the buffer to be non-empty
+    /// first.
+    async fn take<T>(&self, mut f: impl FnMut(&mut State) -> Option<T>) -> T {
+        let mut waiting_since: Option<Instant> = None;
+
+        let res = loop {
+            // Created before checking the buffer so no notification is missed.
+            let pushed = self.pushed.notified();
+
+            {
+                let mut state = self.lock();
+
+                if !state.queue.is_empty() {
+                    if let Some(since) = waiting_since {
+                        state.stats.consumer_stall_time += since.elapsed();
+                    }
+                    if let Some(res) = f(&mut state) {
+                        break res;
+                    }
+                }
+
+                state.consumer_waited = true;
+            }
+
+            waiting_since.get_or_insert_with(Instant::now);
+            pushed.await;
+        };
+
+        self.popped.notify_waiters();
+        res
+    }
+
+    /// Drops every buffered update.
+    pub(crate) fn clear(&self) {
+        let mut state = self.lock();
+        state.queue.clear();
+        state.window_pops = 0;
+        state.window_peak = 0;
+        drop(state);
+
+        self.popped.notify_waiters();
+    }
+
+    /// Returns the buffer statistics.
+    pub(crate) fn stats(&self) -> ChainUpdateBufferStats {
+        let state = self.lock();
+
+        ChainUpdateBufferStats {
+            occupancy: state.queue.len(),
+            ..state.stats.clone()
+        }
+    }
+
+    /// Locks the buffer state.
+    fn lock(&self) -> MutexGuard<'_, State> {
+        self.state.lock().unwrap_or_else(|err| err.into_inner())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the adaptive capacity of the buffer.
+
+    use std::time::Duration;
+
+    use tokio::time::timeout;
+
+    use super::*;
+    use crate::MultiEraBlockData;
+
+    /// Time after which a buffer operation is considered blocked.
+    const BLOCKED: Duration = Duration::from_millis(20);
+
+    /// Returns a block update.
+    fn block() -> Result<ChainUpdate, SendError> {
+        Ok(ChainUpdate::Block(MultiEraBlockData::from(Vec::new())))
+    }
+
+    /// The buffer doesn't grow when the consumer is slower than the producer, which
+    /// waits for it instead.
+    #[tokio::test]
+    async fn slow_consumer() {
+        let buffer = UpdateBuffer::new(2, 8);
+        buffer.push(block()).await;
+        buffer.push(block()).await;
+
+        assert!(timeout(BLOCKED, buffer.push(block())).await.is_err());
+        assert_eq!(buffer.stats().capacity, 2);
+        assert_eq!(buffer.stats().occupancy, 2);
+    }
+
+    /// The buffer grows when it is found full after the consumer found it empty, up to
+    /// its maximum capacity.
+    #[tokio::test]
+    async fn grows_on_bursts() {
+        let buffer = UpdateBuffer::new(2, 6);
+
+        for capacity in [4, 6] {
+            while buffer.stats().occupancy > 0 {
+                buffer.pop().await.expect("update");
+            }
+            assert!(timeout(BLOCKED, buffer.pop()).await.is_err());
+
+            for _ in 0..=buffer.stats().capacity {
+                buffer.push(block()).await;
+            }
+            assert_eq!(buffer.stats().capacity, capacity);
+        }
+
+        assert_eq!(buffer.stats().high_water_mark, 5);
+    }
+
+    /// The buffer shrinks back once its occupancy stayed low for a while, down to its
+    /// minimum capacity.
+    #[tokio::test]
+    async fn shrinks_when_idle() {
+        let buffer = UpdateBuffer::new(2, 8);
+        assert!(timeout(BLOCKED, buffer.pop()).await.is_err());
+        for _ in 0..3 {
+            buffer.push(block()).await;
+        }
+        assert_eq!(buffer.stats().capacity, 4);
+
+        for _ in 0..3 {
+            buffer.pop().await.expect("update");
+        }
+        for _ in 0..40 {
+            buffer.push(block()).await;
+            buffer.pop().await.expect("update");
+        }
+        assert_eq!(buffer.stats().capacity, 2);
+    }
+
+    /// Batches stop at the first error, which is returned on its own.
+    #[tokio::test]
+    async fn batch_up_to_error() {
+        let buffer = UpdateBuffer::new(4, 4);
+        buffer.push(block()).await;
+        buffer.push(block()).await;
+        buffer.push(Err("failed".into())).await;
+        buffer.push(block()).await;
+
+        let mut updates = Vec::new();
+        assert_eq!(buffer.pop_batch(10, &mut updates).await.ok(), Some(2));
+        assert!(buffer.pop_batch(10, &mut updates).await.is_err());
+        assert_eq!(buffer.pop_batch(10, &mut updates).await.ok(), Some(1));
+        assert_eq!(updates.len(), 3);
+    }
+}
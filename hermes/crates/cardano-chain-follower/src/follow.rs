@@ -0,0 +1,183 @@
+//! Background task of the [`Follower`](crate::Follower).
+
+use std::sync::{Arc, Mutex};
+
+use pallas::{
+    ledger::traverse::MultiEraHeader,
+    network::{facades::PeerClient, miniprotocols::chainsync},
+};
+
+use crate::{
+    buffer::UpdateBuffer, index::PointIndex, BlockStore, ChainUpdate, MultiEraBlockData, Point,
+    SendError, StoredBlocks, RECENT_BLOCKS_WINDOW, SECURITY_PARAMETER,
+};
+
+/// Points of the recently followed blocks, shared by the follower and its task.
+pub(crate) type RecentBlocks = Arc<Mutex<PointIndex<()>>>;
+
+/// State of the follower task.
+pub(crate) struct FollowTask {
+    /// Connection to the producer node.
+    pub(crate) client: PeerClient,
+    /// Point the read-pointer was set to. The producer reports it as a rollback
+    /// before the first update, which is not passed on to the consumer. None if the
+    /// rollback has to be passed on, as after resuming from an ancestor of the blocks
+    /// the consumer already got.
+    pub(crate) intersection: Option<Point>,
+    /// Stored blocks passed on before following the producer.
+    pub(crate) local: Option<StoredBlocks>,
+    /// Store the immutable blocks are appended to.
+    pub(crate) store: Option<Arc<BlockStore>>,
+    /// Recently followed blocks.
+    pub(crate) recent: RecentBlocks,
+    /// Buffer the updates are pushed to.
+    pub(crate) buffer: Arc<UpdateBuffer>,
+    /// Maximum number of AWAIT messages in a row.
+    pub(crate) max_await_retries: u32,
+    /// Number of AWAIT messages received since the last update.
+    pub(crate) awaits: u32,
+}
+
+impl FollowTask {
+    /// Follows the chain, pushing the updates to the buffer until an error occurs.
+    pub(crate) async fn run(mut self) {
+        loop {
+            match self.next_update().await {
+                Ok(Some(update)) => self.buffer.push(Ok(update)).await,
+                Ok(None) => {},
+                Err(err) => {
+                    self.buffer.push(Err(err)).await;
+                    return;
+                },
+            }
+        }
+    }
+
+    /// Receives the next message from the producer, returning the chain update it
+    /// results in, if any.
+    async fn next_update(&mut self) -> Result<Option<ChainUpdate>, SendError> {
+        if let Some(res) = self.local.as_mut().and_then(Iterator::next) {
+            let data = res.map_err(|err| err.to_string())?;
+            let header = data.header().map_err(|err| err.to_string())?;
+            let point = Point::Specific(header.slot(), header.hash().to_vec());
+            self.remember(&point);
+
+            return Ok(Some(ChainUpdate::Block(data)));
+        }
+
+        match self.client.chainsync().request_or_await_next().await? {
+            chainsync::NextResponse::RollForward(header, tip) => {
+                self.awaits = 0;
+
+                let header = MultiEraHeader::decode(
+                    header.variant,
+                    header.byron_prefix.map(|(subtag, _)| subtag),
+                    &header.cbor,
+                )?;
+                let point = Point::Specific(header.slot(), header.hash().to_vec());
+                // Only the blocks the producer can no longer roll back are stored.
+                let immutable = header.number().saturating_add(SECURITY_PARAMETER) <= tip.1;
+                let previous = header.previous_hash().map(|hash| hash.to_vec());
+
+                let data = MultiEraBlockData::from(
+                    self.client.blockfetch().fetch_single(point.clone()).await?,
+                );
+                if immutable {
+                    self.persist(previous.as_deref(), &point, &data)?;
+                }
+                self.remember(&point);
+
+                Ok(Some(ChainUpdate::Block(data)))
+            },
+            chainsync::NextResponse::RollBackward(point, _) => {
+                self.awaits = 0;
+
+                if self.intersection.take().as_ref() == Some(&point) {
+                    return Ok(None);
+                }
+
+                if point == Point::Origin {
+                    return Err("chain rolled back to the origin".into());
+                }
+
+                // Only the points of the recent blocks are kept, so the block rolled
+                // back to is fetched again.
+                let known = {
+                    let mut recent = self.lock_recent();
+                    match recent.find(&point) {
+                        Some(i) => {
+                            recent.truncate_after(i);
+                            true
+                        },
+                        None => {
+                            *recent = PointIndex::default();
+                            false
+                        },
+                    }
+                };
+
+                let data = MultiEraBlockData::from(
+                    self.client.blockfetch().fetch_single(point.clone()).await?,
+                );
+                if !known {
+                    self.remember(&point);
+                }
+
+                Ok(Some(ChainUpdate::Rollback(data)))
+            },
+            chainsync::NextResponse::Await => {
+                self.awaits += 1;
+
+                if self.awaits > self.max_await_retries {
+                    return Err("producer kept the follower waiting".into());
+                }
+
+                Ok(None)
+            },
+        }
+    }
+
+    /// Appends an immutable block to the block store, if `previous`, the hash of the
+    /// block before it, is the store tip.
+    fn persist(
+        &self, previous: Option<&[u8]>, point: &Point, data: &MultiEraBlockData,
+    ) -> Result<(), SendError> {
+        let Some(store) = &self.store else {
+            return Ok(());
+        };
+
+        let follows_tip = match store.tip() {
+            Some(Point::Specific(_, hash)) => previous == Some(&hash[..]),
+            Some(Point::Origin) | None => true,
+        };
+        if follows_tip {
+            store
+                .append(point, data.raw())
+                .map_err(|err| err.to_string())?;
+        }
+
+        Ok(())
+    }
+
+    /// Adds a block to the recently followed blocks, dropping the oldest one past
+    /// [`RECENT_BLOCKS_WINDOW`].
+    fn remember(&self, point: &Point) {
+        let mut recent = self.lock_recent();
+
+        if recent.push(point, ()).is_err() {
+            // The block doesn't follow the recent ones, which are no longer usable.
+            *recent = PointIndex::default();
+            recent.push(point, ()).ok();
+        }
+
+        if recent.len() > RECENT_BLOCKS_WINDOW {
+            let excess = recent.len() - RECENT_BLOCKS_WINDOW;
+            recent.drop_first(excess);
+        }
+    }
+
+    /// Locks the recently followed blocks.
+    fn lock_recent(&self) -> std::sync::MutexGuard<'_, PointIndex<()>> {
+        self.recent.lock().unwrap_or_else(|err| err.into_inner())
+    }
+}
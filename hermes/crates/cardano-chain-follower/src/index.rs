@@ -0,0 +1,247 @@
+//! Compact index of chain points.
+
+use crate::{Point, Result};
+
+/// Size of a block hash.
+pub(crate) const HASH_SIZE: usize = 32;
+
+/// Index of a sequence of blocks, in chain order, by point.
+///
+/// Slots, hashes and values are kept in separate arrays, so looking up a point is a
+/// binary search over a dense array of slots that only touches the hashes of the
+/// matching slot.
+pub(crate) struct PointIndex<T> {
+    /// Slot of each block.
+    slots: Vec<u64>,
+    /// Hash of each block.
+    hashes: Vec<[u8; HASH_SIZE]>,
+    /// Value associated with each block.
+    values: Vec<T>,
+}
+
+impl<T> Default for PointIndex<T> {
+    fn default() -> Self {
+        Self {
+            slots: Vec::new(),
+            hashes: Vec::new(),
+            values: Vec::new(),
+        }
+    }
+}
+
+impl<T> PointIndex<T> {
+    /// Returns the number of indexed blocks.
+    pub(crate) fn len(&self) -> usize {
+        self.slots.len()
+    }
+
+    /// Appends the block at `slot` with hash `hash`, which must come after the last
+    /// indexed block.
+    pub(crate) fn push_raw(&mut self, slot: u64, hash: [u8; HASH_SIZE], value: T) -> Result<()> {
+        if let (Some(last_slot), Some(last_hash)) = (self.slots.last(), self.hashes.last()) {
+            if slot < *last_slot || (slot == *last_slot && hash == *last_hash) {
+                return Err("block does not come after the last indexed block".into());
+            }
+        }
+
+        self.slots.push(slot);
+        self.hashes.push(hash);
+        self.values.push(value);
+
+        Ok(())
+    }
+
+    /// Appends the block at `point`, which must come after the last indexed block.
+    pub(crate) fn push(&mut self, point: &Point, value: T) -> Result<()> {
+        let Point::Specific(slot, hash) = point else {
+            return Err("the origin can't be indexed".into());
+        };
+        let hash = hash[..]
+            .try_into()
+            .map_err(|_| "invalid block hash length")?;
+
+        self.push_raw(*slot, hash, value)
+    }
+
+    /// Returns the position of the block at `point`, if indexed.
+    pub(crate) fn find(&self, point: &Point) -> Option<usize> {
+        let Point::Specific(slot, hash) = point else {
+            return None;
+        };
+
+        // Byron epoch boundary blocks share the slot of the next block, so a few
+        // hashes may need to be checked.
+        let start = self.slots.partition_point(|s| s < slot);
+        let end = start + self.slots.get(start..)?.partition_point(|s| s == slot);
+
+        self.hashes
+            .get(start..end)?
+            .iter()
+            .position(|h| h[..] == hash[..])
+            .map(|i| start + i)
+    }
+
+    /// Returns the position of the last block at or before `slot`, if any.
+    pub(crate) fn floor(&self, slot: u64) -> Option<usize> {
+        self.slots.partition_point(|s| *s <= slot).checked_sub(1)
+    }
+
+    /// Returns the point of the block at position `i`.
+    pub(crate) fn point(&self, i: usize) -> Option<Point> {
+        Some(Point::Specific(
+            *self.slots.get(i)?,
+            self.hashes.get(i)?.to_vec(),
+        ))
+    }
+
+    /// Returns the value associated with the block at position `i`.
+    pub(crate) fn get(&self, i: usize) -> Option<&T> {
+        self.values.get(i)
+    }
+
+    /// Returns the point of the last indexed block, if any.
+    pub(crate) fn last_point(&self) -> Option<Point> {
+        self.point(self.len().checked_sub(1)?)
+    }
+
+    /// Returns the points to offer a producer when looking for an intersection at the
+    /// block at position `i`: that block, followed by its ancestors at exponentially
+    /// growing distances, down to the first indexed block.
+    ///
+    /// If the block is no longer on the producer's chain, the closest of its ancestors
+    /// that is will be found in a single round trip.
+    pub(crate) fn intersection_points(&self, i: usize) -> Vec<Point> {
+        let mut points = Vec::new();
+        let Some(last) = self.len().checked_sub(1) else {
+            return points;
+        };
+        let start = i.min(last);
+
+        let mut offset = 0;
+        loop {
+            let i = start.saturating_sub(offset);
+            points.extend(self.point(i));
+
+            if i == 0 {
+                return points;
+            }
+            offset = (offset * 2).max(1);
+        }
+    }
+
+    /// Drops every block after position `i`.
+    pub(crate) fn truncate_after(&mut self, i: usize) {
+        let len = i.saturating_add(1);
+        self.slots.truncate(len);
+        self.hashes.truncate(len);
+        self.values.truncate(len);
+    }
+
+    /// Drops the first `n` blocks.
+    pub(crate) fn drop_first(&mut self, n: usize) {
+        let n = n.min(self.len());
+        self.slots.drain(..n);
+        self.hashes.drain(..n);
+        self.values.drain(..n);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the point index.
+
+    use super::*;
+
+    /// Returns the point of a block at `slot` with a hash made of `byte`.
+    fn point(slot: u64, byte: u8) -> Point {
+        Point::Specific(slot, vec![byte; HASH_SIZE])
+    }
+
+    /// Returns an index of the blocks at `slots`, each hashed with its position.
+    fn index(slots: &[u64]) -> PointIndex<usize> {
+        let mut index = PointIndex::default();
+        for (i, slot) in slots.iter().enumerate() {
+            let byte = u8::try_from(i).expect("few blocks");
+            index.push(&point(*slot, byte), i).expect("ordered blocks");
+        }
+        index
+    }
+
+    /// Blocks must come in chain order, and the origin can't be indexed.
+    #[test]
+    fn push_in_order() {
+        let mut index = index(&[10, 20]);
+
+        assert!(index.push(&point(20, 1), 2).is_err());
+        assert!(index.push(&point(15, 2), 2).is_err());
+        assert!(index.push(&Point::Origin, 2).is_err());
+        assert!(index.push(&Point::Specific(30, vec![0; 4]), 2).is_err());
+        assert_eq!(index.len(), 2);
+
+        // A different block at the same slot, as a Byron epoch boundary block.
+        assert!(index.push(&point(20, 2), 2).is_ok());
+        assert_eq!(index.last_point(), Some(point(20, 2)));
+    }
+
+    /// Blocks are found by slot and hash, blocks sharing a slot included.
+    #[test]
+    fn find_points() {
+        let index = index(&[10, 20, 20, 30]);
+
+        assert_eq!(index.find(&point(10, 0)), Some(0));
+        assert_eq!(index.find(&point(20, 1)), Some(1));
+        assert_eq!(index.find(&point(20, 2)), Some(2));
+        assert_eq!(index.find(&point(20, 3)), None);
+        assert_eq!(index.find(&point(25, 0)), None);
+        assert_eq!(index.find(&Point::Origin), None);
+        assert_eq!(index.get(3), Some(&3));
+
+        assert_eq!(index.floor(5), None);
+        assert_eq!(index.floor(20), Some(2));
+        assert_eq!(index.floor(29), Some(2));
+        assert_eq!(index.floor(100), Some(3));
+    }
+
+    /// Intersection points go back from the block at exponentially growing distances,
+    /// down to the first block.
+    #[test]
+    fn intersection_points() {
+        let slots: Vec<_> = (0..20).collect();
+        let index = index(&slots);
+
+        let offered: Vec<_> = index
+            .intersection_points(19)
+            .into_iter()
+            .filter_map(|point| {
+                match point {
+                    Point::Specific(slot, _) => Some(slot),
+                    Point::Origin => None,
+                }
+            })
+            .collect();
+        assert_eq!(offered, [19, 18, 17, 15, 11, 3, 0]);
+
+        assert_eq!(index.intersection_points(0), [point(0, 0)]);
+        assert!(PointIndex::<()>::default()
+            .intersection_points(0)
+            .is_empty());
+    }
+
+    /// Blocks can be dropped from both ends.
+    #[test]
+    fn truncate() {
+        let mut index = index(&[10, 20, 30, 40]);
+
+        index.truncate_after(2);
+        assert_eq!(index.last_point(), Some(point(30, 2)));
+
+        index.drop_first(1);
+        assert_eq!(index.len(), 2);
+        assert_eq!(index.find(&point(20, 1)), Some(0));
+        assert_eq!(index.get(0), Some(&1));
+
+        index.drop_first(5);
+        assert_eq!(index.len(), 0);
+        assert_eq!(index.last_point(), None);
+    }
+}
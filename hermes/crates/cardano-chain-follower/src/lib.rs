@@ -1,22 +1,54 @@
 //! Cardano chain follower.
 
-// TODO: remove this once we implement the API.
-#![allow(dead_code, clippy::unused_async, clippy::no_effect_underscore_binding)]
 // (fsgr): This should be removed. I only added it because, for some reason,
 //         the tower crate is failing to compile in my machine (didn't test anywhere else)
 //         if it's compiled with this flag.
 #![deny(missing_docs)]
 
+mod block;
+mod buffer;
+mod follow;
+mod index;
+mod parallel;
+mod store;
+mod validation;
+
+use std::{
+    pin::Pin,
+    sync::Arc,
+    task::{Context, Poll},
+};
+
+pub use block::{BlockTx, MultiEraBlockData};
+pub use buffer::ChainUpdateBufferStats;
+use buffer::UpdateBuffer;
+use follow::{FollowTask, RecentBlocks};
+use index::PointIndex;
 pub use pallas::network::miniprotocols::Point;
-use pallas::{
-    ledger::traverse::MultiEraBlock,
-    network::miniprotocols::{MAINNET_MAGIC, PREVIEW_MAGIC, PRE_PRODUCTION_MAGIC, TESTNET_MAGIC},
+use pallas::network::{
+    facades::PeerClient,
+    miniprotocols::{MAINNET_MAGIC, PREVIEW_MAGIC, PRE_PRODUCTION_MAGIC, TESTNET_MAGIC},
 };
+pub use store::{BlockStore, StoredBlocks};
+use tokio::{
+    sync::{mpsc, Mutex},
+    task::JoinHandle,
+};
+pub use tokio_stream::Stream;
+use tokio_stream::StreamExt;
+pub use validation::{validate_blocks, InvalidBlock};
 
 /// Default [`Follower`] block buffer size.
 const DEFAULT_CHAIN_UPDATE_BUFFER_SIZE: usize = 32;
 /// Default [`Follower`] max await retries.
 const DEFAULT_MAX_AWAIT_RETRIES: u32 = 3;
+/// Default number of blocks [`Reader::read_block_range`] holds ahead of the consumer.
+const DEFAULT_BLOCK_RANGE_WINDOW: usize = 64;
+/// Number of recently followed blocks kept by the [`Follower`]. Rollbacks can't go
+/// further back than the security parameter.
+const RECENT_BLOCKS_WINDOW: usize = 2160;
+/// Number of blocks after which a block can no longer be rolled back.
+const SECURITY_PARAMETER: u64 = 2160;
 
 /// Crate error type.
 ///
@@ -38,7 +70,11 @@ pub type Error = Box<dyn std::error::Error>;
 /// Crate result type.
 pub type Result<T> = std::result::Result<T, Error>;
 
+/// Error type that can be sent from the tasks spawned by the crate.
+type SendError = Box<dyn std::error::Error + Send + Sync>;
+
 /// A point in the chain or the tip.
+#[derive(Clone)]
 pub enum PointOrTip {
     /// Represents a specific point of the chain.
     Point(Point),
@@ -52,23 +88,6 @@ impl From<Point> for PointOrTip {
     }
 }
 
-/// CBOR encoded data of a multi-era block.
-pub struct MultiEraBlockData(Vec<u8>);
-
-impl MultiEraBlockData {
-    /// Decodes the data into a multi-era block.
-    ///
-    /// # Errors
-    ///
-    /// Returns Err if the block's era couldn't be decided or if the encoded data is
-    /// invalid.
-    pub fn decode(&self) -> Result<MultiEraBlock> {
-        let block = MultiEraBlock::decode(&self.0).map_err(Box::new)?;
-
-        Ok(block)
-    }
-}
-
 /// Enum of possible Cardano networks.
 pub enum Network {
     /// Cardano mainnet network.
@@ -93,7 +112,18 @@ impl From<Network> for u64 {
 }
 
 /// Cardano chain Reader.
-pub struct Reader {}
+pub struct Reader {
+    /// Connection to the producer node.
+    ///
+    /// It is shared with the tasks spawned by [`Reader::read_block_range_stream`],
+    /// which hold the lock until the whole range has been received.
+    client: Arc<Mutex<PeerClient>>,
+    /// Connections to additional producers, used along with `client` to download
+    /// block ranges in parallel.
+    extra_peers: Vec<Arc<Mutex<PeerClient>>>,
+    /// Local store of immutable blocks, looked up before asking the producers.
+    store: Option<Arc<BlockStore>>,
+}
 
 impl Reader {
     /// Connects the Reader to a producer using the node-to-node protocol.
@@ -106,8 +136,60 @@ impl Reader {
     /// # Errors
     ///
     /// Returns Err if the connection could not be established.
-    pub async fn connect(_address: &str, _network: Network) -> Result<Self> {
-        todo!()
+    pub async fn connect(address: &str, network: Network) -> Result<Self> {
+        let client = PeerClient::connect(address, network.into())
+            .await
+            .map_err(Box::new)?;
+
+        Ok(Self {
+            client: Arc::new(Mutex::new(client)),
+            extra_peers: Vec::new(),
+            store: None,
+        })
+    }
+
+    /// Connects the Reader to several producers using the node-to-node protocol.
+    ///
+    /// Block ranges are downloaded from all producers in parallel (see
+    /// [`Reader::read_block_range_stream`]), any other request is sent to the first
+    /// one.
+    ///
+    /// # Arguments
+    ///
+    /// * `addresses`: Addresses of the nodes to connect to.
+    /// * `network`: The [Network] the client is assuming it's connecting to.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if no address was given or if any of the connections could not be
+    /// established.
+    pub async fn connect_many(addresses: &[&str], network: Network) -> Result<Self> {
+        let magic: u64 = network.into();
+
+        let mut peers = Vec::with_capacity(addresses.len());
+        for address in addresses {
+            let client = PeerClient::connect(*address, magic)
+                .await
+                .map_err(Box::new)?;
+            peers.push(Arc::new(Mutex::new(client)));
+        }
+
+        let mut peers = peers.into_iter();
+        let client = peers.next().ok_or("no producer address given")?;
+
+        Ok(Self {
+            client,
+            extra_peers: peers.collect(),
+            store: None,
+        })
+    }
+
+    /// Sets the local block store the reader serves blocks from.
+    ///
+    /// Blocks found in the store are read from disk, only the blocks past its tip are
+    /// requested from the producers.
+    pub fn set_block_store(&mut self, store: Arc<BlockStore>) {
+        self.store = Some(store);
     }
 
     /// Reads a single block from the chain.
@@ -119,9 +201,26 @@ impl Reader {
     /// # Errors
     ///
     /// Returns Err if the block was not found or if some communication error ocurred.
-    pub async fn read_block<P>(&mut self, _at: P) -> Result<MultiEraBlockData>
+    pub async fn read_block<P>(&mut self, at: P) -> Result<MultiEraBlockData>
     where P: Into<PointOrTip> {
-        todo!()
+        let at = at.into();
+
+        if let (Some(store), PointOrTip::Point(point)) = (&self.store, &at) {
+            if let Some(data) = store.get(point)? {
+                return Ok(data);
+            }
+        }
+
+        let mut client = self.client.lock().await;
+
+        let point = resolve_point_or_tip(&mut client, at).await?;
+        let data = client
+            .blockfetch()
+            .fetch_single(point)
+            .await
+            .map_err(Box::new)?;
+
+        Ok(data.into())
     }
 
     /// Reads a range of blocks from the chain.
@@ -136,14 +235,195 @@ impl Reader {
     /// Returns Err if the block range was not found or if some communication error
     /// ocurred.
     pub async fn read_block_range<P>(
-        &mut self, _from: Point, _to: P,
+        &mut self, from: Point, to: P,
     ) -> Result<Vec<MultiEraBlockData>>
     where P: Into<PointOrTip> {
-        todo!()
+        let mut stream = self
+            .read_block_range_stream(from, to, DEFAULT_BLOCK_RANGE_WINDOW)
+            .await?;
+
+        let mut blocks = Vec::new();
+        while let Some(block) = stream.next().await {
+            blocks.push(block?);
+        }
+
+        Ok(blocks)
+    }
+
+    /// Streams a range of blocks from the chain.
+    ///
+    /// Blocks held by the local block store (see [`Reader::set_block_store`]) are read
+    /// from disk, only the rest of the range is requested from the producers.
+    ///
+    /// When connected to a single producer, the whole range is requested with a single
+    /// block-fetch request and the blocks are received by a background task while the
+    /// stream is being consumed. At most `window` blocks are held ahead of the
+    /// consumer, once the window is full the task stops receiving, so memory usage
+    /// does not grow with the range size.
+    ///
+    /// When connected to several producers (see [`Reader::connect_many`]), the range
+    /// is split into sub-ranges that are fetched from all of them concurrently. A
+    /// producer that fails or stalls is left out for the rest of the download and its
+    /// sub-range is fetched from another one. Blocks are still yielded in chain order.
+    ///
+    /// The reader can't be used for other requests until the range has been fully
+    /// received, even if the stream is dropped early.
+    ///
+    /// # Arguments
+    ///
+    /// * `from`: The point at which to start reading block from.
+    /// * `to`: The point up to which the blocks will be read.
+    /// * `window`: Maximum number of received blocks held ahead of the consumer.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block range was not found or if some communication error
+    /// ocurred. Errors that happen while the blocks are being received are yielded by
+    /// the stream.
+    pub async fn read_block_range_stream<P>(
+        &mut self, from: Point, to: P, window: usize,
+    ) -> Result<BlockStream>
+    where P: Into<PointOrTip> {
+        let to = match to.into() {
+            PointOrTip::Point(point) => point,
+            tip @ PointOrTip::Tip => {
+                resolve_point_or_tip(&mut *self.client.lock().await, tip).await?
+            },
+        };
+
+        // The range continues from the network with the last stored block, which is
+        // requested again and skipped.
+        let (local, from, skip_first) = match &self.store {
+            Some(store) => {
+                match store.read_range(&from, &to) {
+                    (local, Some(last)) if last == to => {
+                        return Ok(BlockStream {
+                            local: Some(local),
+                            skip_first: false,
+                            rx: None,
+                        });
+                    },
+                    (local, Some(last)) => (Some(local), last, true),
+                    (_, None) => (None, from, false),
+                }
+            },
+            None => (None, from, false),
+        };
+
+        let mut client = Arc::clone(&self.client).lock_owned().await;
+
+        if !self.extra_peers.is_empty() {
+            drop(client);
+
+            let peers = std::iter::once(&self.client)
+                .chain(&self.extra_peers)
+                .map(Arc::clone)
+                .collect();
+
+            return Ok(BlockStream {
+                local,
+                skip_first,
+                rx: Some(parallel::spawn(peers, from, to, window)),
+            });
+        }
+
+        if client
+            .blockfetch()
+            .request_range((from, to))
+            .await
+            .map_err(Box::new)?
+            .is_none()
+        {
+            return Err("block range not found".into());
+        }
+
+        let (tx, rx) = mpsc::channel(window.max(1));
+
+        tokio::spawn(async move {
+            let blockfetch = client.blockfetch();
+
+            loop {
+                let res = blockfetch.recv_while_streaming().await;
+                let done = !matches!(res, Ok(Some(_)));
+
+                // Keep receiving after the stream is dropped so the connection is
+                // left idle for the next request.
+                if !tx.is_closed() {
+                    if let Some(res) = res.map_err(Into::into).transpose() {
+                        tx.send(res).await.ok();
+                    }
+                }
+
+                if done {
+                    break;
+                }
+            }
+        });
+
+        Ok(BlockStream {
+            local,
+            skip_first,
+            rx: Some(rx),
+        })
+    }
+}
+
+/// Resolves a [`PointOrTip`] into the [`Point`] it refers to, asking the producer for
+/// its tip if needed.
+async fn resolve_point_or_tip(client: &mut PeerClient, point_or_tip: PointOrTip) -> Result<Point> {
+    match point_or_tip {
+        PointOrTip::Point(point) => Ok(point),
+        PointOrTip::Tip => {
+            let point = client.chainsync().intersect_tip().await.map_err(Box::new)?;
+
+            Ok(point)
+        },
+    }
+}
+
+/// Stream of blocks returned by [`Reader::read_block_range_stream`].
+pub struct BlockStream {
+    /// Blocks read from the local block store, yielded first.
+    local: Option<StoredBlocks>,
+    /// Whether the first block received is the last one read from the store.
+    skip_first: bool,
+    /// Blocks received by the background tasks, if the range wasn't fully stored.
+    rx: Option<mpsc::Receiver<std::result::Result<Vec<u8>, SendError>>>,
+}
+
+impl Stream for BlockStream {
+    type Item = Result<MultiEraBlockData>;
+
+    fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        if let Some(res) = self.local.as_mut().and_then(Iterator::next) {
+            return Poll::Ready(Some(res));
+        }
+
+        let this = &mut *self;
+        let Some(rx) = &mut this.rx else {
+            return Poll::Ready(None);
+        };
+
+        loop {
+            let res = std::task::ready!(rx.poll_recv(cx));
+
+            if this.skip_first && matches!(res, Some(Ok(_))) {
+                this.skip_first = false;
+                continue;
+            }
+
+            return Poll::Ready(res.map(|res| {
+                res.map(MultiEraBlockData::from)
+                    .map_err(|err| -> Error { err })
+            }));
+        }
     }
 }
 
 /// Enum of chain updates received by the follower.
+///
+/// Cloning an update doesn't copy the block, so it can be passed to many consumers.
+#[derive(Clone)]
 pub enum ChainUpdate {
     /// New block inserted on chain.
     Block(MultiEraBlockData),
@@ -155,18 +435,24 @@ pub enum ChainUpdate {
 pub struct FollowerConfigBuilder {
     /// Block buffer size option.
     chain_update_buffer_size: usize,
+    /// Maximum block buffer size option, if the buffer is adaptive.
+    chain_update_buffer_max_size: Option<usize>,
     /// Maximum await retries option.
     max_await_retries: u32,
     /// Where to start following from.
     follow_from: PointOrTip,
+    /// Local store of immutable blocks.
+    block_store: Option<Arc<BlockStore>>,
 }
 
 impl Default for FollowerConfigBuilder {
     fn default() -> Self {
         Self {
             chain_update_buffer_size: DEFAULT_CHAIN_UPDATE_BUFFER_SIZE,
+            chain_update_buffer_max_size: None,
             max_await_retries: DEFAULT_MAX_AWAIT_RETRIES,
             follow_from: PointOrTip::Tip,
+            block_store: None,
         }
     }
 }
@@ -174,6 +460,10 @@ impl Default for FollowerConfigBuilder {
 impl FollowerConfigBuilder {
     /// Sets the size of the chain updates buffer used by the [`Follower`].
     ///
+    /// If the buffer is adaptive (see
+    /// [`FollowerConfigBuilder::chain_update_buffer_max_size`]), this is its minimum
+    /// size.
+    ///
     /// # Arguments
     ///
     /// * `chain_update_buffer_size`: Size of the chain updates buffer.
@@ -183,6 +473,23 @@ impl FollowerConfigBuilder {
         self
     }
 
+    /// Makes the chain updates buffer used by the [`Follower`] adaptive, sets the
+    /// maximum size it can grow to.
+    ///
+    /// The buffer starts at the size set by
+    /// [`FollowerConfigBuilder::chain_update_buffer_size`]. It grows when updates
+    /// arrive in bursts the consumer can't keep up with, and shrinks back when it
+    /// stays mostly empty. See [`Follower::buffer_stats`] to monitor it.
+    ///
+    /// # Arguments
+    ///
+    /// * `chain_update_buffer_max_size`: Maximum size of the chain updates buffer.
+    #[must_use]
+    pub fn chain_update_buffer_max_size(mut self, chain_update_buffer_max_size: usize) -> Self {
+        self.chain_update_buffer_max_size = Some(chain_update_buffer_max_size);
+        self
+    }
+
     /// Sets the maximum number of retries the [`Follower`] will execute when remote node
     /// sends an AWAIT message when the [`Follower`] is already in the "must reply"
     /// state.
@@ -208,13 +515,33 @@ impl FollowerConfigBuilder {
         self
     }
 
+    /// Sets the local block store of the [`Follower`].
+    ///
+    /// Blocks found in the store are read from disk, the producer is only asked for
+    /// the blocks past its tip. Blocks that can no longer be rolled back are appended
+    /// to the store as they are received, when they follow its tip.
+    ///
+    /// # Arguments
+    ///
+    /// * `store`: Block store.
+    #[must_use]
+    pub fn block_store(mut self, store: Arc<BlockStore>) -> Self {
+        self.block_store = Some(store);
+        self
+    }
+
     /// Builds a [`FollowerConfig`].
     #[must_use]
     pub fn build(self) -> FollowerConfig {
         FollowerConfig {
             chain_update_buffer_size: self.chain_update_buffer_size,
+            chain_update_buffer_max_size: self
+                .chain_update_buffer_max_size
+                .unwrap_or(self.chain_update_buffer_size)
+                .max(self.chain_update_buffer_size),
             max_await_retries: self.max_await_retries,
             follow_from: self.follow_from,
+            block_store: self.block_store,
         }
     }
 }
@@ -223,14 +550,45 @@ impl FollowerConfigBuilder {
 pub struct FollowerConfig {
     /// Configured chain update buffer size.
     pub chain_update_buffer_size: usize,
+    /// Configured maximum chain update buffer size. The buffer is adaptive if this is
+    /// larger than `chain_update_buffer_size`.
+    pub chain_update_buffer_max_size: usize,
     /// Configured maximum await retry count.
     pub max_await_retries: u32,
     /// Where to start following from.
     pub follow_from: PointOrTip,
+    /// Local store of immutable blocks, if any.
+    pub block_store: Option<Arc<BlockStore>>,
 }
 
 /// Cardano chain follower.
-pub struct Follower {}
+///
+/// Chain updates are received by a background task, started on the first call to
+/// [`Follower::next`], and held in a buffer until the consumer asks for them.
+pub struct Follower {
+    /// Address of the producer node.
+    address: String,
+    /// Magic number of the network.
+    network_magic: u64,
+    /// Connection to the producer node, while the background task is not running.
+    client: Option<PeerClient>,
+    /// Follower's configuration.
+    config: FollowerConfig,
+    /// The point the read-pointer was last set to.
+    read_pointer: Option<Point>,
+    /// Tip of the block store, if the read-pointer was set before it. The stored
+    /// blocks after the read-pointer are passed on first, and the producer is followed
+    /// from there.
+    stored_until: Option<Point>,
+    /// Points of the most recently followed blocks, at most [`RECENT_BLOCKS_WINDOW`].
+    ///
+    /// Used to find intersections with the producer in a single round trip.
+    recent: RecentBlocks,
+    /// Buffer of chain updates received by the background task.
+    buffer: Arc<UpdateBuffer>,
+    /// Background task following the chain, if running.
+    task: Option<JoinHandle<()>>,
+}
 
 impl Follower {
     /// Connects the follower to a producer using the node-to-node protocol.
@@ -243,16 +601,54 @@ impl Follower {
     ///
     /// # Errors
     ///
-    /// Returns Err if the connection could not be established.
-    pub async fn connect(
-        _address: &str, _network: Network, _config: FollowerConfig,
-    ) -> Result<Self> {
-        todo!()
+    /// Returns Err if the connection could not be established or if the point to
+    /// follow from was not found on the chain.
+    pub async fn connect(address: &str, network: Network, config: FollowerConfig) -> Result<Self> {
+        let network_magic = network.into();
+        let client = PeerClient::connect(address, network_magic)
+            .await
+            .map_err(Box::new)?;
+
+        let follow_from = config.follow_from.clone();
+        let buffer = UpdateBuffer::new(
+            config.chain_update_buffer_size,
+            config.chain_update_buffer_max_size,
+        );
+        let mut follower = Self {
+            address: address.to_string(),
+            network_magic,
+            client: Some(client),
+            config,
+            read_pointer: None,
+            stored_until: None,
+            recent: RecentBlocks::default(),
+            buffer: Arc::new(buffer),
+            task: None,
+        };
+
+        if follower.set_read_pointer(follow_from).await?.is_none() {
+            return Err("point to follow from not found".into());
+        }
+
+        Ok(follower)
     }
 
     /// Set the follower's chain read-pointer. Returns None if the point was
     /// not found on the chain.
     ///
+    /// If the point is one of the recently followed blocks but is no longer on the
+    /// chain, for instance after reconnecting to another producer, the read-pointer is
+    /// set to its closest ancestor still on the chain and that point is returned
+    /// instead. The ancestors are found locally and offered to the producer in a single
+    /// request.
+    ///
+    /// If the point is in the block store, before its tip, the stored blocks are
+    /// followed first and the producer is asked for an intersection at the store tip
+    /// instead.
+    ///
+    /// Buffered chain updates are dropped. If the background task is running, it is
+    /// stopped and the follower reconnects to the producer.
+    ///
     /// # Arguments
     ///
     /// * `at`: Point at which to set the read-pointer.
@@ -260,26 +656,246 @@ impl Follower {
     /// # Errors
     ///
     /// Returns Err if something went wrong while communicating with the producer.
-    pub async fn set_read_pointer<P>(&mut self, _at: P) -> Result<Option<Point>>
+    pub async fn set_read_pointer<P>(&mut self, at: P) -> Result<Option<Point>>
     where P: Into<PointOrTip> {
-        todo!()
+        let at = at.into();
+        let stored_until = match (&self.config.block_store, &at) {
+            (Some(store), PointOrTip::Point(point)) if store.contains(point) => {
+                store.tip().filter(|tip| tip != point)
+            },
+            _ => None,
+        };
+        let points = match (&at, &stored_until) {
+            (_, Some(tip)) => vec![tip.clone()],
+            (PointOrTip::Point(point), None) => {
+                let recent = self.lock_recent();
+                match recent.find(point) {
+                    Some(i) => recent.intersection_points(i),
+                    None => vec![point.clone()],
+                }
+            },
+            (PointOrTip::Tip, None) => Vec::new(),
+        };
+
+        let client = self.idle_client().await?;
+
+        let intersection = match at {
+            PointOrTip::Point(point) => {
+                let (intersection, _) = client
+                    .chainsync()
+                    .find_intersect(points)
+                    .await
+                    .map_err(Box::new)?;
+                // Stored blocks are immutable, so the point is on the chain if the store
+                // tip is.
+                if stored_until.is_some() {
+                    intersection.map(|_| point)
+                } else {
+                    intersection
+                }
+            },
+            PointOrTip::Tip => {
+                let point = client.chainsync().intersect_tip().await.map_err(Box::new)?;
+                Some(point)
+            },
+        };
+
+        // The read-pointer is left unchanged if no intersection was found.
+        if let Some(point) = &intersection {
+            let mut recent = self.lock_recent();
+            match recent.find(point) {
+                Some(i) => recent.truncate_after(i),
+                None => *recent = PointIndex::default(),
+            }
+            drop(recent);
+
+            self.read_pointer = Some(point.clone());
+            self.stored_until = stored_until;
+        }
+
+        Ok(intersection)
     }
 
     /// Receive the next chain update from the producer.
     ///
+    /// If the connection to the producer was lost, the next call reconnects and
+    /// resumes following from the last received block.
+    ///
     /// # Errors
     ///
     /// Returns Err if any producer communication errors occurred.
     pub async fn next(&mut self) -> Result<ChainUpdate> {
-        todo!()
+        if self.task.is_none() {
+            self.start_task().await?;
+        }
+
+        match self.buffer.pop().await {
+            Ok(update) => Ok(update),
+            Err(err) => {
+                // The task stops after an error.
+                self.task = None;
+                let err: Error = err;
+                Err(err)
+            },
+        }
+    }
+
+    /// Receive every chain update available, up to `max`, appending them to
+    /// `updates`. Waits for at least one update if none is available. Returns the
+    /// number of updates received.
+    ///
+    /// This takes all the buffered updates at once, so during catch-up a consumer
+    /// handling many blocks is woken up once per batch instead of once per block.
+    /// `updates` is not cleared, so it can be reused between calls.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if any producer communication errors occurred. Updates received
+    /// before the error are returned first, the error is returned by the next call.
+    pub async fn next_batch(
+        &mut self, max: usize, updates: &mut Vec<ChainUpdate>,
+    ) -> Result<usize> {
+        if self.task.is_none() {
+            self.start_task().await?;
+        }
+
+        match self.buffer.pop_batch(max, updates).await {
+            Ok(count) => Ok(count),
+            Err(err) => {
+                // The task stops after an error.
+                self.task = None;
+                let err: Error = err;
+                Err(err)
+            },
+        }
+    }
+
+    /// Stops following the chain, waiting for the background task to finish, and
+    /// syncs the block store.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the background task panicked or if the block store could not be
+    /// synced.
+    pub async fn close(mut self) -> Result<()> {
+        self.stop_task().await?;
+
+        match &self.config.block_store {
+            Some(store) => store.sync(),
+            None => Ok(()),
+        }
+    }
+
+    /// Returns the statistics of the chain updates buffer.
+    #[must_use]
+    pub fn buffer_stats(&self) -> ChainUpdateBufferStats {
+        self.buffer.stats()
+    }
+
+    /// Starts the background task, reconnecting to the producer if the connection
+    /// was lost.
+    ///
+    /// If the producer no longer has the last block passed to the consumer, following
+    /// resumes from its closest ancestor still on the chain, and the consumer is sent a
+    /// rollback to it first.
+    async fn start_task(&mut self) -> Result<()> {
+        let mut rolled_back = false;
+
+        if self.client.is_none() {
+            let delivered = self.lock_recent().last_point();
+            let resume_from = delivered
+                .clone()
+                .or_else(|| self.read_pointer.clone())
+                .map_or(PointOrTip::Tip, PointOrTip::Point);
+
+            let Some(resumed) = self.set_read_pointer(resume_from).await? else {
+                return Err("point to resume following from not found".into());
+            };
+            rolled_back = delivered.is_some_and(|point| point != resumed);
+        }
+
+        let (local, intersection) = match (
+            self.stored_until.take(),
+            &self.config.block_store,
+            &self.read_pointer,
+        ) {
+            (Some(tip), Some(store), Some(from)) => {
+                let (mut blocks, _) = store.read_range(from, &tip);
+                // The block at the read-pointer isn't passed on.
+                blocks.next();
+                (Some(blocks), Some(tip))
+            },
+            // The rollback to the intersection is passed on when the consumer is past it.
+            _ if rolled_back => (None, None),
+            _ => (None, self.read_pointer.clone()),
+        };
+
+        let client = self.client.take().ok_or("not connected to the producer")?;
+        let task = FollowTask {
+            client,
+            intersection,
+            local,
+            store: self.config.block_store.clone(),
+            recent: Arc::clone(&self.recent),
+            buffer: Arc::clone(&self.buffer),
+            max_await_retries: self.config.max_await_retries,
+            awaits: 0,
+        };
+        self.task = Some(tokio::spawn(task.run()));
+
+        Ok(())
+    }
+
+    /// Returns a connection to the producer not used by the background task, stopping
+    /// the task and reconnecting if needed.
+    async fn idle_client(&mut self) -> Result<&mut PeerClient> {
+        if self.task.is_some() {
+            // The task may be in the middle of a request, so its connection can't be
+            // reused.
+            self.stop_task().await?;
+            self.client = None;
+        }
+        self.buffer.clear();
+
+        if self.client.is_none() {
+            let client = PeerClient::connect(self.address.as_str(), self.network_magic)
+                .await
+                .map_err(Box::new)?;
+            self.client = Some(client);
+        }
+
+        self.client
+            .as_mut()
+            .ok_or_else(|| "not connected to the producer".into())
+    }
+
+    /// Stops the background task, if running, and waits for it to finish so it can't
+    /// push any more updates to the buffer.
+    async fn stop_task(&mut self) -> Result<()> {
+        let Some(task) = self.task.take() else {
+            return Ok(());
+        };
+
+        task.abort();
+        match task.await {
+            Err(err) if err.is_panic() => Err("follower task panicked".into()),
+            Ok(()) | Err(_) => Ok(()),
+        }
+    }
+
+    /// Locks the recently followed blocks.
+    fn lock_recent(&self) -> std::sync::MutexGuard<'_, PointIndex<()>> {
+        self.recent.lock().unwrap_or_else(|err| err.into_inner())
     }
 }
 
-/// Validate a multi-era block.
-///
-/// This does not execute Plutus scripts nor validates ledger state.
-/// It only checks that the block is correctly formatted for its era.
-fn validate_multiera_block(_block: &MultiEraBlock) {
-    // (fsgr): Not sure about hwo the validation will be done in here yet.
-    todo!()
+impl Drop for Follower {
+    fn drop(&mut self) {
+        // The task can't be waited for here. Nothing reads the buffer once the follower
+        // is dropped, so updates it pushes until it is cancelled are simply lost. Use
+        // `Follower::close` to wait for it.
+        if let Some(task) = self.task.take() {
+            task.abort();
+        }
+    }
 }
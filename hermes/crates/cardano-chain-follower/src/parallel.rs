@@ -0,0 +1,410 @@
+//! Parallel download of a block range from several producers.
+//!
+//! The range is split into sub-ranges by following the chain headers from the first
+//! peer. Sub-ranges are put in a work queue shared by the other peers, each one fetching
+//! the next pending sub-range as soon as it is done with the previous one, and the first
+//! peer joins them once all sub-ranges are enqueued. A peer that fails or stalls is
+//! dropped and its sub-range is put back at the front of the queue for the remaining
+//! peers, the download fails once no peer is left to fetch it. Peers wait for the
+//! sub-ranges still being fetched to be delivered before leaving, so they are there to
+//! take over if the peer fetching them fails. Fetched sub-ranges are reassembled in chain
+//! order before being handed to the consumer.
+
+use std::{
+    collections::{BTreeMap, VecDeque},
+    sync::{Arc, Mutex as SyncMutex},
+    time::Duration,
+};
+
+use pallas::{
+    ledger::traverse::MultiEraHeader,
+    network::{facades::PeerClient, miniprotocols::chainsync},
+};
+use tokio::sync::{mpsc, Mutex, Notify, OwnedSemaphorePermit, Semaphore, TryAcquireError};
+
+use crate::{Point, SendError};
+
+/// Number of blocks in each sub-range handed to a peer.
+const SUB_RANGE_SIZE: usize = 100;
+/// Number of pending sub-ranges allowed per peer.
+const SUB_RANGES_PER_PEER: usize = 2;
+/// Time after which a peer that didn't deliver its sub-range is considered stalled.
+const PEER_STALL_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// A contiguous range of blocks to be fetched by a single peer.
+struct SubRange {
+    /// Position of the sub-range within the whole range.
+    index: usize,
+    /// First point of the sub-range.
+    from: Point,
+    /// Last point of the sub-range.
+    to: Point,
+    /// Keeps the sub-range accounted for until its blocks are sent to the consumer.
+    permit: OwnedSemaphorePermit,
+}
+
+/// Events received by the reassembly task.
+enum Event {
+    /// The blocks of a sub-range were fetched.
+    Fetched(usize, Vec<Vec<u8>>, OwnedSemaphorePermit),
+    /// All sub-ranges were enqueued.
+    Enumerated(usize),
+    /// The range could not be split into sub-ranges, or no peer is left to fetch
+    /// them.
+    Failed(SendError),
+}
+
+/// Sub-ranges waiting for a peer.
+#[derive(Default)]
+struct WorkQueue {
+    /// Pending sub-ranges, in chain order.
+    pending: VecDeque<SubRange>,
+    /// Whether no more sub-ranges will be enqueued.
+    enumerated: bool,
+    /// Whether the download was finished or aborted.
+    closed: bool,
+    /// Number of sub-ranges taken by a peer and not delivered yet.
+    in_flight: usize,
+    /// Number of peers enumerating or fetching sub-ranges.
+    active_peers: usize,
+}
+
+impl WorkQueue {
+    /// Takes the next pending sub-range, to be fetched by the caller.
+    fn take(&mut self) -> Option<SubRange> {
+        let sub_range = self.pending.pop_front()?;
+        self.in_flight += 1;
+        Some(sub_range)
+    }
+}
+
+/// State shared by the tasks involved in a parallel download.
+struct Shared {
+    /// Work queue.
+    queue: SyncMutex<WorkQueue>,
+    /// Notified when the work queue changes.
+    changed: Notify,
+}
+
+impl Shared {
+    /// Runs `f` with the work queue locked, notifying the waiting peers afterwards.
+    fn update<T>(&self, f: impl FnOnce(&mut WorkQueue) -> T) -> T {
+        let res = f(&mut self.queue.lock().unwrap_or_else(|err| err.into_inner()));
+        self.changed.notify_waiters();
+        res
+    }
+
+    /// Waits for the next pending sub-range. Returns None once every sub-range was
+    /// delivered, or the download was aborted.
+    async fn next_sub_range(&self) -> Option<SubRange> {
+        loop {
+            // Created before checking the queue so no notification is missed.
+            let changed = self.changed.notified();
+
+            {
+                let mut queue = self.queue.lock().unwrap_or_else(|err| err.into_inner());
+                if queue.closed {
+                    return None;
+                }
+                if let Some(sub_range) = queue.take() {
+                    return Some(sub_range);
+                }
+                if queue.enumerated && queue.in_flight == 0 {
+                    return None;
+                }
+            }
+
+            changed.await;
+        }
+    }
+
+    /// Takes the next pending sub-range if no other peer is left to fetch it.
+    fn take_if_alone(&self) -> Option<SubRange> {
+        let mut queue = self.queue.lock().unwrap_or_else(|err| err.into_inner());
+        if queue.active_peers > 1 {
+            return None;
+        }
+        queue.take()
+    }
+
+    /// Sends the blocks of a fetched sub-range to the reassembly task.
+    fn deliver(
+        &self, sub_range: SubRange, blocks: Vec<Vec<u8>>, events: &mpsc::UnboundedSender<Event>,
+    ) {
+        events
+            .send(Event::Fetched(sub_range.index, blocks, sub_range.permit))
+            .ok();
+        self.update(|queue| queue.in_flight = queue.in_flight.saturating_sub(1));
+    }
+
+    /// Removes a peer from the fetching peers, putting back the sub-range it failed to
+    /// fetch, if any. Returns whether no peer is left to fetch the sub-ranges still to
+    /// be fetched, in which case the download is aborted.
+    fn leave(&self, failed: Option<SubRange>) -> bool {
+        self.update(|queue| {
+            queue.active_peers = queue.active_peers.saturating_sub(1);
+
+            if let Some(sub_range) = failed {
+                queue.in_flight = queue.in_flight.saturating_sub(1);
+                queue.pending.push_front(sub_range);
+            }
+            let unfinished = !queue.pending.is_empty() || !queue.enumerated || queue.in_flight > 0;
+
+            let stranded = queue.active_peers == 0 && unfinished && !queue.closed;
+            if stranded {
+                queue.closed = true;
+            }
+            stranded
+        })
+    }
+
+    /// Whether the download was finished or aborted.
+    fn is_closed(&self) -> bool {
+        self.queue
+            .lock()
+            .unwrap_or_else(|err| err.into_inner())
+            .closed
+    }
+}
+
+/// Spawns the tasks downloading the blocks between `from` and `to` (inclusive) from
+/// `peers`, returning the receiving end of the reassembled blocks.
+///
+/// The first peer is used to follow the headers of the range and joins the other
+/// peers in fetching blocks once it is done. It is locked for the whole enumeration, so
+/// it only fetches sub-ranges meanwhile when no other peer is left to, which keeps
+/// the enumeration going once the pending sub-ranges use up their limit.
+pub(crate) fn spawn(
+    peers: Vec<Arc<Mutex<PeerClient>>>, from: Point, to: Point, window: usize,
+) -> mpsc::Receiver<std::result::Result<Vec<u8>, SendError>> {
+    let shared = Arc::new(Shared {
+        queue: SyncMutex::new(WorkQueue {
+            active_peers: peers.len(),
+            ..WorkQueue::default()
+        }),
+        changed: Notify::new(),
+    });
+    let pending_limit = Arc::new(Semaphore::new(peers.len() * SUB_RANGES_PER_PEER));
+    let (events_tx, events_rx) = mpsc::unbounded_channel();
+    let (blocks_tx, blocks_rx) = mpsc::channel(window.max(1));
+
+    if let Some(first) = peers.first() {
+        tokio::spawn(enumerate(
+            Arc::clone(first),
+            from,
+            to,
+            Arc::clone(&shared),
+            Arc::clone(&pending_limit),
+            events_tx.clone(),
+        ));
+    }
+    for peer in peers.into_iter().skip(1) {
+        tokio::spawn(fetch(peer, Arc::clone(&shared), events_tx.clone()));
+    }
+    tokio::spawn(reassemble(shared, pending_limit, events_rx, blocks_tx));
+
+    blocks_rx
+}
+
+/// Follows the headers from `from` to `to`, splitting them into sub-ranges of at
+/// most [`SUB_RANGE_SIZE`] blocks, then fetches sub-ranges along with the other peers.
+async fn enumerate(
+    peer: Arc<Mutex<PeerClient>>, from: Point, to: Point, shared: Arc<Shared>,
+    pending_limit: Arc<Semaphore>, events: mpsc::UnboundedSender<Event>,
+) {
+    let mut client = peer.lock().await;
+    let mut index = 0;
+
+    let res = async {
+        let (intersection, _) = client
+            .chainsync()
+            .find_intersect(vec![from.clone()])
+            .await?;
+        if intersection.is_none() {
+            return Err("block range start not found".into());
+        }
+
+        // First point and length of the sub-range being enumerated.
+        let mut sub_range = Some((from.clone(), 1));
+        let mut last = from;
+
+        loop {
+            let sub_range_full = matches!(&sub_range, Some((_, len)) if *len >= SUB_RANGE_SIZE);
+            if sub_range_full || last == to {
+                if let Some((first, _)) = sub_range.take() {
+                    let permit = loop {
+                        // Created before checking the queue so no notification is missed.
+                        let changed = shared.changed.notified();
+
+                        match Arc::clone(&pending_limit).try_acquire_owned() {
+                            Ok(permit) => break permit,
+                            Err(TryAcquireError::Closed) => {
+                                return Err("block range download aborted".into());
+                            },
+                            Err(TryAcquireError::NoPermits) => {},
+                        }
+
+                        // Permits are only released as sub-ranges are delivered, which
+                        // takes this peer once the others are gone.
+                        if let Some(pending) = shared.take_if_alone() {
+                            let blocks = tokio::time::timeout(
+                                PEER_STALL_TIMEOUT,
+                                client
+                                    .blockfetch()
+                                    .fetch_range((pending.from.clone(), pending.to.clone())),
+                            )
+                            .await
+                            .map_err(|_| "all peers stalled while reading the block range")??;
+                            shared.deliver(pending, blocks, &events);
+                            continue;
+                        }
+
+                        changed.await;
+                    };
+                    shared.update(|queue| {
+                        queue.pending.push_back(SubRange {
+                            index,
+                            from: first,
+                            to: last.clone(),
+                            permit,
+                        });
+                    });
+                    index += 1;
+                }
+            }
+
+            if last == to || shared.is_closed() {
+                break;
+            }
+
+            match client.chainsync().request_or_await_next().await? {
+                chainsync::NextResponse::RollForward(header, _) => {
+                    let header = MultiEraHeader::decode(
+                        header.variant,
+                        header.byron_prefix.map(|(subtag, _)| subtag),
+                        &header.cbor,
+                    )?;
+                    last = Point::Specific(header.slot(), header.hash().to_vec());
+
+                    match &mut sub_range {
+                        Some((_, len)) => *len += 1,
+                        None => sub_range = Some((last.clone(), 1)),
+                    }
+                },
+                chainsync::NextResponse::RollBackward(point, _) => {
+                    // The intersection is reported as a rollback before the first
+                    // header, anything else means the range is being rolled back.
+                    if point != last {
+                        return Err("chain rolled back while reading the block range".into());
+                    }
+                },
+                chainsync::NextResponse::Await => {},
+            }
+        }
+
+        Ok::<_, SendError>(())
+    }
+    .await;
+
+    match res {
+        Ok(()) => {
+            shared.update(|queue| queue.enumerated = true);
+            events.send(Event::Enumerated(index)).ok();
+
+            drop(client);
+            fetch(peer, shared, events).await;
+        },
+        Err(err) => {
+            events.send(Event::Failed(err)).ok();
+        },
+    }
+}
+
+/// Fetches pending sub-ranges from `peer` until there is no more work or the peer
+/// fails.
+async fn fetch(
+    peer: Arc<Mutex<PeerClient>>, shared: Arc<Shared>, events: mpsc::UnboundedSender<Event>,
+) {
+    while let Some(sub_range) = shared.next_sub_range().await {
+        let mut client = peer.lock().await;
+
+        let res = tokio::time::timeout(
+            PEER_STALL_TIMEOUT,
+            client
+                .blockfetch()
+                .fetch_range((sub_range.from.clone(), sub_range.to.clone())),
+        )
+        .await;
+        drop(client);
+
+        match res {
+            Ok(Ok(blocks)) => shared.deliver(sub_range, blocks, &events),
+            Ok(Err(_)) | Err(_) => {
+                // This peer is left out for the rest of the download and the others
+                // take over its sub-range. If this was the last peer the download
+                // can't be completed.
+                if shared.leave(Some(sub_range)) {
+                    let err = match res {
+                        Ok(Err(err)) => err.into(),
+                        _ => "all peers stalled while reading the block range".into(),
+                    };
+                    events.send(Event::Failed(err)).ok();
+                }
+
+                return;
+            },
+        }
+    }
+
+    // Only reached once every sub-range was delivered or the download was aborted.
+    if shared.leave(None) {
+        events
+            .send(Event::Failed("no peer left to read the block range".into()))
+            .ok();
+    }
+}
+
+/// Receives the fetched sub-ranges and sends their blocks to the consumer in chain
+/// order.
+async fn reassemble(
+    shared: Arc<Shared>, pending_limit: Arc<Semaphore>, mut events: mpsc::UnboundedReceiver<Event>,
+    blocks: mpsc::Sender<std::result::Result<Vec<u8>, SendError>>,
+) {
+    let mut fetched = BTreeMap::new();
+    let mut next_index = 0;
+    let mut total = None;
+
+    'events: while total != Some(next_index) {
+        let Some(event) = events.recv().await else {
+            break;
+        };
+
+        match event {
+            Event::Fetched(index, data, permit) => {
+                fetched.insert(index, (data, permit));
+            },
+            Event::Enumerated(count) => total = Some(count),
+            Event::Failed(err) => {
+                blocks.send(Err(err)).await.ok();
+                break;
+            },
+        }
+
+        while let Some((data, permit)) = fetched.remove(&next_index) {
+            for block in data {
+                if blocks.send(Ok(block)).await.is_err() {
+                    break 'events;
+                }
+            }
+
+            next_index += 1;
+            // The enumerating peer may be waiting for the permit.
+            drop(permit);
+            shared.changed.notify_waiters();
+        }
+    }
+
+    // Stop the other tasks in case the download was aborted.
+    shared.update(|queue| queue.closed = true);
+    pending_limit.close();
+}
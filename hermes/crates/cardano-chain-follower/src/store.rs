@@ -0,0 +1,603 @@
+//! On-disk block store.
+//!
+//! Blocks are appended in chain order to segment files (`NNNNNNNN.chunk`) of at most
+//! [`SEGMENT_SIZE`] bytes. Each segment has an index file (`NNNNNNNN.index`) with a
+//! fixed size record per block, holding its slot, hash and location in the segment.
+//! Segments are read through memory maps, so blocks are served from the page cache
+//! without being copied.
+//!
+//! Blocks appended but not synced may be lost if the node stops, the records they
+//! leave incomplete are discarded when the store is opened again.
+
+use std::{
+    fs::{self, File, OpenOptions},
+    io::Write,
+    ops::Range,
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex, RwLock},
+};
+
+use bytes::Bytes;
+use memmap2::Mmap;
+
+use crate::{
+    index::{PointIndex, HASH_SIZE},
+    MultiEraBlockData, Point, Result,
+};
+
+/// Maximum size of a segment file, unless a single block is larger.
+const SEGMENT_SIZE: u64 = 128 * 1024 * 1024;
+/// Size of an index record: slot, hash, offset and length of the block.
+const RECORD_SIZE: usize = 8 + HASH_SIZE + 8 + 4;
+
+/// Location of a stored block.
+struct Location {
+    /// Position of the segment within the store.
+    segment: usize,
+    /// Offset of the block within the segment.
+    offset: u64,
+    /// Length of the block data.
+    len: u32,
+}
+
+/// A segment file along with its index.
+struct Segment {
+    /// Sequence number of the segment, used in its file names.
+    number: u32,
+    /// Segment file, opened for appending.
+    data_file: File,
+    /// Index file, opened for appending.
+    index_file: File,
+    /// Length of the segment data.
+    len: u64,
+    /// Memory map of the segment data, empty until a block is read from it.
+    ///
+    /// The segment is remapped when a block appended after it was mapped is read.
+    /// Blocks read from a previous map keep it alive until they are dropped.
+    mapped: Mutex<Bytes>,
+}
+
+impl Segment {
+    /// Opens or creates the segment `number` in `dir`, adding its blocks to `index`.
+    ///
+    /// Records left incomplete by an interrupted append, along with any data not
+    /// referenced by a complete record, are discarded.
+    fn open(
+        dir: &Path, number: u32, segment: usize, index: &mut PointIndex<Location>,
+    ) -> Result<Self> {
+        let (data_path, index_path) = segment_paths(dir, number);
+        let data_file = open_append(&data_path)?;
+        let index_file = open_append(&index_path)?;
+
+        let data_len = data_file.metadata()?.len();
+        let records = fs::read(&index_path)?;
+        let mut len = 0;
+        let mut valid_records = 0;
+
+        for record in records.chunks_exact(RECORD_SIZE) {
+            let (slot, rest) = record.split_at(8);
+            let (hash, rest) = rest.split_at(HASH_SIZE);
+            let (offset, block_len) = rest.split_at(8);
+
+            let location = Location {
+                segment,
+                offset: u64::from_le_bytes(offset.try_into()?),
+                len: u32::from_le_bytes(block_len.try_into()?),
+            };
+
+            let end = location.offset + u64::from(location.len);
+            if location.offset != len || end > data_len {
+                break;
+            }
+            let slot = u64::from_le_bytes(slot.try_into()?);
+            if index.push_raw(slot, hash.try_into()?, location).is_err() {
+                break;
+            }
+
+            len = end;
+            valid_records += 1;
+        }
+
+        index_file.set_len(u64::try_from(valid_records * RECORD_SIZE)?)?;
+        data_file.set_len(len)?;
+
+        Ok(Self {
+            number,
+            data_file,
+            index_file,
+            len,
+            mapped: Mutex::new(Bytes::new()),
+        })
+    }
+
+    /// Appends a block to the segment, returning its offset.
+    ///
+    /// If the block can't be fully written, the segment is left as it was.
+    fn append(&mut self, slot: u64, hash: &[u8; HASH_SIZE], data: &[u8]) -> Result<u64> {
+        let offset = self.len;
+        let len = u32::try_from(data.len())?;
+
+        let mut record = [0; RECORD_SIZE];
+        let (record_slot, rest) = record.split_at_mut(8);
+        let (record_hash, rest) = rest.split_at_mut(HASH_SIZE);
+        let (record_offset, record_len) = rest.split_at_mut(8);
+        record_slot.copy_from_slice(&slot.to_le_bytes());
+        record_hash.copy_from_slice(hash);
+        record_offset.copy_from_slice(&offset.to_le_bytes());
+        record_len.copy_from_slice(&len.to_le_bytes());
+
+        let index_len = self.index_file.metadata()?.len();
+        let res = self
+            .data_file
+            .write_all(data)
+            .and_then(|()| self.index_file.write_all(&record));
+
+        if let Err(err) = res {
+            self.data_file.set_len(offset).ok();
+            self.index_file.set_len(index_len).ok();
+            return Err(err.into());
+        }
+
+        self.len += u64::from(len);
+
+        Ok(offset)
+    }
+
+    /// Returns the data of the block at `location`, mapping the segment if needed.
+    fn read(&self, location: &Location) -> Result<Bytes> {
+        let start = usize::try_from(location.offset)?;
+        let end = start + usize::try_from(location.len)?;
+
+        let mut mapped = self.mapped.lock().unwrap_or_else(|err| err.into_inner());
+        if mapped.len() < end {
+            // SAFETY: Segment data is never modified once written, and the store
+            // directory must not be modified by anything else while it is open.
+            let map = unsafe { Mmap::map(&self.data_file)? };
+            *mapped = Bytes::from_owner(map);
+        }
+
+        if mapped.len() < end {
+            return Err("stored block is out of the segment bounds".into());
+        }
+
+        Ok(mapped.slice(start..end))
+    }
+}
+
+/// Blocks held by the store.
+struct Inner {
+    /// Segments, in chain order.
+    segments: Vec<Segment>,
+    /// Location of every stored block.
+    index: PointIndex<Location>,
+}
+
+impl Inner {
+    /// Returns the data of the block at position `i` of the index.
+    fn read(&self, i: usize) -> Result<MultiEraBlockData> {
+        let location = self.index.get(i).ok_or("stored block not found")?;
+        let segment = self
+            .segments
+            .get(location.segment)
+            .ok_or("stored block segment not found")?;
+
+        Ok(segment.read(location)?.into())
+    }
+}
+
+/// Append-only on-disk store of immutable blocks.
+///
+/// The store is meant to hold blocks that can no longer be rolled back, it has no
+/// way of removing blocks once they are appended.
+pub struct BlockStore {
+    /// Directory holding the store files.
+    dir: PathBuf,
+    /// Stored blocks.
+    inner: RwLock<Inner>,
+}
+
+impl BlockStore {
+    /// Opens the block store in directory `path`, creating it if it doesn't exist.
+    ///
+    /// The directory must not be modified by anything else while the store is open.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the store files could not be read.
+    pub fn open(path: impl AsRef<Path>) -> Result<Self> {
+        let dir = path.as_ref().to_path_buf();
+        fs::create_dir_all(&dir)?;
+
+        let mut numbers = Vec::new();
+        for dir_entry in fs::read_dir(&dir)? {
+            let file_name = dir_entry?.file_name();
+            let number = file_name
+                .to_str()
+                .and_then(|name| name.strip_suffix(".chunk"))
+                .and_then(|number| number.parse::<u32>().ok());
+
+            if let Some(number) = number {
+                numbers.push(number);
+            }
+        }
+        numbers.sort_unstable();
+
+        let mut segments = Vec::with_capacity(numbers.len());
+        let mut index = PointIndex::default();
+        for number in numbers {
+            segments.push(Segment::open(&dir, number, segments.len(), &mut index)?);
+        }
+
+        Ok(Self {
+            dir,
+            inner: RwLock::new(Inner { segments, index }),
+        })
+    }
+
+    /// Returns the point of the last stored block, if any.
+    #[must_use]
+    pub fn tip(&self) -> Option<Point> {
+        self.read_inner().index.last_point()
+    }
+
+    /// Returns the number of stored blocks.
+    #[must_use]
+    pub fn len(&self) -> usize {
+        self.read_inner().index.len()
+    }
+
+    /// Whether no block is stored.
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Whether the block at `point` is stored.
+    #[must_use]
+    pub fn contains(&self, point: &Point) -> bool {
+        self.read_inner().index.find(point).is_some()
+    }
+
+    /// Appends the block at `point`, which must come after the store tip.
+    ///
+    /// Appended blocks are not guaranteed to be on disk until [`BlockStore::sync`] is
+    /// called.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block comes before the store tip or if it could not be
+    /// written.
+    pub fn append(&self, point: &Point, data: &[u8]) -> Result<()> {
+        let Point::Specific(slot, hash) = point else {
+            return Err("the origin can't be stored".into());
+        };
+        let slot = *slot;
+        let hash: [u8; HASH_SIZE] = hash[..]
+            .try_into()
+            .map_err(|_| "invalid block hash length")?;
+
+        let mut inner = self.inner.write().unwrap_or_else(|err| err.into_inner());
+
+        if let Some(Point::Specific(tip_slot, tip_hash)) = inner.index.last_point() {
+            if slot < tip_slot || (slot == tip_slot && hash[..] == tip_hash[..]) {
+                return Err("block does not come after the store tip".into());
+            }
+        }
+
+        let len = u64::try_from(data.len())?;
+        let full = inner.segments.last().map_or(true, |segment| {
+            segment.len > 0 && segment.len + len > SEGMENT_SIZE
+        });
+        if full {
+            // Only the last segment is synced by `sync`, so the tail of the outgoing one
+            // has to reach the disk before it stops being the last.
+            if let Some(segment) = inner.segments.last() {
+                segment.data_file.sync_data()?;
+                segment.index_file.sync_data()?;
+            }
+
+            let number = inner
+                .segments
+                .last()
+                .map_or(0, |segment| segment.number + 1);
+            let segment = Segment::open(
+                &self.dir,
+                number,
+                inner.segments.len(),
+                &mut PointIndex::default(),
+            )?;
+            inner.segments.push(segment);
+        }
+
+        let segment_index = inner.segments.len() - 1;
+        let segment = inner.segments.last_mut().ok_or("no segment to append to")?;
+        let offset = segment.append(slot, &hash, data)?;
+
+        inner.index.push_raw(slot, hash, Location {
+            segment: segment_index,
+            offset,
+            len: u32::try_from(data.len())?,
+        })
+    }
+
+    /// Flushes the appended blocks to disk.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the store files could not be synced.
+    pub fn sync(&self) -> Result<()> {
+        let inner = self.read_inner();
+
+        if let Some(segment) = inner.segments.last() {
+            segment.data_file.sync_data()?;
+            segment.index_file.sync_data()?;
+        }
+
+        Ok(())
+    }
+
+    /// Reads the block at `point`, if stored.
+    ///
+    /// # Errors
+    ///
+    /// Returns Err if the block could not be read from disk.
+    pub fn get(&self, point: &Point) -> Result<Option<MultiEraBlockData>> {
+        let inner = self.read_inner();
+
+        match inner.index.find(point) {
+            Some(i) => inner.read(i).map(Some),
+            None => Ok(None),
+        }
+    }
+
+    /// Returns the stored blocks from `from` up to `to` (inclusive), stopping early at
+    /// the store tip, along with the point of the last one. The blocks are read from
+    /// disk one at a time, as the returned iterator is advanced.
+    ///
+    /// Nothing is returned if the block at `from` is not stored.
+    #[must_use]
+    pub fn read_range(self: &Arc<Self>, from: &Point, to: &Point) -> (StoredBlocks, Option<Point>) {
+        let inner = self.read_inner();
+
+        let range = inner.index.find(from).map_or(0..0, |start| {
+            let end = match to {
+                Point::Specific(slot, _) => inner.index.floor(*slot).unwrap_or(start),
+                Point::Origin => start,
+            };
+            start..end.saturating_add(1).max(start)
+        });
+        let last = range
+            .clone()
+            .next_back()
+            .and_then(|end| inner.index.point(end));
+        drop(inner);
+
+        let blocks = StoredBlocks {
+            store: Arc::clone(self),
+            range,
+        };
+        (blocks, last)
+    }
+
+    /// Locks the stored blocks for reading.
+    fn read_inner(&self) -> std::sync::RwLockReadGuard<'_, Inner> {
+        self.inner.read().unwrap_or_else(|err| err.into_inner())
+    }
+}
+
+/// Blocks read from a [`BlockStore`], see [`BlockStore::read_range`].
+pub struct StoredBlocks {
+    /// Store the blocks are read from.
+    store: Arc<BlockStore>,
+    /// Positions of the blocks left to read.
+    range: Range<usize>,
+}
+
+impl Iterator for StoredBlocks {
+    type Item = Result<MultiEraBlockData>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let i = self.range.next()?;
+        Some(self.store.read_inner().read(i))
+    }
+
+    fn size_hint(&self) -> (usize, Option<usize>) {
+        self.range.size_hint()
+    }
+}
+
+/// Returns the paths of the data and index files of segment `number`.
+fn segment_paths(dir: &Path, number: u32) -> (PathBuf, PathBuf) {
+    (
+        dir.join(format!("{number:08}.chunk")),
+        dir.join(format!("{number:08}.index")),
+    )
+}
+
+/// Opens `path` for reading and appending, creating it if it doesn't exist.
+fn open_append(path: &Path) -> std::io::Result<File> {
+    OpenOptions::new()
+        .read(true)
+        .append(true)
+        .create(true)
+        .open(path)
+}
+
+#[cfg(test)]
+mod tests {
+    //! Tests of the block store.
+
+    use super::*;
+
+    /// Directory removed when dropped.
+    struct TempDir(PathBuf);
+
+    impl TempDir {
+        /// Returns a new directory for the test `name`.
+        fn new(name: &str) -> Self {
+            let path =
+                std::env::temp_dir().join(format!("hermes-blocks-{name}-{}", std::process::id()));
+            fs::remove_dir_all(&path).ok();
+            Self(path)
+        }
+    }
+
+    impl Drop for TempDir {
+        fn drop(&mut self) {
+            fs::remove_dir_all(&self.0).ok();
+        }
+    }
+
+    /// Returns the point of a block at `slot` with a hash made of `byte`.
+    fn point(slot: u64, byte: u8) -> Point {
+        Point::Specific(slot, vec![byte; HASH_SIZE])
+    }
+
+    /// Returns a store in `dir` holding blocks at slots 1, 2 and 3, each made of
+    /// 10 bytes of its slot.
+    fn store_of_three(dir: &TempDir) -> BlockStore {
+        let store = BlockStore::open(&dir.0).expect("store should open");
+        for slot in 1..=3 {
+            store
+                .append(
+                    &point(slot, 1),
+                    &[u8::try_from(slot).expect("slot fits"); 10],
+                )
+                .expect("block should be appended");
+        }
+        store.sync().expect("store should sync");
+        store
+    }
+
+    /// Returns the length of file `name` in `dir`.
+    fn file_len(dir: &TempDir, name: &str) -> u64 {
+        fs::metadata(dir.0.join(name))
+            .expect("file should exist")
+            .len()
+    }
+
+    /// Truncates file `name` in `dir` to `len` bytes.
+    fn truncate(dir: &TempDir, name: &str, len: u64) {
+        OpenOptions::new()
+            .write(true)
+            .open(dir.0.join(name))
+            .and_then(|file| file.set_len(len))
+            .expect("file should be truncated");
+    }
+
+    /// Appends `bytes` to file `name` in `dir`.
+    fn append_bytes(dir: &TempDir, name: &str, bytes: &[u8]) {
+        OpenOptions::new()
+            .append(true)
+            .open(dir.0.join(name))
+            .and_then(|mut file| file.write_all(bytes))
+            .expect("bytes should be appended");
+    }
+
+    /// Returns the data of the block at `point`.
+    fn block(store: &BlockStore, point: &Point) -> Option<Vec<u8>> {
+        store
+            .get(point)
+            .expect("block should be read")
+            .map(|data| data.raw().to_vec())
+    }
+
+    /// Stored blocks are found again once the store is reopened.
+    #[test]
+    fn reopen() {
+        let dir = TempDir::new("reopen");
+        drop(store_of_three(&dir));
+
+        let store = BlockStore::open(&dir.0).expect("store should reopen");
+        assert_eq!(store.len(), 3);
+        assert_eq!(store.tip(), Some(point(3, 1)));
+        assert_eq!(block(&store, &point(2, 1)), Some(vec![2; 10]));
+    }
+
+    /// A block cut short drops its record, and appends resume after the last whole
+    /// block.
+    #[test]
+    fn torn_block() {
+        let dir = TempDir::new("torn-block");
+        drop(store_of_three(&dir));
+        truncate(&dir, "00000000.chunk", 25);
+
+        let store = BlockStore::open(&dir.0).expect("store should reopen");
+        assert_eq!(store.len(), 2);
+        assert_eq!(store.tip(), Some(point(2, 1)));
+        assert_eq!(file_len(&dir, "00000000.chunk"), 20);
+        assert_eq!(
+            file_len(&dir, "00000000.index"),
+            u64::try_from(2 * RECORD_SIZE).expect("length fits")
+        );
+
+        store
+            .append(&point(4, 1), &[4; 10])
+            .expect("block should be appended");
+        assert_eq!(block(&store, &point(4, 1)), Some(vec![4; 10]));
+        assert_eq!(block(&store, &point(3, 1)), None);
+    }
+
+    /// A record cut short is dropped along with the data of its block.
+    #[test]
+    fn torn_record() {
+        let dir = TempDir::new("torn-record");
+        drop(store_of_three(&dir));
+        let index_len = u64::try_from(3 * RECORD_SIZE - 1).expect("length fits");
+        truncate(&dir, "00000000.index", index_len);
+
+        let store = BlockStore::open(&dir.0).expect("store should reopen");
+        assert_eq!(store.len(), 2);
+        assert_eq!(store.tip(), Some(point(2, 1)));
+        assert_eq!(file_len(&dir, "00000000.chunk"), 20);
+    }
+
+    /// Data without a record is discarded, so the next block is stored where it was.
+    #[test]
+    fn unreferenced_data() {
+        let dir = TempDir::new("unreferenced-data");
+        drop(store_of_three(&dir));
+        append_bytes(&dir, "00000000.chunk", &[0xFF; 7]);
+
+        let store = BlockStore::open(&dir.0).expect("store should reopen");
+        assert_eq!(store.len(), 3);
+        assert_eq!(file_len(&dir, "00000000.chunk"), 30);
+
+        store
+            .append(&point(4, 1), &[4; 10])
+            .expect("block should be appended");
+        store.sync().expect("store should sync");
+        drop(store);
+
+        let store = BlockStore::open(&dir.0).expect("store should reopen");
+        assert_eq!(store.len(), 4);
+        assert_eq!(block(&store, &point(4, 1)), Some(vec![4; 10]));
+    }
+
+    /// A range is read up to its end or the store tip, and is empty if it starts at a
+    /// point not stored or ends before it starts.
+    #[test]
+    fn read_range() {
+        let dir = TempDir::new("read-range");
+        let store = Arc::new(store_of_three(&dir));
+
+        let read = |from: &Point, to: &Point| {
+            let (blocks, last) = store.read_range(from, to);
+            let blocks = blocks
+                .map(|data| data.expect("block should be read").raw().to_vec())
+                .collect::<Vec<_>>();
+            (blocks, last)
+        };
+
+        assert_eq!(
+            read(&point(1, 1), &point(2, 1)),
+            (vec![vec![1; 10], vec![2; 10]], Some(point(2, 1)))
+        );
+        assert_eq!(
+            read(&point(2, 1), &point(9, 1)),
+            (vec![vec![2; 10], vec![3; 10]], Some(point(3, 1)))
+        );
+        assert_eq!(read(&point(3, 1), &point(1, 1)), (Vec::new(), None));
+        assert_eq!(read(&point(5, 1), &point(9, 1)), (Vec::new(), None));
+    }
+}
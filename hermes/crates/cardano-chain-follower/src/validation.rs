@@ -0,0 +1,157 @@
+//! Block validation.
+
+use std::{
+    fmt,
+    num::NonZeroUsize,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Mutex,
+    },
+};
+
+use pallas::{
+    crypto::key::ed25519::{PublicKey, Signature},
+    ledger::traverse::{MultiEraBlock, MultiEraTx},
+};
+
+use crate::{MultiEraBlockData, SendError};
+
+/// Error returned when a block fails validation.
+#[derive(Debug)]
+pub struct InvalidBlock {
+    /// Position of the block within the validated batch.
+    index: usize,
+    /// Reason the block is invalid.
+    reason: SendError,
+}
+
+impl InvalidBlock {
+    /// Returns the position of the invalid block within the validated batch.
+    #[must_use]
+    pub fn index(&self) -> usize {
+        self.index
+    }
+}
+
+impl fmt::Display for InvalidBlock {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "block {} is invalid: {}", self.index, self.reason)
+    }
+}
+
+impl std::error::Error for InvalidBlock {
+    fn source(&self) -> Option<&(dyn std::error::Error + 'static)> {
+        Some(self.reason.as_ref())
+    }
+}
+
+/// Validates a batch of blocks in parallel, using one thread per available CPU.
+///
+/// Blocks are decoded as part of their validation, so they don't need to be decoded
+/// again afterwards. Once a block fails validation no block after it is validated,
+/// and the error reported is always the one of the first invalid block in the
+/// batch.
+///
+/// This blocks the calling thread until the whole batch is validated, so async
+/// callers should run it with `tokio::task::spawn_blocking` or similar.
+///
+/// # Errors
+///
+/// Returns Err if any of the blocks is invalid.
+pub fn validate_blocks(blocks: &[MultiEraBlockData]) -> Result<(), InvalidBlock> {
+    let threads = std::thread::available_parallelism()
+        .map_or(1, NonZeroUsize::get)
+        .min(blocks.len());
+    // Blocks are handed out in order, so threads pick up the next block as soon as
+    // they are done with the previous one.
+    let next_index = AtomicUsize::new(0);
+    let first_failure = Mutex::new(None::<InvalidBlock>);
+    let first_failure_index = AtomicUsize::new(usize::MAX);
+
+    std::thread::scope(|s| {
+        for _ in 0..threads {
+            s.spawn(|| {
+                loop {
+                    let index = next_index.fetch_add(1, Ordering::Relaxed);
+                    // Blocks after an invalid one don't need to be validated, but the
+                    // ones before it do, as they could fail too.
+                    if index > first_failure_index.load(Ordering::Relaxed) {
+                        break;
+                    }
+                    let Some(block) = blocks.get(index) else {
+                        break;
+                    };
+
+                    let Err(reason) = validate_block_data(block) else {
+                        continue;
+                    };
+
+                    let mut first_failure =
+                        first_failure.lock().unwrap_or_else(|err| err.into_inner());
+                    if first_failure
+                        .as_ref()
+                        .map_or(true, |failure| index < failure.index)
+                    {
+                        *first_failure = Some(InvalidBlock { index, reason });
+                        first_failure_index.fetch_min(index, Ordering::Relaxed);
+                    }
+                    // Later blocks taken by this thread would come after this one.
+                    break;
+                }
+            });
+        }
+    });
+
+    match first_failure
+        .into_inner()
+        .unwrap_or_else(|err| err.into_inner())
+    {
+        Some(failure) => Err(failure),
+        None => Ok(()),
+    }
+}
+
+/// Decodes and validates a single block.
+fn validate_block_data(data: &MultiEraBlockData) -> Result<(), SendError> {
+    let block = data.decode().map_err(|err| err.to_string())?;
+    validate_multiera_block(block)
+}
+
+/// Validate a multi-era block.
+///
+/// This does not execute Plutus scripts nor validates ledger state.
+/// It only checks that the block is correctly formatted for its era and that its
+/// transactions are signed by the keys in their witness sets.
+pub(crate) fn validate_multiera_block(block: &MultiEraBlock) -> Result<(), SendError> {
+    for (index, tx) in block.txs().iter().enumerate() {
+        validate_tx(tx).map_err(|err| format!("transaction {index}: {err}"))?;
+    }
+
+    Ok(())
+}
+
+/// Checks that the transaction is well-formed and that its verification key
+/// witnesses are valid signatures of its body.
+///
+/// Byron witnesses use a different signature scheme and are not checked.
+fn validate_tx(tx: &MultiEraTx) -> Result<(), SendError> {
+    if tx.inputs().is_empty() {
+        return Err("transaction has no inputs".into());
+    }
+
+    let tx_hash = tx.hash();
+    for witness in tx.vkey_witnesses() {
+        let vkey: [u8; PublicKey::SIZE] = witness.vkey[..]
+            .try_into()
+            .map_err(|_| "invalid verification key length")?;
+        let signature: [u8; Signature::SIZE] = witness.signature[..]
+            .try_into()
+            .map_err(|_| "invalid signature length")?;
+
+        if !PublicKey::from(vkey).verify(tx_hash, &Signature::from(signature)) {
+            return Err("invalid verification key witness signature".into());
+        }
+    }
+
+    Ok(())
+}
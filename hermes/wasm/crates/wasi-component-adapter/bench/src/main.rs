@@ -0,0 +1,445 @@
+use anyhow::{bail, Context, Result};
+use cap_std::{ambient_authority, fs::Dir};
+use std::{
+    env,
+    fmt::Write as _,
+    fs,
+    path::Path,
+    time::{Duration, Instant},
+};
+use wasmtime::component::{Component, Linker};
+use wasmtime::{Config, Engine, Store};
+use wasmtime_wasi::preview2::command::sync::{add_to_linker, Command};
+use wasmtime_wasi::preview2::pipe::{MemoryInputPipe, SinkOutputStream};
+use wasmtime_wasi::preview2::{DirPerms, FilePerms, Table, WasiCtx, WasiCtxBuilder, WasiView};
+
+/// Number of timed runs of each benchmark, after a warm-up run.
+const SAMPLES: usize = 10;
+
+/// Size of the file read by `fd_pread`.
+const FILE_SIZE: usize = 64 * 1024;
+
+/// Number of entries of the directory listed by `fd_readdir`.
+const DIR_ENTRIES: usize = 1000;
+
+/// Guest module, calling `{body}` `{iterations}` times from `_start`.
+///
+/// The first page of memory holds the arguments and results of the calls: an
+/// iovec of the data buffer at 0, results at 16, a subscription at 32, an event
+/// at 128 and paths at 256. The data buffer takes the second page.
+const GUEST: &str = r#"
+(module
+  (import "wasi_snapshot_preview1" "fd_write"
+    (func $fd_write (param i32 i32 i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "fd_read"
+    (func $fd_read (param i32 i32 i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "fd_pread"
+    (func $fd_pread (param i32 i32 i32 i64 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "fd_readdir"
+    (func $fd_readdir (param i32 i32 i32 i64 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "fd_fdstat_get"
+    (func $fd_fdstat_get (param i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "poll_oneoff"
+    (func $poll_oneoff (param i32 i32 i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "random_get"
+    (func $random_get (param i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "path_open"
+    (func $path_open (param i32 i32 i32 i32 i32 i64 i64 i32 i32) (result i32)))
+
+  (memory (export "memory") 2)
+  (data (i32.const 256) "bench.dat")
+  (data (i32.const 272) "dir")
+
+  (global $heap (mut i32) (i32.const 131072))
+
+  ;; Bump allocator for the adapter, growing the memory as needed.
+  (func (export "cabi_realloc")
+    (param $old i32) (param $old_len i32) (param $align i32) (param $len i32)
+    (result i32)
+    (local $ptr i32) (local $end i32) (local $size i32)
+    (local.set $ptr
+      (i32.and
+        (i32.add (global.get $heap) (i32.sub (local.get $align) (i32.const 1)))
+        (i32.sub (i32.const 0) (local.get $align))))
+    (local.set $end (i32.add (local.get $ptr) (local.get $len)))
+    (local.set $size (i32.mul (memory.size) (i32.const 65536)))
+    (if (i32.gt_u (local.get $end) (local.get $size))
+      (then
+        (if (i32.eq
+              (memory.grow
+                (i32.shr_u
+                  (i32.add (i32.sub (local.get $end) (local.get $size)) (i32.const 65535))
+                  (i32.const 16)))
+              (i32.const -1))
+          (then unreachable))))
+    (memory.copy (local.get $ptr) (local.get $old) (local.get $old_len))
+    (global.set $heap (local.get $end))
+    (local.get $ptr))
+
+  (func $check (param $errno i32)
+    (if (local.get $errno) (then unreachable)))
+
+  (func (export "_start")
+    (local $i i32) (local $fd i32) (local $cookie i64) (local $used i32)
+    (local $offset i32) (local $entry_len i32)
+    (i32.store (i32.const 0) (i32.const 65536))
+    (i32.store (i32.const 4) (i32.const {len}))
+    {setup}
+    (block $done
+      (br_if $done (i32.eqz (i32.const {iterations})))
+      (loop $loop
+        {body}
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br_if $loop (i32.lt_u (local.get $i) (i32.const {iterations}))))))
+)
+"#;
+
+/// Opens `bench.dat` in the preopened directory into `$fd`.
+const OPEN_FILE: &str = "
+    (call $check (call $path_open (i32.const 3) (i32.const 0) (i32.const 256) (i32.const 9)
+      (i32.const 0) (i64.const -1) (i64.const -1) (i32.const 0) (i32.const 16)))
+    (local.set $fd (i32.load (i32.const 16)))";
+
+/// Opens `dir` in the preopened directory into `$fd`.
+const OPEN_DIR: &str = "
+    (call $check (call $path_open (i32.const 3) (i32.const 0) (i32.const 272) (i32.const 3)
+      (i32.const 2) (i64.const -1) (i64.const -1) (i32.const 0) (i32.const 16)))
+    (local.set $fd (i32.load (i32.const 16)))";
+
+/// Subscribes to stdout being writable.
+const SUBSCRIBE_STDOUT: &str = "
+    (i64.store (i32.const 32) (i64.const 0))
+    (i32.store8 (i32.const 40) (i32.const 2))
+    (i32.store (i32.const 48) (i32.const 1))";
+
+/// Lists the whole directory `$fd`, resuming each call after the last entry that
+/// fit in the buffer.
+const LIST_DIR: &str = "
+    (local.set $cookie (i64.const 0))
+    (loop $next
+      (call $check (call $fd_readdir (local.get $fd) (i32.const 65536) (i32.const {len})
+        (local.get $cookie) (i32.const 16)))
+      (local.set $used (i32.load (i32.const 16)))
+      (local.set $offset (i32.const 0))
+      (block $parsed
+        (loop $entry
+          (br_if $parsed
+            (i32.gt_u (i32.add (local.get $offset) (i32.const 24)) (local.get $used)))
+          (local.set $entry_len
+            (i32.add (i32.const 24) (i32.load (i32.add (local.get $offset) (i32.const 65552)))))
+          (br_if $parsed
+            (i32.gt_u (i32.add (local.get $offset) (local.get $entry_len)) (local.get $used)))
+          (local.set $cookie (i64.load (i32.add (local.get $offset) (i32.const 65536))))
+          (local.set $offset (i32.add (local.get $offset) (local.get $entry_len)))
+          (br $entry)))
+      (br_if $next (i32.eq (local.get $used) (i32.const {len}))))";
+
+/// A benchmark of a preview1 function.
+struct Bench {
+    /// Name of the benchmark.
+    name: String,
+    /// Guest code run once before the loop.
+    setup: &'static str,
+    /// Guest code of one iteration.
+    body: &'static str,
+    /// Size of the data buffer.
+    len: usize,
+    /// Number of iterations of each run.
+    iterations: usize,
+    /// Bytes transferred by each iteration, if it's worth reporting a throughput.
+    bytes: Option<usize>,
+    /// Bytes stdin provides to each run.
+    stdin: usize,
+}
+
+impl Bench {
+    fn new(name: &str, body: &'static str, len: usize, iterations: usize) -> Self {
+        Bench {
+            name: name.to_string(),
+            setup: "",
+            body,
+            len,
+            iterations,
+            bytes: None,
+            stdin: 0,
+        }
+    }
+
+    fn with_setup(mut self, setup: &'static str) -> Self {
+        self.setup = setup;
+        self
+    }
+
+    fn with_throughput(mut self) -> Self {
+        self.name = format!("{}/{}", self.name, self.len);
+        self.bytes = Some(self.len);
+        self
+    }
+
+    fn wat(&self) -> String {
+        GUEST
+            .replace("{setup}", self.setup)
+            .replace("{body}", self.body)
+            .replace("{len}", &self.len.to_string())
+            .replace("{iterations}", &self.iterations.to_string())
+    }
+}
+
+struct Host {
+    table: Table,
+    ctx: WasiCtx,
+}
+
+impl WasiView for Host {
+    fn table(&self) -> &Table {
+        &self.table
+    }
+    fn table_mut(&mut self) -> &mut Table {
+        &mut self.table
+    }
+    fn ctx(&self) -> &WasiCtx {
+        &self.ctx
+    }
+    fn ctx_mut(&mut self) -> &mut WasiCtx {
+        &mut self.ctx
+    }
+}
+
+struct Runner {
+    engine: Engine,
+    linker: Linker<Host>,
+    adapter: Vec<u8>,
+    dir: std::path::PathBuf,
+}
+
+impl Runner {
+    fn new(adapter: Vec<u8>, dir: std::path::PathBuf) -> Result<Self> {
+        let mut config = Config::new();
+        config.wasm_component_model(true);
+        let engine = Engine::new(&config)?;
+        let mut linker = Linker::new(&engine);
+        add_to_linker(&mut linker)?;
+        Ok(Runner {
+            engine,
+            linker,
+            adapter,
+            dir,
+        })
+    }
+
+    /// Returns the median time of a run of `bench`.
+    fn median(&self, bench: &Bench) -> Result<Duration> {
+        let module = wat::parse_str(bench.wat())?;
+        let component = wit_component::ComponentEncoder::default()
+            .module(&module)?
+            .adapter("wasi_snapshot_preview1", &self.adapter)?
+            .validate(true)
+            .encode()?;
+        let component = Component::new(&self.engine, &component)?;
+
+        let mut samples = (0..=SAMPLES)
+            .map(|_| self.run(&component, bench))
+            .collect::<Result<Vec<_>>>()?;
+        // Drop the warm-up run.
+        samples.remove(0);
+        samples.sort();
+        Ok(samples[SAMPLES / 2])
+    }
+
+    /// Runs `component` in a new instance, timing its `run` function only.
+    fn run(&self, component: &Component, bench: &Bench) -> Result<Duration> {
+        let dir = Dir::open_ambient_dir(&self.dir, ambient_authority())?;
+        let ctx = WasiCtxBuilder::new()
+            .stdin(MemoryInputPipe::new(vec![0; bench.stdin]))
+            .stdout(SinkOutputStream)
+            .preopened_dir(dir, DirPerms::all(), FilePerms::all(), "/")
+            .build();
+        let mut store = Store::new(
+            &self.engine,
+            Host {
+                table: Table::new(),
+                ctx,
+            },
+        );
+        let (command, _) = Command::instantiate(&mut store, component, &self.linker)?;
+
+        let start = Instant::now();
+        let result = command.wasi_cli_run().call_run(&mut store)?;
+        let elapsed = start.elapsed();
+
+        if result.is_err() {
+            bail!("`{}` failed", bench.name);
+        }
+        Ok(elapsed)
+    }
+}
+
+/// Creates the directory preopened by the guests.
+fn create_dir(dir: &Path) -> Result<()> {
+    let _ = fs::remove_dir_all(dir);
+    fs::create_dir_all(dir.join("dir"))?;
+    fs::write(dir.join("bench.dat"), vec![0x5a; FILE_SIZE])?;
+    for i in 0..DIR_ENTRIES {
+        fs::write(dir.join("dir").join(format!("{i:08}.chunk")), b"")?;
+    }
+    Ok(())
+}
+
+/// An adapter build to benchmark.
+struct Build {
+    /// Name of the build in the report.
+    label: String,
+    /// Median time of a run of each benchmark.
+    times: Vec<Duration>,
+    /// Time of the first call of an instance.
+    cold: Duration,
+}
+
+/// Runs every benchmark of `benches` against the adapter of the argument `arg`, given
+/// as `LABEL=PATH` or as a path, named after its file.
+fn run_build(arg: &str, benches: &[Bench], dir: &Path) -> Result<Build> {
+    let (label, path) = match arg.split_once('=') {
+        Some((label, path)) => (label.to_string(), path),
+        None => (
+            Path::new(arg).file_stem().map_or_else(
+                || arg.to_string(),
+                |stem| stem.to_string_lossy().into_owned(),
+            ),
+            arg,
+        ),
+    };
+    let adapter = fs::read(path).with_context(|| format!("failed to read `{path}`"))?;
+    let runner = Runner::new(adapter, dir.to_path_buf())?;
+
+    let times = benches
+        .iter()
+        .map(|bench| runner.median(bench))
+        .collect::<Result<Vec<_>>>()?;
+
+    // The cold start is the first call of an instance over an empty run.
+    let fdstat = "(call $check (call $fd_fdstat_get (i32.const 1) (i32.const 16)))";
+    let empty = runner.median(&Bench::new("empty", "", 0, 0))?;
+    let cold = runner.median(&Bench::new("State::new", fdstat, 0, 1))?;
+
+    Ok(Build {
+        label,
+        times,
+        cold: cold.saturating_sub(empty),
+    })
+}
+
+/// Writes the header of a table of the report, titled `title`, with a column per build.
+fn write_header(report: &mut String, title: &str, builds: &[Build]) -> Result<()> {
+    write!(report, "{title:<32}")?;
+    for build in builds {
+        write!(report, " {:>28}", build.label)?;
+    }
+    writeln!(report)?;
+    Ok(())
+}
+
+/// Writes a row of the report: `name`, then the value of each build, along with how
+/// it compares to the first build.
+fn write_row(report: &mut String, name: &str, values: &[f64], unit: &str) -> Result<()> {
+    write!(report, "{name:<32}")?;
+    for (i, value) in values.iter().enumerate() {
+        let mut cell = format!("{value:.1} {unit}");
+        if i > 0 && values[0] > 0.0 {
+            write!(cell, " ({:+.0}%)", (value / values[0] - 1.0) * 100.0)?;
+        }
+        write!(report, " {cell:>28}")?;
+    }
+    writeln!(report)?;
+    Ok(())
+}
+
+fn main() -> Result<()> {
+    let args = env::args().skip(1).collect::<Vec<_>>();
+    if args.is_empty() {
+        bail!("must pass the command adapter wasm files as arguments, as `LABEL=PATH`");
+    }
+
+    let dir = env::temp_dir().join("bench-component-adapter");
+    create_dir(&dir)?;
+
+    let write = "(call $check (call $fd_write (i32.const 1) (i32.const 0) (i32.const 1)
+      (i32.const 16)))";
+    let read = "(call $check (call $fd_read (i32.const 0) (i32.const 0) (i32.const 1)
+      (i32.const 16)))";
+    let pread = "(call $check (call $fd_pread (local.get $fd) (i32.const 0) (i32.const 1)
+      (i64.const 0) (i32.const 16)))";
+    let poll = "(call $check (call $poll_oneoff (i32.const 32) (i32.const 128) (i32.const 1)
+      (i32.const 192)))";
+    let random = "(call $check (call $random_get (i32.const 65536) (i32.const {len})))";
+
+    let mut benches = Vec::new();
+    for (len, iterations) in [(64, 10_000), (4096, 10_000), (65536, 1000)] {
+        benches.push(Bench::new("fd_write", write, len, iterations).with_throughput());
+    }
+    for (len, iterations) in [(64, 10_000), (4096, 10_000), (65536, 1000)] {
+        let mut bench = Bench::new("fd_read", read, len, iterations).with_throughput();
+        bench.stdin = len * iterations;
+        benches.push(bench);
+    }
+    for (len, iterations) in [(64, 10_000), (4096, 10_000), (FILE_SIZE, 1000)] {
+        benches.push(
+            Bench::new("fd_pread", pread, len, iterations)
+                .with_setup(OPEN_FILE)
+                .with_throughput(),
+        );
+    }
+    benches.push(Bench::new("poll_oneoff", poll, 0, 10_000).with_setup(SUBSCRIBE_STDOUT));
+    benches.push(
+        Bench::new(
+            &format!("fd_readdir/{DIR_ENTRIES} entries"),
+            LIST_DIR,
+            4096,
+            20,
+        )
+        .with_setup(OPEN_DIR),
+    );
+    for (len, iterations) in [(16, 10_000), (4096, 1000)] {
+        benches.push(Bench::new("random_get", random, len, iterations).with_throughput());
+    }
+
+    let builds = args
+        .iter()
+        .map(|arg| run_build(arg, &benches, &dir))
+        .collect::<Result<Vec<_>>>()?;
+
+    // Builds are reported side by side, each compared to the first one.
+    let mut report = String::new();
+    write_header(&mut report, "ns/call", &builds)?;
+    for (i, bench) in benches.iter().enumerate() {
+        let ns = builds
+            .iter()
+            .map(|build| build.times[i].as_secs_f64() * 1e9 / bench.iterations as f64)
+            .collect::<Vec<_>>();
+        write_row(&mut report, &bench.name, &ns, "ns")?;
+    }
+    let cold = builds
+        .iter()
+        .map(|build| build.cold.as_secs_f64() * 1e9)
+        .collect::<Vec<_>>();
+    write_row(&mut report, "cold State::new", &cold, "ns")?;
+
+    writeln!(report)?;
+    write_header(&mut report, "MiB/s", &builds)?;
+    for (i, bench) in benches.iter().enumerate() {
+        let Some(bytes) = bench.bytes else {
+            continue;
+        };
+        let rates = builds
+            .iter()
+            .map(|build| {
+                (bytes * bench.iterations) as f64 / build.times[i].as_secs_f64() / (1024.0 * 1024.0)
+            })
+            .collect::<Vec<_>>();
+        write_row(&mut report, &bench.name, &rates, "MiB/s")?;
+    }
+
+    print!("{report}");
+
+    fs::remove_dir_all(dir)?;
+    Ok(())
+}
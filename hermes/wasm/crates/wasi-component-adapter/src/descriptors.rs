@@ -1,8 +1,10 @@
 use crate::bindings::wasi::cli::{stderr, stdin, stdout};
+use crate::bindings::wasi::io::poll::Pollable;
 use crate::bindings::wasi::io::streams::{InputStream, OutputStream};
-use crate::{BlockingMode, BumpArena, ImportAlloc, TrappingUnwrap, WasmStr};
+use crate::{cabi_realloc, BlockingMode, BumpArena, ImportAlloc, TrappingUnwrap, WasmStr};
 use core::cell::{Cell, OnceCell, UnsafeCell};
-use core::mem::MaybeUninit;
+use core::mem::{align_of, size_of, MaybeUninit};
+use core::ptr::{self, addr_of_mut};
 use wasi::{Errno, Fd};
 
 #[cfg(not(feature = "proxy"))]
@@ -10,8 +12,14 @@ use crate::bindings::wasi::filesystem::types as filesystem;
 #[cfg(not(feature = "proxy"))]
 use crate::File;
 
+/// Number of descriptors stored inline in `State`. Further descriptors are stored
+/// in memory allocated by the main module.
 pub const MAX_DESCRIPTORS: usize = 128;
 
+/// Largest number of descriptors in the table, which bounds the memory taken by
+/// renumbering a descriptor to a large fd.
+pub const MAX_TABLE_LEN: usize = 1 << 16;
+
 #[repr(C)]
 pub enum Descriptor {
     /// A closed descriptor, holding a reference to the previous closed
@@ -28,6 +36,14 @@ pub enum Descriptor {
 /// identifies what kind of stream they are and possibly supporting
 /// type-specific operations like seeking.
 pub struct Streams {
+    /// Pollable of the input stream, created by the first `poll_oneoff` on it and
+    /// kept for the following ones. Declared before the streams so it is dropped
+    /// before them, as it is a child of the input stream.
+    pub read_pollable: OnceCell<Pollable>,
+
+    /// Pollable of the output stream, see `read_pollable`.
+    pub write_pollable: OnceCell<Pollable>,
+
     /// The input stream, if present.
     pub input: OnceCell<InputStream>,
 
@@ -67,6 +83,42 @@ impl Streams {
         }
     }
 
+    /// Return the pollable of the input stream, subscribing to it on the first call.
+    pub fn get_read_pollable(&self) -> Result<&Pollable, Errno> {
+        match self.read_pollable.get() {
+            Some(pollable) => Ok(pollable),
+            None => {
+                let pollable = self.get_read_stream()?.subscribe();
+                self.read_pollable.set(pollable).trapping_unwrap();
+                Ok(self.read_pollable.get().trapping_unwrap())
+            }
+        }
+    }
+
+    /// Return the pollable of the output stream, subscribing to it on the first call.
+    pub fn get_write_pollable(&self) -> Result<&Pollable, Errno> {
+        match self.write_pollable.get() {
+            Some(pollable) => Ok(pollable),
+            None => {
+                let pollable = self.get_write_stream()?.subscribe();
+                self.write_pollable.set(pollable).trapping_unwrap();
+                Ok(self.write_pollable.get().trapping_unwrap())
+            }
+        }
+    }
+
+    /// Drop the input stream, along with its pollable.
+    pub fn drop_input(&mut self) {
+        drop(self.read_pollable.take());
+        drop(self.input.take());
+    }
+
+    /// Drop the output stream, along with its pollable.
+    pub fn drop_output(&mut self) {
+        drop(self.write_pollable.take());
+        drop(self.output.take());
+    }
+
     /// Return the output stream, initializing it on the fly if needed.
     pub fn get_write_stream(&self) -> Result<&OutputStream, Errno> {
         match self.output.get() {
@@ -141,7 +193,13 @@ pub struct Descriptors {
     /// Storage of mapping from preview1 file descriptors to preview2 file
     /// descriptors.
     table: UnsafeCell<MaybeUninit<[Descriptor; MAX_DESCRIPTORS]>>,
-    table_len: Cell<u16>,
+    table_len: Cell<u32>,
+
+    /// Storage of the descriptors past the first `MAX_DESCRIPTORS`, allocated with the
+    /// main module's `cabi_realloc` once the inline table is full. It is never freed,
+    /// just like the `State` holding it.
+    overflow: Cell<*mut Descriptor>,
+    overflow_capacity: Cell<usize>,
 
     /// Points to the head of a free-list of closed file descriptors.
     closed: Option<Fd>,
@@ -157,6 +215,8 @@ impl Descriptors {
         let d = Descriptors {
             table: UnsafeCell::new(MaybeUninit::uninit()),
             table_len: Cell::new(0),
+            overflow: Cell::new(ptr::null_mut()),
+            overflow_capacity: Cell::new(0),
             closed: None,
             #[cfg(not(feature = "proxy"))]
             preopens: Cell::new(None),
@@ -169,18 +229,25 @@ impl Descriptors {
         }
 
         d.push(Descriptor::Streams(Streams {
+            read_pollable: OnceCell::new(),
+
+            write_pollable: OnceCell::new(),
             input: new_once(stdin::get_stdin()),
             output: OnceCell::new(),
             type_: StreamType::Stdio(Stdio::Stdin),
         }))
         .trapping_unwrap();
         d.push(Descriptor::Streams(Streams {
+            read_pollable: OnceCell::new(),
+            write_pollable: OnceCell::new(),
             input: OnceCell::new(),
             output: new_once(stdout::get_stdout()),
             type_: StreamType::Stdio(Stdio::Stdout),
         }))
         .trapping_unwrap();
         d.push(Descriptor::Streams(Streams {
+            read_pollable: OnceCell::new(),
+            write_pollable: OnceCell::new(),
             input: OnceCell::new(),
             output: new_once(stderr::get_stderr()),
             type_: StreamType::Stdio(Stdio::Stderr),
@@ -220,6 +287,8 @@ impl Descriptors {
             // stdio (0,1,2) and no others, so that preopens are 3..
             let descriptor_type = descriptor.get_type().trapping_unwrap();
             self.push(Descriptor::Streams(Streams {
+                read_pollable: OnceCell::new(),
+                write_pollable: OnceCell::new(),
                 input: OnceCell::new(),
                 output: OnceCell::new(),
                 type_: StreamType::File(File {
@@ -236,34 +305,74 @@ impl Descriptors {
         self.preopens.set(Some(preopens));
     }
 
+    // Callers must not hold references to descriptors, as growing the overflow
+    // storage may move it.
     fn push(&self, desc: Descriptor) -> Result<Fd, Errno> {
+        let len = usize::try_from(self.table_len.get()).trapping_unwrap();
+        if len >= MAX_TABLE_LEN {
+            return Err(wasi::ERRNO_NOMEM);
+        }
         unsafe {
-            let table = (*self.table.get()).as_mut_ptr();
-            let len = usize::try_from(self.table_len.get()).trapping_unwrap();
-            if len >= (*table).len() {
-                return Err(wasi::ERRNO_NOMEM);
-            }
-            core::ptr::addr_of_mut!((*table)[len]).write(desc);
-            self.table_len.set(u16::try_from(len + 1).trapping_unwrap());
-            Ok(Fd::from(u32::try_from(len).trapping_unwrap()))
+            let slot = if len < MAX_DESCRIPTORS {
+                let table = (*self.table.get()).as_mut_ptr();
+                addr_of_mut!((*table)[len])
+            } else {
+                let index = len - MAX_DESCRIPTORS;
+                if index >= self.overflow_capacity.get() {
+                    self.grow_overflow()?;
+                }
+                self.overflow.get().add(index)
+            };
+            slot.write(desc);
         }
+        self.table_len.set(u32::try_from(len + 1).trapping_unwrap());
+        Ok(Fd::try_from(len).trapping_unwrap())
     }
 
-    fn table(&self) -> &[Descriptor] {
-        unsafe {
-            std::slice::from_raw_parts(
-                (*self.table.get()).as_ptr().cast(),
-                usize::try_from(self.table_len.get()).trapping_unwrap(),
+    // Double the overflow storage, starting with as many descriptors as the inline
+    // table holds.
+    #[cold]
+    fn grow_overflow(&self) -> Result<(), Errno> {
+        let old_capacity = self.overflow_capacity.get();
+        let new_capacity = (old_capacity * 2)
+            .max(MAX_DESCRIPTORS)
+            .min(MAX_TABLE_LEN - MAX_DESCRIPTORS);
+        let new_len = new_capacity
+            .checked_mul(size_of::<Descriptor>())
+            .ok_or(wasi::ERRNO_NOMEM)?;
+
+        // Descriptors hold no pointers to themselves, so moving them along with the
+        // allocation is fine.
+        let overflow = unsafe {
+            cabi_realloc(
+                self.overflow.get().cast(),
+                old_capacity * size_of::<Descriptor>(),
+                align_of::<Descriptor>(),
+                new_len,
             )
+        };
+        if overflow.is_null() {
+            return Err(wasi::ERRNO_NOMEM);
         }
+
+        self.overflow.set(overflow.cast());
+        self.overflow_capacity.set(new_capacity);
+        Ok(())
     }
 
-    fn table_mut(&mut self) -> &mut [Descriptor] {
+    // Return a pointer to the descriptor `fd`, if it's in the table.
+    fn slot(&self, fd: Fd) -> Option<*mut Descriptor> {
+        let index = usize::try_from(fd).trapping_unwrap();
+        if index >= usize::try_from(self.table_len.get()).trapping_unwrap() {
+            return None;
+        }
         unsafe {
-            std::slice::from_raw_parts_mut(
-                (*self.table.get()).as_mut_ptr().cast(),
-                usize::try_from(self.table_len.get()).trapping_unwrap(),
-            )
+            if index < MAX_DESCRIPTORS {
+                let table = (*self.table.get()).as_mut_ptr();
+                Some(addr_of_mut!((*table)[index]))
+            } else {
+                Some(self.overflow.get().add(index - MAX_DESCRIPTORS))
+            }
         }
     }
 
@@ -288,15 +397,13 @@ impl Descriptors {
     }
 
     pub fn get(&self, fd: Fd) -> Result<&Descriptor, Errno> {
-        self.table()
-            .get(usize::try_from(fd).trapping_unwrap())
-            .ok_or(wasi::ERRNO_BADF)
+        let slot = self.slot(fd).ok_or(wasi::ERRNO_BADF)?;
+        Ok(unsafe { &*slot })
     }
 
     pub fn get_mut(&mut self, fd: Fd) -> Result<&mut Descriptor, Errno> {
-        self.table_mut()
-            .get_mut(usize::try_from(fd).trapping_unwrap())
-            .ok_or(wasi::ERRNO_BADF)
+        let slot = self.slot(fd).ok_or(wasi::ERRNO_BADF)?;
+        Ok(unsafe { &mut *slot })
     }
 
     #[cfg(not(feature = "proxy"))]
@@ -327,6 +434,15 @@ impl Descriptors {
         Ok(())
     }
 
+    // Close every open fd. The table holds no handles afterwards, but it isn't freed.
+    #[cfg(feature = "snapshot")]
+    pub fn close_all(&mut self) {
+        for fd in 0..self.table_len.get() {
+            // Already closed fds are skipped with ERRNO_BADF.
+            let _ = self.close(fd);
+        }
+    }
+
     // Expand the table by pushing a closed descriptor to the end. Used for renumbering.
     fn push_closed(&mut self) -> Result<(), Errno> {
         let old_closed = self.closed;
@@ -339,8 +455,12 @@ impl Descriptors {
     pub fn renumber(&mut self, from_fd: Fd, to_fd: Fd) -> Result<(), Errno> {
         // First, ensure from_fd is in bounds:
         let _ = self.get(from_fd)?;
+        // Refuse fds the table can never grow to, before expanding it.
+        if usize::try_from(to_fd).trapping_unwrap() >= MAX_TABLE_LEN {
+            return Err(wasi::ERRNO_BADF);
+        }
         // Expand table until to_fd is in bounds as well:
-        while self.table_len.get() as u32 <= to_fd {
+        while self.table_len.get() <= to_fd {
             self.push_closed()?;
         }
         // Then, close from_fd and put its contents into to_fd:
@@ -419,6 +539,20 @@ impl Descriptors {
         self.get_stream_with_error_mut(fd, wasi::ERRNO_SPIPE)
     }
 
+    pub fn get_read_pollable(&self, fd: Fd) -> Result<&Pollable, Errno> {
+        match self.get(fd)? {
+            Descriptor::Streams(streams) => streams.get_read_pollable(),
+            Descriptor::Closed(_) | Descriptor::Bad => Err(wasi::ERRNO_BADF),
+        }
+    }
+
+    pub fn get_write_pollable(&self, fd: Fd) -> Result<&Pollable, Errno> {
+        match self.get(fd)? {
+            Descriptor::Streams(streams) => streams.get_write_pollable(),
+            Descriptor::Closed(_) | Descriptor::Bad => Err(wasi::ERRNO_BADF),
+        }
+    }
+
     pub fn get_read_stream(&self, fd: Fd) -> Result<&InputStream, Errno> {
         match self.get(fd)? {
             Descriptor::Streams(streams) => streams.get_read_stream(),
@@ -109,6 +109,12 @@ pub unsafe extern "C" fn run() -> u32 {
     0
 }
 
+// The main module's allocator, used for all the memory the adapter keeps.
+#[link(wasm_import_module = "__main_module__")]
+extern "C" {
+    fn cabi_realloc(old_ptr: *mut u8, old_len: usize, align: usize, new_len: usize) -> *mut u8;
+}
+
 #[cfg(feature = "proxy")]
 macro_rules! cfg_filesystem_available {
     ($($t:tt)*) => {
@@ -173,6 +179,41 @@ pub unsafe extern "C" fn reset_adapter_state() {
     }
 }
 
+/// Prepare the adapter state for a snapshot of the instance, wizer-style, taken
+/// after this returns.
+///
+/// The state is allocated, and the arguments and environment variables are
+/// imported into the long-lived arena, so instances started from the snapshot
+/// don't need to do either. Resource handles belong to the instance that created
+/// them and can't be part of a snapshot, so all descriptors are closed here.
+/// Instances started from the snapshot open stdio and the preopens again on
+/// first use.
+#[no_mangle]
+#[cfg(feature = "snapshot")]
+pub unsafe extern "C" fn adapter_snapshot_state() {
+    State::with(|state| {
+        #[cfg(not(feature = "proxy"))]
+        {
+            let _ = state.get_args();
+            let _ = state.get_environment();
+            drop(state.dirent_cache.stream.replace(None));
+        }
+        let mut descriptors = state
+            .descriptors
+            .try_borrow_mut()
+            .unwrap_or_else(|_| unreachable!());
+        // The table doesn't drop its entries, so they are closed one by one.
+        if let Some(descriptors) = descriptors.as_mut() {
+            descriptors.close_all();
+        }
+        *descriptors = None;
+        // Instances started from the snapshot mustn't share random bytes.
+        #[cfg(feature = "random-pool")]
+        state.random_pool.clear();
+        Ok(())
+    });
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn cabi_import_realloc(
     old_ptr: *mut u8,
@@ -191,11 +232,22 @@ pub unsafe extern "C" fn cabi_import_realloc(
     ptr
 }
 
+/// Minimum size of the chunks a `BumpArena` allocates once its inline memory is used up.
+const BUMP_ARENA_CHUNK_SIZE: usize = 64 * 1024;
+
 /// Bump-allocated memory arena. This is a singleton - the
 /// memory will be sized according to `bump_arena_size()`.
+///
+/// Once the inline memory is used up, allocations are served from chunks
+/// obtained from the main module's allocator. Allocations are never freed, so
+/// only the latest chunk needs to be remembered.
 pub struct BumpArena {
     data: MaybeUninit<[u8; bump_arena_size()]>,
     position: Cell<usize>,
+    /// Next free address in the current chunk, or zero before the first one.
+    chunk_next: Cell<usize>,
+    /// End address of the current chunk.
+    chunk_end: Cell<usize>,
 }
 
 impl BumpArena {
@@ -203,6 +255,8 @@ impl BumpArena {
         BumpArena {
             data: MaybeUninit::uninit(),
             position: Cell::new(0),
+            chunk_next: Cell::new(0),
+            chunk_end: Cell::new(0),
         }
     }
     fn alloc(&self, align: usize, size: usize) -> *mut u8 {
@@ -210,11 +264,36 @@ impl BumpArena {
         let next = start + self.position.get();
         let alloc = align_to(next, align);
         let offset = alloc - start;
-        if offset + size > bump_arena_size() {
+        if offset + size <= bump_arena_size() {
+            self.position.set(offset + size);
+            return alloc as *mut u8;
+        }
+        self.alloc_chunked(align, size)
+    }
+
+    /// Allocate from the current chunk, allocating a new one if it doesn't fit.
+    #[cold]
+    fn alloc_chunked(&self, align: usize, size: usize) -> *mut u8 {
+        if self.chunk_next.get() != 0 {
+            let alloc = align_to(self.chunk_next.get(), align);
+            let end = alloc.checked_add(size).trapping_unwrap();
+            if end <= self.chunk_end.get() {
+                self.chunk_next.set(end);
+                return alloc as *mut u8;
+            }
+        }
+
+        // The rest of the current chunk is abandoned, which wastes little as long
+        // as allocations are small compared to chunks.
+        let chunk_size = size.max(BUMP_ARENA_CHUNK_SIZE);
+        let chunk = unsafe { cabi_realloc(ptr::null_mut(), 0, align, chunk_size) };
+        if chunk.is_null() {
             unreachable!("out of memory");
         }
-        self.position.set(offset + size);
-        alloc as *mut u8
+        let chunk = chunk as usize;
+        self.chunk_next.set(chunk + size);
+        self.chunk_end.set(chunk + chunk_size);
+        chunk as *mut u8
     }
 }
 fn align_to(ptr: usize, align: usize) -> usize {
@@ -304,11 +383,9 @@ impl ImportAlloc {
 
 /// This allocator is only used for the `run` entrypoint.
 ///
-/// The implementation here is a bump allocator into `State::long_lived_arena` which
-/// traps when it runs out of data. This means that the total size of
-/// arguments/env/etc coming into a component is bounded by the current 64k
-/// (ish) limit. That's just an implementation limit though which can be lifted
-/// by dynamically calling the main module's allocator as necessary for more data.
+/// The implementation here is a bump allocator into `State::long_lived_arena`. Its
+/// inline memory covers the common case of small arguments/env/etc coming into a
+/// component, anything more is allocated by the main module's allocator.
 #[no_mangle]
 pub unsafe extern "C" fn cabi_export_realloc(
     old_ptr: *mut u8,
@@ -858,46 +935,73 @@ pub unsafe extern "C" fn fd_filestat_set_times(
 #[no_mangle]
 pub unsafe extern "C" fn fd_pread(
     fd: Fd,
-    mut iovs_ptr: *const Iovec,
-    mut iovs_len: usize,
+    iovs_ptr: *const Iovec,
+    iovs_len: usize,
     offset: Filesize,
     nread: *mut Size,
 ) -> Errno {
     cfg_filesystem_available! {
-        // Advance to the first non-empty buffer.
-        while iovs_len != 0 && (*iovs_ptr).buf_len == 0 {
-            iovs_ptr = iovs_ptr.add(1);
-            iovs_len -= 1;
-        }
         if iovs_len == 0 {
             *nread = 0;
             return ERRNO_SUCCESS;
         }
+        let iovs = slice::from_raw_parts(iovs_ptr, iovs_len);
+        if iovs.iter().all(|iov| iov.buf_len == 0) {
+            *nread = 0;
+            return ERRNO_SUCCESS;
+        }
 
         State::with(|state| {
-            let ptr = (*iovs_ptr).buf;
-            let len = (*iovs_ptr).buf_len;
-
             let ds = state.descriptors();
             let file = ds.get_file(fd)?;
-            let (data, end) = state
-                .import_alloc
-                .with_buffer(ptr, len, || file.fd.read(len as u64, offset))?;
-            assert_eq!(data.as_ptr(), ptr);
-            assert!(data.len() <= len);
-
-            let len = data.len();
-            forget(data);
-            if !end && len == 0 {
-                Err(ERRNO_INTR)
-            } else {
-                *nread = len;
-                Ok(())
-            }
+            *nread = read_at(&state.import_alloc, file, iovs, offset)?;
+            Ok(())
         })
     }
 }
 
+/// Read from `file` at `offset` into the buffers of `iovs`, filling them in order
+/// until the end of the file or a short read. Returns the number of bytes read.
+#[cfg(not(feature = "proxy"))]
+unsafe fn read_at(
+    import_alloc: &ImportAlloc,
+    file: &File,
+    iovs: &[Iovec],
+    offset: Filesize,
+) -> Result<usize, Errno> {
+    let mut total = 0;
+    let mut end = false;
+    for iov in iovs.iter().filter(|iov| iov.buf_len != 0) {
+        let ptr = iov.buf;
+        let len = iov.buf_len;
+        let offset = offset + total as Filesize;
+
+        let (data, at_end) =
+            match import_alloc.with_buffer(ptr, len, || file.fd.read(len as u64, offset)) {
+                Ok(res) => res,
+                // Report what was read so far, the error is left for the next call.
+                Err(_) if total > 0 => break,
+                Err(e) => Err(e)?,
+            };
+        assert_eq!(data.as_ptr(), ptr);
+        assert!(data.len() <= len);
+
+        let read = data.len();
+        forget(data);
+        total += read;
+        end = at_end;
+        if end || read < len {
+            break;
+        }
+    }
+
+    if !end && total == 0 {
+        Err(ERRNO_INTR)
+    } else {
+        Ok(total)
+    }
+}
+
 /// Return a description of the given preopened file descriptor.
 #[no_mangle]
 pub unsafe extern "C" fn fd_prestat_get(fd: Fd, buf: *mut Prestat) -> Errno {
@@ -988,22 +1092,19 @@ pub unsafe extern "C" fn fd_pwrite(
 #[no_mangle]
 pub unsafe extern "C" fn fd_read(
     fd: Fd,
-    mut iovs_ptr: *const Iovec,
-    mut iovs_len: usize,
+    iovs_ptr: *const Iovec,
+    iovs_len: usize,
     nread: *mut Size,
 ) -> Errno {
-    // Advance to the first non-empty buffer.
-    while iovs_len != 0 && (*iovs_ptr).buf_len == 0 {
-        iovs_ptr = iovs_ptr.add(1);
-        iovs_len -= 1;
-    }
     if iovs_len == 0 {
         *nread = 0;
         return ERRNO_SUCCESS;
     }
-
-    let ptr = (*iovs_ptr).buf;
-    let len = (*iovs_ptr).buf_len;
+    let iovs = slice::from_raw_parts(iovs_ptr, iovs_len);
+    if iovs.iter().all(|iov| iov.buf_len == 0) {
+        *nread = 0;
+        return ERRNO_SUCCESS;
+    }
 
     State::with(|state| {
         let ds = state.descriptors();
@@ -1018,38 +1119,68 @@ pub unsafe extern "C" fn fd_read(
                 #[cfg(feature = "proxy")]
                 let blocking_mode = BlockingMode::Blocking;
 
-                let read_len = u64::try_from(len).trapping_unwrap();
-                let wasi_stream = streams.get_read_stream()?;
-                let data = match state
-                    .import_alloc
-                    .with_buffer(ptr, len, || blocking_mode.read(wasi_stream, read_len))
-                {
-                    Ok(data) => data,
-                    Err(streams::StreamError::Closed) => {
-                        *nread = 0;
+                // Regular files are read at the current position without a stream, so
+                // seeking doesn't require creating a new one.
+                #[cfg(not(feature = "proxy"))]
+                if let StreamType::File(file) = &streams.type_ {
+                    if let filesystem::DescriptorType::RegularFile = file.descriptor_type {
+                        let position = file.position.get();
+                        let read = read_at(&state.import_alloc, file, iovs, position)?;
+                        file.position.set(position + read as filesystem::Filesize);
+                        *nread = read;
                         return Ok(());
                     }
-                    Err(streams::StreamError::LastOperationFailed(e)) => {
-                        Err(stream_error_to_errno(e))?
-                    }
-                };
+                }
+
+                let wasi_stream = streams.get_read_stream()?;
+
+                // Fill the buffers in order. Only the first read may block, the
+                // following ones take what the stream already has ready, and reading
+                // stops at the first short read.
+                let mut total = 0;
+                for iov in iovs.iter().filter(|iov| iov.buf_len != 0) {
+                    let ptr = iov.buf;
+                    let len = iov.buf_len;
+                    let mode = if total == 0 {
+                        blocking_mode
+                    } else {
+                        BlockingMode::NonBlocking
+                    };
+
+                    let read_len = u64::try_from(len).trapping_unwrap();
+                    let data = match state
+                        .import_alloc
+                        .with_buffer(ptr, len, || mode.read(wasi_stream, read_len))
+                    {
+                        Ok(data) => data,
+                        Err(streams::StreamError::Closed) => break,
+                        // Report what was read so far, the error is left for the next
+                        // call.
+                        Err(streams::StreamError::LastOperationFailed(_)) if total > 0 => break,
+                        Err(streams::StreamError::LastOperationFailed(e)) => {
+                            Err(stream_error_to_errno(e))?
+                        }
+                    };
+
+                    assert_eq!(data.as_ptr(), ptr);
+                    assert!(data.len() <= len);
 
-                assert_eq!(data.as_ptr(), ptr);
-                assert!(data.len() <= len);
+                    let read = data.len();
+                    forget(data);
+                    total += read;
+                    if read < len {
+                        break;
+                    }
+                }
 
                 // If this is a file, keep the current-position pointer up to date.
                 #[cfg(not(feature = "proxy"))]
                 if let StreamType::File(file) = &streams.type_ {
                     file.position
-                        .set(file.position.get() + data.len() as filesystem::Filesize);
-                    if len == 0 {
-                        return Err(ERRNO_INTR);
-                    }
+                        .set(file.position.get() + total as filesystem::Filesize);
                 }
 
-                let len = data.len();
-                *nread = len;
-                forget(data);
+                *nread = total;
                 Ok(())
             }
             Descriptor::Closed(_) | Descriptor::Bad => Err(ERRNO_BADF),
@@ -1099,134 +1230,151 @@ pub unsafe extern "C" fn fd_readdir(
 ) -> Errno {
     let mut buf = slice::from_raw_parts_mut(buf, buf_len);
     return State::with(|state| {
-        // First determine if there's an entry in the dirent cache to use. This
-        // is done to optimize the use case where a large directory is being
-        // used with a fixed-sized buffer to avoid re-invoking the `readdir`
-        // function and continuing to use the same iterator.
-        //
-        // This is a bit tricky since the requested state in this function call
-        // must match the prior state of the dirent stream, if any, so that's
-        // all validated here as well.
+        // Directory entries are prefetched in batches into the dirent cache, in
+        // the same format as they're returned, and copied from there into `buf`.
+        // The cache keeps the entries that didn't fit along with the stream
+        // positioned after them. This optimizes the use case where a large
+        // directory is being read with a fixed-sized buffer: the next call
+        // resumes from the cache without rewinding the stream, and copies whole
+        // batches of entries at once.
         //
         // Note that for the duration of this function the `cookie` specifier is
         // the `n`th iteration of the `readdir` stream return value.
-        let prev_stream = state.dirent_cache.stream.replace(None);
-        let stream =
-            if state.dirent_cache.for_fd.get() == fd && state.dirent_cache.cookie.get() == cookie {
-                prev_stream
-            } else {
-                None
-            };
+        let cache = &state.dirent_cache;
 
         // Compute the inode of `.` so that the iterator can produce an entry
         // for it.
         let ds = state.descriptors();
         let dir = ds.get_dir(fd)?;
 
-        let mut iter;
-        match stream {
-            // All our checks passed and a dirent cache was available with a
-            // prior stream. Construct an iterator which will yield its first
-            // entry from cache and is additionally resuming at the `cookie`
-            // specified.
-            Some(stream) => {
-                iter = DirectoryEntryIterator {
-                    stream,
+        let prev_stream = cache.stream.replace(None);
+        let mut iter = match prev_stream {
+            // The cache is for this directory and doesn't start past the
+            // requested `cookie`, so the iterator resumes after the cached
+            // entries.
+            Some(stream) if cache.for_fd.get() == fd && cache.cookie.get() <= cookie => {
+                DirectoryEntryIterator {
                     state,
-                    cookie,
-                    use_cache: true,
+                    cookie: cache.next_cookie.get(),
+                    stream,
                     dir_descriptor: &dir.fd,
                 }
             }
 
-            // Either a dirent stream wasn't previously available, a different
+            // Either a dirent stream wasn't previously available, an earlier
             // cookie was requested, or a brand new directory is now being read.
             // In these situations fall back to resuming reading the directory
-            // from scratch, and the `cookie` value indicates how many items
-            // need skipping.
-            None => {
-                iter = DirectoryEntryIterator {
+            // from scratch.
+            _ => {
+                cache.for_fd.set(fd);
+                cache.cookie.set(wasi::DIRCOOKIE_START);
+                cache.start.set(0);
+                cache.end.set(0);
+                cache.done.set(false);
+                DirectoryEntryIterator {
                     state,
                     cookie: wasi::DIRCOOKIE_START,
-                    use_cache: false,
                     stream: DirectoryEntryStream(dir.fd.read_directory()?),
                     dir_descriptor: &dir.fd,
-                };
-
-                // Skip to the entry that is requested by the `cookie`
-                // parameter.
-                for _ in wasi::DIRCOOKIE_START..cookie {
-                    match iter.next() {
-                        Some(Ok(_)) => {}
-                        Some(Err(e)) => return Err(e),
-                        None => return Ok(()),
-                    }
                 }
             }
         };
 
-        while buf.len() > 0 {
-            let (dirent, name) = match iter.next() {
-                Some(Ok(pair)) => pair,
+        // Skip to the entry that is requested by the `cookie` parameter, first
+        // through the cached entries and then through the stream.
+        while cache.cookie.get() < cookie && cache.start.get() < cache.end.get() {
+            cache
+                .start
+                .set(cache.start.get() + cache.entry_len(cache.start.get()));
+            cache.cookie.set(cache.cookie.get() + 1);
+        }
+        while cache.cookie.get() < cookie && !cache.done.get() {
+            match iter.next() {
+                Some(Ok(_)) => cache.cookie.set(iter.cookie),
                 Some(Err(e)) => return Err(e),
-                None => break,
-            };
+                None => cache.done.set(true),
+            }
+        }
 
-            // Copy a `dirent` describing this entry into the destination `buf`,
-            // truncating it if it doesn't fit entirely.
-            let bytes = slice::from_raw_parts(
-                (&dirent as *const wasi::Dirent).cast::<u8>(),
-                size_of::<Dirent>(),
-            );
-            let dirent_bytes_to_copy = buf.len().min(bytes.len());
-            buf[..dirent_bytes_to_copy].copy_from_slice(&bytes[..dirent_bytes_to_copy]);
-            buf = &mut buf[dirent_bytes_to_copy..];
-
-            // Copy the name bytes into the output `buf`, truncating it if it
-            // doesn't fit.
-            //
-            // Note that this might be a 0-byte copy if the `dirent` was
-            // truncated or fit entirely into the destination.
-            let name_bytes_to_copy = buf.len().min(name.len());
-            ptr::copy_nonoverlapping(name.as_ptr().cast(), buf.as_mut_ptr(), name_bytes_to_copy);
-
-            buf = &mut buf[name_bytes_to_copy..];
-
-            // If the buffer is empty then that means the value may be
-            // truncated, so save the state of the iterator in our dirent cache
-            // and return.
-            //
-            // Note that `cookie - 1` is stored here since `iter.cookie` stores
-            // the address of the next item, and we're rewinding one item since
-            // the current item is truncated and will want to resume from that
-            // in the future.
-            //
-            // Additionally note that this caching step is skipped if the name
-            // to store doesn't actually fit in the dirent cache's path storage.
-            // In that case there's not much we can do and let the next call to
-            // `fd_readdir` start from scratch.
-            if buf.len() == 0 && name.len() <= DIRENT_CACHE {
-                let DirectoryEntryIterator { stream, cookie, .. } = iter;
-                state.dirent_cache.stream.set(Some(stream));
-                state.dirent_cache.for_fd.set(fd);
-                state.dirent_cache.cookie.set(cookie - 1);
-                state.dirent_cache.cached_dirent.set(dirent);
-                ptr::copy(
-                    name.as_ptr().cast::<u8>(),
-                    (*state.dirent_cache.path_data.get()).as_mut_ptr() as *mut u8,
-                    name.len(),
-                );
+        while buf.len() > 0 {
+            if cache.start.get() == cache.end.get() {
+                if cache.done.get() {
+                    break;
+                }
+                cache.prefetch(&mut iter)?;
+                if cache.start.get() == cache.end.get() {
+                    break;
+                }
+            }
+
+            // Copy the next entry into the destination `buf`, truncating it if
+            // it doesn't fit entirely. A truncated entry stays cached, so that
+            // the next call can resume from it.
+            let start = cache.start.get();
+            let len = cache.entry_len(start);
+            let bytes_to_copy = buf.len().min(len);
+            ptr::copy_nonoverlapping(cache.data.get().add(start), buf.as_mut_ptr(), bytes_to_copy);
+            buf = &mut buf[bytes_to_copy..];
+
+            if bytes_to_copy < len {
                 break;
             }
+            cache.start.set(start + len);
+            cache.cookie.set(cache.cookie.get() + 1);
         }
 
+        let DirectoryEntryIterator { stream, cookie, .. } = iter;
+        cache.next_cookie.set(cookie);
+        cache.stream.set(Some(stream));
+
         *bufused = buf_len - buf.len();
         Ok(())
     });
 
+    impl DirentCache {
+        /// Return the length of the cached entry at offset `start`.
+        unsafe fn entry_len(&self, start: usize) -> usize {
+            let dirent = ptr::read_unaligned(self.data.get().add(start).cast::<wasi::Dirent>());
+            size_of::<wasi::Dirent>() + dirent.d_namlen as usize
+        }
+
+        /// Read a batch of entries from `iter` into the cache, which must be empty,
+        /// for as long as an entry with the longest name still fits.
+        unsafe fn prefetch(&self, iter: &mut DirectoryEntryIterator<'_>) -> Result<(), Errno> {
+            if self.data.get().is_null() {
+                let data = iter
+                    .state
+                    .long_lived_arena
+                    .alloc(align_of::<wasi::Dirent>(), DIRENT_CACHE);
+                self.data.set(data);
+            }
+            let data = self.data.get();
+
+            let mut end = 0;
+            while end + size_of::<wasi::Dirent>() + PATH_MAX <= DIRENT_CACHE {
+                let (dirent, name) = match iter.next() {
+                    Some(Ok(pair)) => pair,
+                    Some(Err(e)) => return Err(e),
+                    None => {
+                        self.done.set(true);
+                        break;
+                    }
+                };
+
+                ptr::write_unaligned(data.add(end).cast::<wasi::Dirent>(), dirent);
+                end += size_of::<wasi::Dirent>();
+                ptr::copy_nonoverlapping(name.as_ptr().cast::<u8>(), data.add(end), name.len());
+                end += name.len();
+            }
+
+            self.start.set(0);
+            self.end.set(end);
+            Ok(())
+        }
+    }
+
     struct DirectoryEntryIterator<'a> {
         state: &'a State,
-        use_cache: bool,
         cookie: Dircookie,
         stream: DirectoryEntryStream,
         dir_descriptor: &'a filesystem::Descriptor,
@@ -1270,17 +1418,6 @@ pub unsafe extern "C" fn fd_readdir(
                 _ => {}
             }
 
-            if self.use_cache {
-                self.use_cache = false;
-                return Some(unsafe {
-                    let dirent = self.state.dirent_cache.cached_dirent.as_ptr().read();
-                    let ptr = (*(*self.state.dirent_cache.path_data.get()).as_ptr())
-                        .as_ptr()
-                        .cast();
-                    let buffer = slice::from_raw_parts(ptr, dirent.d_namlen as usize);
-                    Ok((dirent, buffer))
-                });
-            }
             let entry = self.state.import_alloc.with_buffer(
                 self.state.path_buf.get().cast(),
                 PATH_MAX,
@@ -1362,10 +1499,16 @@ pub unsafe extern "C" fn fd_seek(
                     },
                     _ => return Err(ERRNO_INVAL),
                 };
-                drop(stream.input.take());
-                drop(stream.output.take());
-                file.position.set(from as filesystem::Filesize);
-                *newoffset = from as filesystem::Filesize;
+                let position = from as filesystem::Filesize;
+                // `fd_read` moves the position without going through the streams, so
+                // they may be behind it even if the position doesn't change. Appending
+                // streams don't depend on the position at all.
+                stream.drop_input();
+                if !file.append {
+                    stream.drop_output();
+                }
+                file.position.set(position);
+                *newoffset = position;
                 Ok(())
             } else {
                 Err(ERRNO_SPIPE)
@@ -1407,8 +1550,8 @@ pub unsafe extern "C" fn fd_tell(fd: Fd, offset: *mut Filesize) -> Errno {
 #[no_mangle]
 pub unsafe extern "C" fn fd_write(
     fd: Fd,
-    mut iovs_ptr: *const Ciovec,
-    mut iovs_len: usize,
+    iovs_ptr: *const Ciovec,
+    iovs_len: usize,
     nwritten: *mut Size,
 ) -> Errno {
     if !matches!(
@@ -1419,19 +1562,15 @@ pub unsafe extern "C" fn fd_write(
         return ERRNO_IO;
     }
 
-    // Advance to the first non-empty buffer.
-    while iovs_len != 0 && (*iovs_ptr).buf_len == 0 {
-        iovs_ptr = iovs_ptr.add(1);
-        iovs_len -= 1;
-    }
     if iovs_len == 0 {
         *nwritten = 0;
         return ERRNO_SUCCESS;
     }
-
-    let ptr = (*iovs_ptr).buf;
-    let len = (*iovs_ptr).buf_len;
-    let bytes = slice::from_raw_parts(ptr, len);
+    let iovs = slice::from_raw_parts(iovs_ptr, iovs_len);
+    if iovs.iter().all(|iov| iov.buf_len == 0) {
+        *nwritten = 0;
+        return ERRNO_SUCCESS;
+    }
 
     State::with(|state| {
         let ds = state.descriptors();
@@ -1441,14 +1580,14 @@ pub unsafe extern "C" fn fd_write(
 
                 #[cfg(not(feature = "proxy"))]
                 let nbytes = if let StreamType::File(file) = &streams.type_ {
-                    file.blocking_mode.write(wasi_stream, bytes)?
+                    file.blocking_mode.write(wasi_stream, iovs)?
                 } else {
                     // Use blocking writes on non-file streams (stdout, stderr, as sockets
                     // aren't currently used).
-                    BlockingMode::Blocking.write(wasi_stream, bytes)?
+                    BlockingMode::Blocking.write(wasi_stream, iovs)?
                 };
                 #[cfg(feature = "proxy")]
-                let nbytes = BlockingMode::Blocking.write(wasi_stream, bytes)?;
+                let nbytes = BlockingMode::Blocking.write(wasi_stream, iovs)?;
 
                 // If this is a file, keep the current-position pointer up
                 // to date. Note that for files that perform appending
@@ -1633,6 +1772,8 @@ pub unsafe extern "C" fn path_open(
                 .open_at(at_flags, path, o_flags, flags)?;
             let descriptor_type = result.get_type()?;
             let desc = Descriptor::Streams(Streams {
+                read_pollable: OnceCell::new(),
+                write_pollable: OnceCell::new(),
                 input: OnceCell::new(),
                 output: OnceCell::new(),
                 type_: StreamType::File(File {
@@ -1798,6 +1939,8 @@ struct Pollables {
     pointer: *mut Pollable,
     index: usize,
     length: usize,
+    /// Subscriptions the pollables are for, telling which ones are owned.
+    subscriptions: *const Subscription,
 }
 
 impl Pollables {
@@ -1808,16 +1951,25 @@ impl Pollables {
         self.pointer.add(self.index).write(pollable);
         self.index += 1;
     }
+
+    /// Push a copy of a pollable owned by a descriptor, which is not dropped with
+    /// the others.
+    unsafe fn push_borrowed(&mut self, pollable: &Pollable) {
+        self.push(ptr::read(pollable));
+    }
 }
 
-// We create new pollable handles for each `poll_oneoff` call, so drop them all
-// after the call.
+// Clock pollables are created for each `poll_oneoff` call, so drop them after
+// the call. Stream pollables are cached by their descriptor and reused by the
+// following calls.
 impl Drop for Pollables {
     fn drop(&mut self) {
         while self.index != 0 {
             self.index -= 1;
             unsafe {
-                core::ptr::drop_in_place(self.pointer.add(self.index));
+                if (*self.subscriptions.add(self.index)).u.tag == wasi::EVENTTYPE_CLOCK.raw() {
+                    core::ptr::drop_in_place(self.pointer.add(self.index));
+                }
             }
         }
     }
@@ -1875,10 +2027,11 @@ pub unsafe extern "C" fn poll_oneoff(
             pointer: pollables,
             index: 0,
             length: nsubscriptions,
+            subscriptions: subscriptions.as_ptr(),
         };
 
         for subscription in subscriptions {
-            pollables.push(match subscription.u.tag {
+            let pollable = match subscription.u.tag {
                 EVENTTYPE_CLOCK => {
                     let clock = &subscription.u.u.clock;
                     let absolute = (clock.flags & SUBCLOCKFLAGS_SUBSCRIPTION_CLOCK_ABSTIME)
@@ -1928,18 +2081,23 @@ pub unsafe extern "C" fn poll_oneoff(
                     }
                 }
 
-                EVENTTYPE_FD_READ => state
-                    .descriptors()
-                    .get_read_stream(subscription.u.u.fd_read.file_descriptor)
-                    .map(|stream| stream.subscribe())?,
+                EVENTTYPE_FD_READ => {
+                    let ds = state.descriptors();
+                    let fd = subscription.u.u.fd_read.file_descriptor;
+                    pollables.push_borrowed(ds.get_read_pollable(fd)?);
+                    continue;
+                }
 
-                EVENTTYPE_FD_WRITE => state
-                    .descriptors()
-                    .get_write_stream(subscription.u.u.fd_write.file_descriptor)
-                    .map(|stream| stream.subscribe())?,
+                EVENTTYPE_FD_WRITE => {
+                    let ds = state.descriptors();
+                    let fd = subscription.u.u.fd_write.file_descriptor;
+                    pollables.push_borrowed(ds.get_write_pollable(fd)?);
+                    continue;
+                }
 
                 _ => return Err(ERRNO_INVAL),
-            });
+            };
+            pollables.push(pollable);
         }
 
         #[link(wasm_import_module = "wasi:io/poll@0.2.0-rc-2023-11-10")]
@@ -2098,6 +2256,15 @@ pub unsafe extern "C" fn random_get(buf: *mut u8, buf_len: Size) -> Errno {
     ) {
         State::with(|state| {
             assert_eq!(buf_len as u32 as Size, buf_len);
+
+            // Small requests are served from the pool, large ones directly by the
+            // host.
+            #[cfg(feature = "random-pool")]
+            if buf_len < RANDOM_POOL_SIZE {
+                state.random_pool.fill(&state.import_alloc, buf, buf_len);
+                return Ok(());
+            }
+
             let result = state
                 .import_alloc
                 .with_buffer(buf, buf_len, || random::get_random_bytes(buf_len as u64));
@@ -2114,6 +2281,56 @@ pub unsafe extern "C" fn random_get(buf: *mut u8, buf_len: Size) -> Errno {
     }
 }
 
+/// Number of random bytes `random_get` fetches from the host at once.
+#[cfg(feature = "random-pool")]
+const RANDOM_POOL_SIZE: usize = 512;
+
+/// Random bytes fetched from the host in chunks, to serve small `random_get`
+/// requests without a host call each.
+///
+/// Bytes are erased from the pool as soon as they're handed out, so the pool
+/// never holds random data that is in use elsewhere.
+#[cfg(feature = "random-pool")]
+struct RandomPool {
+    data: UnsafeCell<[u8; RANDOM_POOL_SIZE]>,
+    /// Offset of the first byte not handed out yet.
+    position: Cell<usize>,
+}
+
+#[cfg(feature = "random-pool")]
+impl RandomPool {
+    /// Fill `len` bytes at `buf` from the pool, refilling it as needed.
+    unsafe fn fill(&self, import_alloc: &ImportAlloc, mut buf: *mut u8, mut len: usize) {
+        let data = self.data.get().cast::<u8>();
+        while len > 0 {
+            if self.position.get() == RANDOM_POOL_SIZE {
+                let result = import_alloc.with_buffer(data, RANDOM_POOL_SIZE, || {
+                    random::get_random_bytes(RANDOM_POOL_SIZE as u64)
+                });
+                assert_eq!(result.as_ptr(), data);
+                assert_eq!(result.len(), RANDOM_POOL_SIZE);
+                forget(result);
+                self.position.set(0);
+            }
+
+            let position = self.position.get();
+            let n = len.min(RANDOM_POOL_SIZE - position);
+            ptr::copy_nonoverlapping(data.add(position), buf, n);
+            ptr::write_bytes(data.add(position), 0, n);
+            self.position.set(position + n);
+            buf = buf.add(n);
+            len -= n;
+        }
+    }
+
+    /// Erase the bytes left in the pool.
+    #[cfg(feature = "snapshot")]
+    fn clear(&self) {
+        unsafe { ptr::write_bytes(self.data.get().cast::<u8>(), 0, RANDOM_POOL_SIZE) };
+        self.position.set(RANDOM_POOL_SIZE);
+    }
+}
+
 /// Accept a new incoming connection.
 /// Note: This is similar to `accept` in POSIX.
 #[no_mangle]
@@ -2301,61 +2518,84 @@ impl BlockingMode {
             BlockingMode::Blocking => input_stream.blocking_read(read_len),
         }
     }
-    fn write(
+    /// Writes the buffers of `iovs` to `output_stream`, returning the number of bytes
+    /// written.
+    ///
+    /// As many bytes as the stream's `check_write` permit allows are written with a
+    /// single host call, across buffer boundaries, and the stream is flushed once at
+    /// the end instead of after every chunk. In non-blocking mode, writing stops as
+    /// soon as the stream has no room left and the flush is started but not waited
+    /// for.
+    ///
+    /// Safety: the buffers of `iovs` must be valid for reads.
+    unsafe fn write(
         self,
         output_stream: &streams::OutputStream,
-        mut bytes: &[u8],
+        iovs: &[Ciovec],
     ) -> Result<usize, Errno> {
-        match self {
-            BlockingMode::Blocking => {
-                let total = bytes.len();
-                while !bytes.is_empty() {
-                    let len = bytes.len().min(4096);
-                    let (chunk, rest) = bytes.split_at(len);
-                    bytes = rest;
-                    match output_stream.blocking_write_and_flush(chunk) {
-                        Ok(()) => {}
-                        Err(streams::StreamError::Closed) => return Err(ERRNO_IO),
-                        Err(streams::StreamError::LastOperationFailed(e)) => {
-                            return Err(stream_error_to_errno(e))
-                        }
-                    }
-                }
-                Ok(total)
+        let mut total = 0;
+
+        'iovs: for iov in iovs {
+            if iov.buf_len == 0 {
+                continue;
             }
+            let mut bytes = slice::from_raw_parts(iov.buf, iov.buf_len);
 
-            BlockingMode::NonBlocking => {
+            while !bytes.is_empty() {
                 let permit = match output_stream.check_write() {
+                    Ok(0) => match self {
+                        BlockingMode::Blocking => {
+                            // Wait for the stream to make room, it becomes ready once
+                            // the previous writes are flushed.
+                            output_stream.subscribe().block();
+                            continue;
+                        }
+                        BlockingMode::NonBlocking => break 'iovs,
+                    },
                     Ok(n) => n,
-                    Err(streams::StreamError::Closed) => 0,
-                    Err(streams::StreamError::LastOperationFailed(e)) => {
-                        return Err(stream_error_to_errno(e))
-                    }
+                    Err(e) => return self.write_failed(total, e),
                 };
 
-                let len = bytes.len().min(permit as usize);
-                if len == 0 {
-                    return Ok(0);
+                let len = bytes
+                    .len()
+                    .min(usize::try_from(permit).unwrap_or(usize::MAX));
+                let (chunk, rest) = bytes.split_at(len);
+                if let Err(e) = output_stream.write(chunk) {
+                    return self.write_failed(total, e);
                 }
+                bytes = rest;
+                total += len;
+            }
+        }
 
-                match output_stream.write(&bytes[..len]) {
-                    Ok(_) => {}
-                    Err(streams::StreamError::Closed) => return Ok(0),
-                    Err(streams::StreamError::LastOperationFailed(e)) => {
-                        return Err(stream_error_to_errno(e))
-                    }
-                }
+        if total == 0 {
+            return Ok(0);
+        }
 
-                match output_stream.blocking_flush() {
-                    Ok(_) => {}
-                    Err(streams::StreamError::Closed) => return Ok(0),
-                    Err(streams::StreamError::LastOperationFailed(e)) => {
-                        return Err(stream_error_to_errno(e))
-                    }
-                }
+        let flushed = match self {
+            BlockingMode::Blocking => output_stream.blocking_flush(),
+            BlockingMode::NonBlocking => output_stream.flush(),
+        };
+        match flushed {
+            Ok(()) => Ok(total),
+            Err(e) => self.write_failed(total, e),
+        }
+    }
 
-                Ok(len)
-            }
+    /// Returns the result of a write that failed with `error` after `written` bytes
+    /// were written. As with POSIX `writev`, a partial write is reported as such and
+    /// the error is left for the next call to report.
+    fn write_failed(self, written: usize, error: streams::StreamError) -> Result<usize, Errno> {
+        if written > 0 {
+            return Ok(written);
+        }
+
+        match error {
+            streams::StreamError::Closed => match self {
+                BlockingMode::Blocking => Err(ERRNO_IO),
+                BlockingMode::NonBlocking => Ok(0),
+            },
+            streams::StreamError::LastOperationFailed(e) => Err(stream_error_to_errno(e)),
         }
     }
 }
@@ -2398,8 +2638,10 @@ const PAGE_SIZE: usize = 65536;
 /// polyfill.
 const PATH_MAX: usize = 4096;
 
-/// Maximum number of bytes to cache for a `wasi::Dirent` plus its path name.
-const DIRENT_CACHE: usize = 256;
+/// Size of the buffer `fd_readdir` prefetches directory entries into, which holds
+/// at least a few entries with the longest path names.
+#[cfg(not(feature = "proxy"))]
+const DIRENT_CACHE: usize = 4 * (size_of::<wasi::Dirent>() + PATH_MAX);
 
 /// A canary value to detect memory corruption within `State`.
 const MAGIC: u32 = u32::from_le_bytes(*b"ugh!");
@@ -2442,11 +2684,15 @@ struct State {
     #[cfg(not(feature = "proxy"))]
     env_vars: Cell<Option<&'static [StrTuple]>>,
 
-    /// Cache for the `fd_readdir` call for a final `wasi::Dirent` plus path
-    /// name that didn't fit into the caller's buffer.
+    /// Cache for the `fd_readdir` call of the directory entries prefetched but
+    /// not yet returned to the caller.
     #[cfg(not(feature = "proxy"))]
     dirent_cache: DirentCache,
 
+    /// Random bytes fetched ahead of time for `random_get`.
+    #[cfg(feature = "random-pool")]
+    random_pool: RandomPool,
+
     /// The string `..` for use by the directory iterator.
     #[cfg(not(feature = "proxy"))]
     dotdot: [UnsafeCell<u8>; 2],
@@ -2458,11 +2704,22 @@ struct State {
 
 #[cfg(not(feature = "proxy"))]
 struct DirentCache {
+    /// Stream of the directory, positioned after the cached entries.
     stream: Cell<Option<DirectoryEntryStream>>,
     for_fd: Cell<wasi::Fd>,
+    /// Cookie of the first cached entry.
     cookie: Cell<wasi::Dircookie>,
-    cached_dirent: Cell<wasi::Dirent>,
-    path_data: UnsafeCell<MaybeUninit<[u8; DIRENT_CACHE]>>,
+    /// Cookie of the next entry of the stream.
+    next_cookie: Cell<wasi::Dircookie>,
+    /// Whether the stream has no more entries.
+    done: Cell<bool>,
+    /// Cached entries, each a `wasi::Dirent` followed by its name. This buffer of
+    /// `DIRENT_CACHE` bytes is allocated in the long-lived arena on first use.
+    data: Cell<*mut u8>,
+    /// Offset of the first cached entry in `data`.
+    start: Cell<usize>,
+    /// Offset of the end of the cached entries in `data`.
+    end: Cell<usize>,
 }
 
 #[cfg(not(feature = "proxy"))]
@@ -2511,9 +2768,13 @@ const fn bump_arena_size() -> usize {
         start -= PATH_MAX;
         start -= size_of::<DirentCache>();
     }
+    #[cfg(feature = "random-pool")]
+    {
+        start -= size_of::<RandomPool>();
+    }
 
     // Remove miscellaneous metadata also stored in state.
-    let misc = if cfg!(feature = "proxy") { 7 } else { 14 };
+    let misc = if cfg!(feature = "proxy") { 9 } else { 16 };
     start -= misc * size_of::<usize>();
 
     // Everything else is the `command_data` allocation.
@@ -2571,16 +2832,6 @@ impl State {
 
     #[cold]
     fn new() -> *mut State {
-        #[link(wasm_import_module = "__main_module__")]
-        extern "C" {
-            fn cabi_realloc(
-                old_ptr: *mut u8,
-                old_len: usize,
-                align: usize,
-                new_len: usize,
-            ) -> *mut u8;
-        }
-
         assert!(matches!(
             unsafe { get_allocation_state() },
             AllocationState::StackAllocated
@@ -2625,13 +2876,16 @@ impl State {
                 stream: Cell::new(None),
                 for_fd: Cell::new(0),
                 cookie: Cell::new(wasi::DIRCOOKIE_START),
-                cached_dirent: Cell::new(wasi::Dirent {
-                    d_next: 0,
-                    d_ino: 0,
-                    d_type: FILETYPE_UNKNOWN,
-                    d_namlen: 0,
-                }),
-                path_data: UnsafeCell::new(MaybeUninit::uninit()),
+                next_cookie: Cell::new(wasi::DIRCOOKIE_START),
+                done: Cell::new(false),
+                data: Cell::new(null_mut()),
+                start: Cell::new(0),
+                end: Cell::new(0),
+            },
+            #[cfg(feature = "random-pool")]
+            random_pool: RandomPool {
+                data: UnsafeCell::new([0; RANDOM_POOL_SIZE]),
+                position: Cell::new(RANDOM_POOL_SIZE),
             },
             #[cfg(not(feature = "proxy"))]
             dotdot: [UnsafeCell::new(b'.'), UnsafeCell::new(b'.')],